@@ -0,0 +1,195 @@
+#!/bin/bash
+# Benchmark sign, validate and install on a generated tree.
+#
+# Usage: bench.sh [OPTIONS]
+#   --files=N          Number of files to generate (default 2000)
+#   --sizes=SPEC       Size distribution, comma separated SIZE:WEIGHT
+#                      pairs, SIZE in bytes with optional k/m suffix
+#                      (default 1k:60,16k:30,256k:9,4m:1)
+#   --depth=N          Directory depth of the tree (default 3)
+#   --symlinks=PCT     Percentage of the files that are symlinks (default 10)
+#   --keys=N           Number of keys in the key dir, the signing key
+#                      is the last one (default 1)
+#   --jobs=N           Passed on as --jobs (default: validator default)
+#   --readahead=N      Passed on as --readahead (default: validator default)
+#   --runs=N           Runs per operation and cache state (default 3)
+#   --tree=DIR         Generate the tree here and keep it, or if it
+#                      exists, reuse it
+#
+# Each run prints one line of JSON on stdout with the operation, cache
+# state (cold or warm), number of files and bytes, wall time, files/s,
+# MB/s and the p50/p99 per-file processing time in microseconds. Jobs
+# is 0 when the validator default is used.
+#
+# The startup operation is what validator-boot.service does, install
+# --boot of a config dir with one config for a single file and the
+# keys in a compiled keyring, so its time is mostly process startup.
+#
+# Cold runs drop the page cache of the tree with dd iflag=nocache,
+# which works without root but only evicts clean pages.
+
+set -e
+
+VALIDATOR=${BUILDDIR:-.}/validator
+
+N_FILES=2000
+SIZES=1k:60,16k:30,256k:9,4m:1
+DEPTH=3
+SYMLINKS=10
+N_KEYS=1
+JOBS=
+READAHEAD=
+RUNS=3
+TREE=
+
+for arg in "$@"; do
+    case $arg in
+        --files=*) N_FILES=${arg#*=} ;;
+        --sizes=*) SIZES=${arg#*=} ;;
+        --depth=*) DEPTH=${arg#*=} ;;
+        --symlinks=*) SYMLINKS=${arg#*=} ;;
+        --keys=*) N_KEYS=${arg#*=} ;;
+        --jobs=*) JOBS="--jobs=${arg#*=}" ;;
+        --readahead=*) READAHEAD="--readahead=${arg#*=}" ;;
+        --runs=*) RUNS=${arg#*=} ;;
+        --tree=*) TREE=${arg#*=} ;;
+        *) echo "Unknown option $arg" 1>&2; exit 1 ;;
+    esac
+done
+
+TMPDIR=$(mktemp -d /tmp/validator-bench.XXXXXX)
+trap 'rm -rf -- "$TMPDIR"' EXIT
+
+if [ -z "$TREE" ]; then
+    TREE=$TMPDIR/tree
+fi
+KEYDIR=$TMPDIR/keys
+SECKEY=$TMPDIR/secret.pem
+DEST=$TMPDIR/dest
+BOOT=$TMPDIR/boot
+TIMINGS=$TMPDIR/timings
+
+to_bytes () {
+    case $1 in
+        *k) echo $(( ${1%k} * 1024 )) ;;
+        *m) echo $(( ${1%m} * 1024 * 1024 )) ;;
+        *) echo $1 ;;
+    esac
+}
+
+# Expand the size spec into a table of 100 sizes to pick from
+SIZE_TABLE=()
+TOTAL_WEIGHT=0
+for entry in ${SIZES//,/ }; do
+    TOTAL_WEIGHT=$(( TOTAL_WEIGHT + ${entry#*:} ))
+done
+for entry in ${SIZES//,/ }; do
+    size=$(to_bytes ${entry%:*})
+    n=$(( ${entry#*:} * 100 / TOTAL_WEIGHT ))
+    for (( i = 0; i < n; i++ )); do
+        SIZE_TABLE+=($size)
+    done
+done
+
+genkeys () {
+    mkdir -p $KEYDIR
+    for (( i = 1; i <= N_KEYS; i++ )); do
+        openssl genpkey -algorithm ed25519 -outform PEM -out $SECKEY 2> /dev/null
+        openssl pkey -in $SECKEY -pubout -out $KEYDIR/key$i.pem
+    done
+}
+
+gentree () {
+    mkdir -p $TREE
+    RANDOM=42
+    for (( i = 0; i < N_FILES; i++ )); do
+        dir=$TREE
+        for (( d = 0; d < DEPTH; d++ )); do
+            dir=$dir/d$(( (i >> (d * 3)) % 8 ))
+        done
+        mkdir -p $dir
+        if (( i > 0 && RANDOM % 100 < SYMLINKS )); then
+            ln -s target$i $dir/link$i
+        else
+            size=${SIZE_TABLE[$(( RANDOM % ${#SIZE_TABLE[@]} ))]}
+            head -c $size /dev/urandom > $dir/file$i
+        fi
+    done
+}
+
+genboot () {
+    mkdir -p $BOOT/src $BOOT/boot.d
+    echo boot > $BOOT/src/file
+    $VALIDATOR sign --key=$SECKEY $BOOT/src/file
+    $VALIDATOR keyring build --key-dir=$KEYDIR $BOOT/keys.keyring
+    printf '[install]\nkeys=%s\nsources=%s\ndestination=%s\n' \
+           $BOOT/keys.keyring $BOOT/src $BOOT/dest > $BOOT/boot.d/file.conf
+}
+
+drop_caches () {
+    find $TREE $KEYDIR -type f -exec dd if={} iflag=nocache count=0 status=none \;
+}
+
+percentile () {
+    sort -n | awk -v p=$1 '{ v[NR] = $1 } END { if (NR == 0) print 0; else { i = int(NR * p / 100 + 0.999); if (i < 1) i = 1; print v[i] } }'
+}
+
+run () {
+    op=$1
+    cache=$2
+    shift 2
+
+    if [ "$cache" = cold ]; then
+        drop_caches
+    fi
+
+    rm -f $TIMINGS
+    start=$(date +%s%N)
+    $VALIDATOR --timings=$TIMINGS $READAHEAD "$@"
+    end=$(date +%s%N)
+
+    usec=$(( (end - start) / 1000 ))
+    n_files=$(wc -l < $TIMINGS)
+    p50=$(cut -d' ' -f1 $TIMINGS | percentile 50)
+    p99=$(cut -d' ' -f1 $TIMINGS | percentile 99)
+    awk -v op=$op -v cache=$cache -v files=$n_files -v bytes=$RUN_BYTES -v usec=$usec \
+        -v p50=$p50 -v p99=$p99 -v jobs=${JOBS#--jobs=} 'BEGIN {
+        secs = usec / 1000000;
+        printf "{\"operation\": \"%s\", \"cache\": \"%s\", \"jobs\": %d, \"files\": %d, \"bytes\": %d, \"usec\": %d, \"files_per_sec\": %.1f, \"mb_per_sec\": %.1f, \"p50_usec\": %d, \"p99_usec\": %d}\n",
+            op, cache, jobs, files, bytes, usec, files / secs, bytes / 1048576 / secs, p50, p99
+    }'
+}
+
+genkeys
+if [ ! -d $TREE ]; then
+    gentree
+fi
+TREE_BYTES=$(find $TREE -type f -printf '%s\n' | awk '{ s += $1 } END { print s + 0 }')
+RUN_BYTES=$TREE_BYTES
+
+for cache in cold warm; do
+    for (( r = 0; r < RUNS; r++ )); do
+        run sign $cache sign -r -f $JOBS --key=$SECKEY $TREE
+    done
+done
+
+for cache in cold warm; do
+    for (( r = 0; r < RUNS; r++ )); do
+        run validate $cache validate -r $JOBS --key-dir=$KEYDIR $TREE
+    done
+done
+
+for cache in cold warm; do
+    for (( r = 0; r < RUNS; r++ )); do
+        rm -rf $DEST
+        mkdir -p $DEST
+        run install $cache install -r -f $JOBS --key-dir=$KEYDIR $TREE $DEST
+    done
+done
+
+genboot
+RUN_BYTES=$(stat -c %s $BOOT/src/file)
+for (( r = 0; r < RUNS; r++ )); do
+    rm -rf $BOOT/dest
+    run startup warm install --boot --config-dir=$BOOT/boot.d
+done
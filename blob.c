@@ -21,6 +21,85 @@
 #include "config.h"
 #include "main.h"
 
+#include <fcntl.h>
+#include <unistd.h>
+
+/* In stream mode each file gets a record of its path below the
+ * relative dir (without --path-prefix, as that is where import-signatures
+ * writes the signature) and its blob */
+static gboolean
+blob_file (WalkItem *item, gpointer user_data, GError **error)
+{
+  const char *path = item->path;
+
+  g_autofree char *stream_path = opt_get_relative_path (path, item->relative_to, NULL);
+  g_autofree char *rel_path = opt_get_relative_path (path, item->relative_to, opt_path_prefix);
+  if (rel_path == NULL)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "File '%s' not inside relative dir",
+                   path);
+      return FALSE;
+    }
+
+  ValidatorDigestType digest_type = opt_get_digest_type ();
+  int type;
+  g_autofree guchar *content = NULL;
+  gsize content_len = 0;
+  if (!load_file_data_for_sign_at (item->dir_fd, item->name, path, &item->st, digest_type, &type,
+                                   &content, &content_len, -1, error))
+    {
+      g_prefix_error (error, "Failed to load '%s': ", path);
+      return FALSE;
+    }
+
+  gsize blob_size;
+  g_autofree guchar *blob
+      = make_sign_blob (rel_path, type, digest_type, content, content_len, &blob_size, error);
+  if (blob == NULL)
+    return FALSE;
+
+  item->output = g_byte_array_new ();
+  blob_stream_append (item->output, stream_path, blob, blob_size);
+
+  return TRUE;
+}
+
+static int
+blob_stream (int argc, char *argv[])
+{
+  g_autoptr (Walker) walker = walker_new (opt_jobs, blob_file, NULL);
+
+  for (gsize i = 1; i < argc; i++)
+    {
+      g_autofree char *path = g_canonicalize_filename (argv[i], NULL);
+      g_autofree char *dirname = NULL;
+      const char *relative_to;
+
+      if (g_file_test (path, G_FILE_TEST_IS_DIR))
+        {
+          if (!opt_recursive)
+            {
+              walker_finish (walker);
+              g_printerr ("error: '%s' is a directory and not in recursive mode\n", path);
+              return EXIT_FAILURE;
+            }
+
+          relative_to = opt_path_relative ? opt_path_relative : path;
+        }
+      else
+        {
+          dirname = g_path_get_dirname (path);
+          relative_to = opt_path_relative ? opt_path_relative : dirname;
+        }
+
+      walker_walk (walker, path, relative_to, NULL, TRUE);
+    }
+
+  gboolean res = walker_finish (walker);
+
+  return res ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
 int
 cmd_blob (int argc, char *argv[])
 {
@@ -29,8 +108,17 @@ cmd_blob (int argc, char *argv[])
   if (argc == 1)
     help_error ("No input files given");
 
+  /* Checks the options, before any blob is output */
+  opt_get_digest_type ();
+
+  if (opt_stream)
+    return blob_stream (argc, argv);
+
   if (argc > 2)
-    help_error ("Only one file argument supported");
+    help_error ("Only one file argument supported without --stream");
+
+  if (opt_recursive)
+    help_error ("--recursive is only supported with --stream");
 
   g_autofree char *path = g_canonicalize_filename (argv[1], NULL);
   g_autofree char *dirname = g_path_get_dirname (path);
@@ -43,10 +131,12 @@ cmd_blob (int argc, char *argv[])
       return EXIT_FAILURE;
     }
 
+  ValidatorDigestType digest_type = opt_get_digest_type ();
   int type;
   g_autofree guchar *content = NULL;
   gsize content_len = 0;
-  if (!load_file_data_for_sign (path, NULL, &type, &content, &content_len, NULL, &error))
+  if (!load_file_data_for_sign (path, NULL, digest_type, &type, &content, &content_len, -1,
+                                &error))
     {
       g_printerr ("Failed to load '%s': %s\n", path, error->message);
       return EXIT_FAILURE;
@@ -54,7 +144,7 @@ cmd_blob (int argc, char *argv[])
 
   gsize blob_size;
   g_autofree guchar *blob
-      = make_sign_blob (rel_path, type, content, content_len, &blob_size, &error);
+      = make_sign_blob (rel_path, type, digest_type, content, content_len, &blob_size, &error);
   if (blob == NULL)
     {
       g_printerr ("%s\n", error->message);
@@ -70,3 +160,196 @@ cmd_blob (int argc, char *argv[])
 
   return EXIT_SUCCESS;
 }
+
+/* Opens the directory path is in, below dir_fd, without following
+ * symlinks, so nothing outside of dir can be written through it */
+static int
+open_parent_nofollow (int dir_fd, const char *dir, const char *path, GError **error)
+{
+  g_autofree char *parent = g_path_get_dirname (path);
+  g_auto (GStrv) elements = g_strsplit (parent, "/", -1);
+  autofd int fd = fcntl (dir_fd, F_DUPFD_CLOEXEC, 0);
+
+  for (gsize i = 0; fd >= 0 && elements[i] != NULL; i++)
+    {
+      if (*elements[i] == 0 || strcmp (elements[i], ".") == 0)
+        continue;
+
+      int child_fd = openat (fd, elements[i], O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+      stats_count (STATS_SYSCALLS, 1);
+      close (fd);
+      fd = child_fd;
+    }
+
+  if (fd < 0)
+    {
+      int errsv = errno;
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errsv),
+                   "Can't open dir of '%s/%s': %s", dir, path, strerror (errsv));
+      return -1;
+    }
+
+  return steal_fd (&fd);
+}
+
+/* Replaces sig_name in parent_fd with a new file, atomically as
+ * g_file_set_contents() does, but never following symlinks */
+static gboolean
+write_signature_at (int parent_fd, const char *sig_name, const char *sig_path,
+                    const guchar *signature, gsize signature_len, GError **error)
+{
+  g_autofree char *tmp_name = NULL;
+  autofd int fd = -1;
+
+  for (int tries = 0; fd < 0 && tries < 10; tries++)
+    {
+      g_free (tmp_name);
+      tmp_name = g_strdup_printf (".%s.%06x", sig_name, g_random_int () & 0xffffff);
+      fd = openat (parent_fd, tmp_name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+                   0644);
+      stats_count (STATS_SYSCALLS, 1);
+      if (fd < 0 && errno != EEXIST)
+        break;
+    }
+
+  if (fd < 0 || write_to_fd (fd, signature, signature_len) < 0
+      || renameat (parent_fd, tmp_name, parent_fd, sig_name) < 0)
+    {
+      int errsv = errno;
+      if (fd >= 0)
+        unlinkat (parent_fd, tmp_name, 0);
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errsv),
+                   "Failed to write file '%s': %s", sig_path, strerror (errsv));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+import_signature (int dir_fd, const char *dir, const char *path, const guchar *header,
+                  gsize header_len, const guchar *raw, gsize raw_len, GError **error)
+{
+  /* Signature paths must stay inside the directory we import into */
+  if (!is_safe_relative_path (path))
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "Invalid path '%s' in stream", path);
+      return FALSE;
+    }
+
+  /* Catches a signer that output something else than raw signatures */
+  if (raw_len != VALIDATOR_ED25519_SIGNATURE_LEN)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                   "Signature of '%s' is %" G_GSIZE_FORMAT " bytes, expected %d", path, raw_len,
+                   VALIDATOR_ED25519_SIGNATURE_LEN);
+      return FALSE;
+    }
+
+  g_autofree char *full_path = g_build_filename (dir, path, NULL);
+  g_autofree char *name = g_path_get_basename (path);
+  autofd int parent_fd = open_parent_nofollow (dir_fd, dir, path, error);
+  if (parent_fd < 0)
+    return FALSE;
+
+  g_autofree guchar *signature = g_malloc (header_len + raw_len);
+  memcpy (signature, header, header_len);
+  memcpy (signature + header_len, raw, raw_len);
+
+  /* The stream doesn't say what digest the blob was made with, so a
+   * wrong --fsverity or --chunked (or a signer mixing up records)
+   * would otherwise only show when validating */
+  int type;
+  g_autofree guchar *content = NULL;
+  gsize content_len = 0;
+  if (!load_file_data_for_sign_at (parent_fd, name, full_path, NULL, opt_get_digest_type (), &type,
+                                   &content, &content_len, -1, error))
+    return FALSE;
+
+  g_autofree char *rel_path
+      = opt_path_prefix ? g_build_filename (opt_path_prefix, path, NULL) : g_strdup (path);
+  g_autoptr (GError) local_error = NULL;
+  if (!validate_data (rel_path, type, content, content_len, (char *)signature,
+                      header_len + raw_len, opt_public_keys, &local_error))
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                   "Signature in stream for '%s' is invalid (as %s)%s%s", full_path, rel_path,
+                   local_error ? ": " : "", local_error ? local_error->message : "");
+      return FALSE;
+    }
+
+  g_autofree char *sig_name = g_strconcat (name, ".sig", NULL);
+  g_autofree char *sig_path = g_strconcat (full_path, ".sig", NULL);
+  if (!write_signature_at (parent_fd, sig_name, sig_path, signature, header_len + raw_len, error))
+    return FALSE;
+
+  g_info ("Wrote signature '%s'", sig_path);
+  return TRUE;
+}
+
+/* Reads a blob stream of raw signatures from stdin (as made of the
+ * output of blob --stream by an external signer) and writes them as
+ * signature files next to the files in DIR */
+int
+cmd_import_signatures (int argc, char *argv[])
+{
+  g_autoptr (GError) error = NULL;
+
+  if (argc == 1)
+    help_error ("No directory given");
+
+  if (argc > 2)
+    help_error ("Only one directory argument supported");
+
+  if (opt_public_keys->keys->len != 1)
+    help_error ("Need exactly one public key, the one the signatures were made with");
+
+  guchar header[VALIDATOR_SIGNATURE_V2_HEADER_LEN];
+  gsize header_len = make_signature_header (g_ptr_array_index (opt_public_keys->keys, 0),
+                                            opt_get_digest_type (), header, &error);
+  if (header_len == 0)
+    {
+      g_printerr ("%s\n", error->message);
+      return EXIT_FAILURE;
+    }
+
+  g_autofree char *dir = g_canonicalize_filename (argv[1], NULL);
+  autofd int dir_fd = open (dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd < 0)
+    {
+      g_printerr ("Failed to open dir '%s': %s\n", dir, strerror (errno));
+      return EXIT_FAILURE;
+    }
+
+  gboolean res = TRUE;
+  guint n_imported = 0;
+  while (TRUE)
+    {
+      g_autofree char *path = NULL;
+      g_autofree guchar *raw = NULL;
+      gsize raw_len;
+
+      if (!blob_stream_read (stdin, &path, &raw, &raw_len, &error))
+        {
+          g_printerr ("%s\n", error->message);
+          return EXIT_FAILURE;
+        }
+
+      if (path == NULL)
+        break;
+
+      if (!import_signature (dir_fd, dir, path, header, header_len, raw, raw_len, &error))
+        {
+          g_printerr ("%s\n", error->message);
+          g_clear_error (&error);
+          res = FALSE;
+          continue;
+        }
+
+      n_imported++;
+    }
+
+  g_info ("Imported %u signatures into '%s'", n_imported, dir);
+
+  return res ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,664 @@
+/*
+ * Copyright © 2023 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+#include "config.h"
+#include "main.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+/* Bundles are read as one sequential stream, with large reads */
+#define BUNDLE_READ_BUFFER_SIZE (1024 * 1024)
+
+struct BundleReader
+{
+  FILE *f;
+  char *path; /* For messages */
+};
+
+struct BundleWriter
+{
+  char *path;
+  char *tmp_path; /* Renamed to path when finished */
+  int fd;
+  guint64 offset;
+  guint64 n_entries;
+  GByteArray *index;
+};
+
+static void
+bundle_header_parse (const guchar *header, BundleEntry *entry, guint32 *path_len_out)
+{
+  guint32 path_len_le;
+  guint64 content_len_le;
+
+  memcpy (&path_len_le, header + 4, 4);
+  memcpy (&content_len_le, header + 8, 8);
+
+  entry->type = header[0];
+  entry->digest_type = header[1];
+  entry->content_len = GUINT64_FROM_LE (content_len_le);
+  *path_len_out = GUINT32_FROM_LE (path_len_le);
+}
+
+static void
+bundle_header_make (guchar *header, ValidatorBundleType type, ValidatorDigestType digest_type,
+                    guint32 path_len, guint64 content_len)
+{
+  guint32 path_len_le = GUINT32_TO_LE (path_len);
+  guint64 content_len_le = GUINT64_TO_LE (content_len);
+
+  memset (header, 0, VALIDATOR_BUNDLE_HEADER_LEN);
+  header[0] = type;
+  header[1] = digest_type;
+  memcpy (header + 4, &path_len_le, 4);
+  memcpy (header + 8, &content_len_le, 8);
+}
+
+BundleReader *
+bundle_reader_open (const char *path, GError **error)
+{
+  g_autoptr (FILE) f = NULL;
+
+  if (strcmp (path, "-") == 0)
+    f = fdopen (dup (0), "r");
+  else
+    f = fopen (path, "re");
+  stats_count (STATS_SYSCALLS, 1);
+  if (f == NULL)
+    {
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno), "Can't open '%s': %s",
+                   path, strerror (errno));
+      return NULL;
+    }
+
+  setvbuf (f, NULL, _IOFBF, BUNDLE_READ_BUFFER_SIZE);
+
+  BundleReader *reader = g_new0 (BundleReader, 1);
+  reader->f = g_steal_pointer (&f);
+  reader->path = g_strdup (strcmp (path, "-") == 0 ? "stdin" : path);
+
+  char magic[VALIDATOR_BUNDLE_MAGIC_LEN];
+  if (fread (magic, 1, sizeof (magic), reader->f) != sizeof (magic)
+      || memcmp (magic, VALIDATOR_BUNDLE_MAGIC, VALIDATOR_BUNDLE_MAGIC_LEN) != 0)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "'%s' is not a bundle",
+                   reader->path);
+      bundle_reader_free (reader);
+      return NULL;
+    }
+
+  return reader;
+}
+
+void
+bundle_reader_free (BundleReader *reader)
+{
+  fclose (reader->f);
+  g_free (reader->path);
+  g_free (reader);
+}
+
+static gboolean
+bundle_reader_read (BundleReader *reader, void *data, gsize len, GError **error)
+{
+  if (fread (data, 1, len, reader->f) == len)
+    return TRUE;
+
+  if (ferror (reader->f))
+    g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno), "Can't read '%s': %s",
+                 reader->path, strerror (errno));
+  else
+    g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "Truncated bundle '%s'", reader->path);
+  return FALSE;
+}
+
+/* Reads the header and path of the next record, the caller must then
+ * read its content, unless it is the END record */
+gboolean
+bundle_reader_next (BundleReader *reader, BundleEntry *entry, GError **error)
+{
+  guchar header[VALIDATOR_BUNDLE_HEADER_LEN];
+  guint32 path_len;
+
+  bundle_entry_clear (entry);
+
+  if (!bundle_reader_read (reader, header, sizeof (header), error))
+    return FALSE;
+
+  bundle_header_parse (header, entry, &path_len);
+
+  if (entry->type == VALIDATOR_BUNDLE_END)
+    return TRUE;
+
+  if ((entry->type != VALIDATOR_BUNDLE_FILE && entry->type != VALIDATOR_BUNDLE_SYMLINK)
+      || entry->digest_type > VALIDATOR_DIGEST_CHUNKED || path_len == 0 || path_len > PATH_MAX
+      || (entry->type == VALIDATOR_BUNDLE_SYMLINK && entry->content_len > PATH_MAX))
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "Invalid record in bundle '%s'",
+                   reader->path);
+      return FALSE;
+    }
+
+  entry->path = g_malloc (path_len + 1);
+  if (!bundle_reader_read (reader, entry->path, path_len, error))
+    return FALSE;
+  entry->path[path_len] = 0;
+
+  if (strlen (entry->path) != path_len)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "Invalid path in bundle '%s'",
+                   reader->path);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Reads the content and signature of the record. The content of files
+ * is copied to copy_to_fd (or skipped if it is -1), the target of
+ * symlinks is read into the entry. */
+gboolean
+bundle_reader_read_content (BundleReader *reader, BundleEntry *entry, int copy_to_fd,
+                            GError **error)
+{
+  if (entry->type == VALIDATOR_BUNDLE_SYMLINK)
+    {
+      entry->symlink_target = g_malloc (entry->content_len + 1);
+      if (!bundle_reader_read (reader, entry->symlink_target, entry->content_len, error))
+        return FALSE;
+      entry->symlink_target[entry->content_len] = 0;
+
+      if (entry->content_len == 0 || strlen (entry->symlink_target) != entry->content_len)
+        {
+          g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                       "Invalid symlink '%s' in bundle '%s'", entry->path, reader->path);
+          return FALSE;
+        }
+    }
+  else
+    {
+      guchar buf[64 * 1024];
+      guint64 left = entry->content_len;
+
+      while (left > 0)
+        {
+          gsize n = MIN (left, sizeof (buf));
+          if (!bundle_reader_read (reader, buf, n, error))
+            return FALSE;
+
+          if (copy_to_fd >= 0)
+            {
+              if (write_to_fd (copy_to_fd, buf, n) < 0)
+                {
+                  g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                               "Can't write copy of '%s': %s", entry->path, strerror (errno));
+                  return FALSE;
+                }
+              stats_count (STATS_BYTES_COPIED, n);
+            }
+          left -= n;
+        }
+    }
+
+  guint32 signature_len_le;
+  if (!bundle_reader_read (reader, &signature_len_le, 4, error))
+    return FALSE;
+
+  entry->signature_len = GUINT32_FROM_LE (signature_len_le);
+  if (entry->signature_len > VALIDATOR_BUNDLE_MAX_SIGNATURE)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                   "Invalid signature for '%s' in bundle '%s'", entry->path, reader->path);
+      return FALSE;
+    }
+
+  entry->signature = g_malloc (entry->signature_len);
+  return bundle_reader_read (reader, entry->signature, entry->signature_len, error);
+}
+
+void
+bundle_entry_clear (BundleEntry *entry)
+{
+  g_free (entry->path);
+  g_free (entry->symlink_target);
+  g_free (entry->signature);
+  memset (entry, 0, sizeof (BundleEntry));
+}
+
+BundleWriter *
+bundle_writer_new (const char *path, GError **error)
+{
+  g_autofree char *tmp_path = g_strconcat (path, ".XXXXXX", NULL);
+  int fd = g_mkstemp_full (tmp_path, O_RDWR | O_CLOEXEC, 0644);
+  if (fd < 0)
+    {
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                   "Can't create '%s': %s", tmp_path, strerror (errno));
+      return NULL;
+    }
+
+  BundleWriter *writer = g_new0 (BundleWriter, 1);
+  writer->path = g_strdup (path);
+  writer->tmp_path = g_steal_pointer (&tmp_path);
+  writer->fd = fd;
+  writer->index = g_byte_array_new ();
+
+  if (write_to_fd (fd, (const guchar *)VALIDATOR_BUNDLE_MAGIC, VALIDATOR_BUNDLE_MAGIC_LEN) < 0)
+    {
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno), "Can't write '%s': %s",
+                   writer->tmp_path, strerror (errno));
+      bundle_writer_free (writer);
+      return NULL;
+    }
+  writer->offset = VALIDATOR_BUNDLE_MAGIC_LEN;
+
+  return writer;
+}
+
+void
+bundle_writer_free (BundleWriter *writer)
+{
+  close (writer->fd);
+  if (writer->tmp_path)
+    (void)unlink (writer->tmp_path);
+  g_free (writer->tmp_path);
+  g_free (writer->path);
+  g_byte_array_unref (writer->index);
+  g_free (writer);
+}
+
+static gboolean
+bundle_writer_write (BundleWriter *writer, const void *data, gsize len, GError **error)
+{
+  if (write_to_fd (writer->fd, data, len) < 0)
+    {
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno), "Can't write '%s': %s",
+                   writer->tmp_path, strerror (errno));
+      return FALSE;
+    }
+
+  writer->offset += len;
+  return TRUE;
+}
+
+/* Appends the file name in dir_fd (path is for messages), as rel_path */
+gboolean
+bundle_writer_add (BundleWriter *writer, const char *rel_path, int dir_fd, const char *name,
+                   const char *path, struct stat *st, ValidatorDigestType digest_type,
+                   const guchar *signature, gsize signature_len, GError **error)
+{
+  int type = st->st_mode & S_IFMT;
+  autofd int fd = -1;
+  g_autofree char *target = NULL;
+  guint64 content_len;
+
+  if (type == S_IFLNK)
+    {
+      target = read_link_at (dir_fd, name, path, error);
+      if (target == NULL)
+        return FALSE;
+      content_len = strlen (target);
+    }
+  else
+    {
+      struct stat fd_st;
+      fd = openat (dir_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+      stats_count (STATS_SYSCALLS, 2);
+      if (fd < 0 || fstat (fd, &fd_st) < 0)
+        {
+          g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                       "Can't open '%s': %s", path, strerror (errno));
+          return FALSE;
+        }
+      content_len = fd_st.st_size;
+    }
+
+  guint64 record_offset = writer->offset;
+  guchar header[VALIDATOR_BUNDLE_HEADER_LEN];
+  bundle_header_make (header,
+                      type == S_IFLNK ? VALIDATOR_BUNDLE_SYMLINK : VALIDATOR_BUNDLE_FILE,
+                      digest_type, strlen (rel_path), content_len);
+
+  if (!bundle_writer_write (writer, header, sizeof (header), error)
+      || !bundle_writer_write (writer, rel_path, strlen (rel_path), error))
+    return FALSE;
+
+  if (target)
+    {
+      if (!bundle_writer_write (writer, target, content_len, error))
+        return FALSE;
+    }
+  else
+    {
+      if (copy_fd (fd, writer->fd) < 0)
+        {
+          g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                       "Can't copy '%s' to '%s': %s", path, writer->tmp_path, strerror (errno));
+          return FALSE;
+        }
+
+      /* The size is in the header already */
+      writer->offset += content_len;
+      if (lseek (writer->fd, 0, SEEK_CUR) != writer->offset)
+        {
+          g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                       "File '%s' changed while being bundled", path);
+          return FALSE;
+        }
+    }
+
+  guint32 signature_len_le = GUINT32_TO_LE (signature_len);
+  if (!bundle_writer_write (writer, &signature_len_le, 4, error)
+      || !bundle_writer_write (writer, signature, signature_len, error))
+    return FALSE;
+
+  guint64 record_offset_le = GUINT64_TO_LE (record_offset);
+  guint32 path_len_le = GUINT32_TO_LE (strlen (rel_path));
+  g_byte_array_append (writer->index, (guchar *)&record_offset_le, 8);
+  g_byte_array_append (writer->index, (guchar *)&path_len_le, 4);
+  g_byte_array_append (writer->index, (guchar *)rel_path, strlen (rel_path));
+  writer->n_entries++;
+
+  return TRUE;
+}
+
+/* Writes the END record with the index, and puts the bundle in place */
+gboolean
+bundle_writer_finish (BundleWriter *writer, GError **error)
+{
+  guint64 end_offset_le = GUINT64_TO_LE (writer->offset);
+  guchar header[VALIDATOR_BUNDLE_HEADER_LEN];
+  bundle_header_make (header, VALIDATOR_BUNDLE_END, 0, 0, writer->index->len);
+
+  if (!bundle_writer_write (writer, header, sizeof (header), error)
+      || !bundle_writer_write (writer, writer->index->data, writer->index->len, error)
+      || !bundle_writer_write (writer, &end_offset_le, 8, error)
+      || !bundle_writer_write (writer, VALIDATOR_BUNDLE_MAGIC, VALIDATOR_BUNDLE_MAGIC_LEN, error))
+    return FALSE;
+
+  if (rename (writer->tmp_path, writer->path) < 0)
+    {
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno), "Can't create '%s': %s",
+                   writer->path, strerror (errno));
+      return FALSE;
+    }
+
+  g_clear_pointer (&writer->tmp_path, g_free);
+  return TRUE;
+}
+
+typedef struct
+{
+  BundleWriter *writer;
+  EVP_PKEY *key; /* If NULL, the existing signatures are used */
+  ValidatorDigestType digest_type;
+} BundleCreate;
+
+static gboolean
+bundle_file (WalkItem *item, gpointer user_data, GError **error)
+{
+  BundleCreate *create = user_data;
+  const char *path = item->path;
+
+  /* The prefix is only in what is signed, like for loose files */
+  g_autofree char *rel_path = opt_get_relative_path (path, item->relative_to, NULL);
+  g_autofree char *signed_path = opt_get_relative_path (path, item->relative_to, opt_path_prefix);
+  if (rel_path == NULL || *rel_path == 0)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "File '%s' not inside relative dir",
+                   path);
+      return FALSE;
+    }
+
+  g_autofree guchar *signature = NULL;
+  gsize signature_len = 0;
+  ValidatorDigestType digest_type = create->digest_type;
+
+  if (create->key)
+    {
+      int type;
+      g_autofree guchar *content = NULL;
+      gsize content_len = 0;
+
+      if (!load_file_data_for_sign_at (item->dir_fd, item->name, path, &item->st, digest_type,
+                                       &type, &content, &content_len, -1, error)
+          || !sign_data (type, digest_type, signed_path, content, content_len, create->key,
+                         &signature, &signature_len, error))
+        {
+          g_prefix_error (error, "Failed to sign file '%s': ", path);
+          return FALSE;
+        }
+    }
+  else
+    {
+      char *loaded = NULL;
+      if (!sigpack_load_signature (item->sigpack, item->dir_fd, item->name, path, &loaded,
+                                   &signature_len, error))
+        return FALSE;
+      signature = (guchar *)loaded;
+
+      if (signature_len > VALIDATOR_BUNDLE_MAX_SIGNATURE)
+        {
+          g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "Invalid signature '%s.sig'",
+                       path);
+          return FALSE;
+        }
+      digest_type = signature_get_digest_type ((char *)signature, signature_len);
+    }
+
+  /* The digest is computed from the installed copy, which doesn't
+   * have fs-verity enabled */
+  if (digest_type == VALIDATOR_DIGEST_FSVERITY)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                   "File '%s' is signed with an fs-verity digest, which can't be bundled", path);
+      return FALSE;
+    }
+
+  if (!bundle_writer_add (create->writer, rel_path, item->dir_fd, item->name, path, &item->st,
+                          digest_type, signature, signature_len, error))
+    return FALSE;
+
+  log_info ("Added '%s' to bundle (as %s)", path, rel_path);
+
+  return TRUE;
+}
+
+static int
+bundle_create (int argc, char *argv[])
+{
+  g_autoptr (GError) error = NULL;
+
+  if (argc == 1)
+    help_error ("No bundle given");
+  if (argc == 2)
+    help_error ("No input files given");
+
+  BundleCreate create = { NULL, NULL, opt_get_digest_type () };
+  if (create.digest_type == VALIDATOR_DIGEST_FSVERITY)
+    help_error ("--fsverity is not supported for bundles");
+
+  g_autoptr (EVP_PKEY) key = NULL;
+  if (opt_key)
+    {
+      key = load_priv_key (opt_key, &error);
+      if (key == NULL)
+        {
+          g_printerr ("Can't load key: %s\n", error->message);
+          return EXIT_FAILURE;
+        }
+      create.key = key;
+    }
+
+  g_autoptr (BundleWriter) writer = bundle_writer_new (argv[1], &error);
+  if (writer == NULL)
+    {
+      g_printerr ("%s\n", error->message);
+      return EXIT_FAILURE;
+    }
+  create.writer = writer;
+
+  /* Records are written in walk order, from this thread */
+  g_autoptr (Walker) walker = walker_new (1, bundle_file, &create);
+
+  for (gsize i = 2; i < argc; i++)
+    {
+      g_autofree char *path = g_canonicalize_filename (argv[i], NULL);
+      g_autofree char *dirname = NULL;
+      const char *relative_to;
+
+      if (g_file_test (path, G_FILE_TEST_IS_DIR))
+        {
+          if (!opt_recursive)
+            {
+              walker_finish (walker);
+              g_printerr ("error: '%s' is a directory and not in recursive mode\n", path);
+              return EXIT_FAILURE;
+            }
+
+          relative_to = opt_path_relative ? opt_path_relative : path;
+        }
+      else
+        {
+          dirname = g_path_get_dirname (path);
+          relative_to = opt_path_relative ? opt_path_relative : dirname;
+        }
+
+      walker_walk (walker, path, relative_to, NULL, TRUE);
+    }
+
+  /* Don't write partial bundles */
+  if (!walker_finish (walker))
+    return EXIT_FAILURE;
+
+  if (!bundle_writer_finish (writer, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      return EXIT_FAILURE;
+    }
+
+  g_info ("Wrote bundle '%s' with %" G_GUINT64_FORMAT " files", argv[1], writer->n_entries);
+
+  return EXIT_SUCCESS;
+}
+
+/* Lists the paths in the index, without reading the records */
+static gboolean
+bundle_list_index (BundleReader *reader, GError **error)
+{
+  guchar footer[VALIDATOR_BUNDLE_FOOTER_LEN];
+  guint64 end_offset_le;
+
+  if (fseek (reader->f, -VALIDATOR_BUNDLE_FOOTER_LEN, SEEK_END) < 0)
+    {
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno), "Can't seek in '%s': %s",
+                   reader->path, strerror (errno));
+      return FALSE;
+    }
+
+  if (!bundle_reader_read (reader, footer, sizeof (footer), error))
+    return FALSE;
+
+  memcpy (&end_offset_le, footer, 8);
+  if (memcmp (footer + 8, VALIDATOR_BUNDLE_MAGIC, VALIDATOR_BUNDLE_MAGIC_LEN) != 0
+      || fseeko (reader->f, GUINT64_FROM_LE (end_offset_le), SEEK_SET) < 0)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "Invalid index in bundle '%s'",
+                   reader->path);
+      return FALSE;
+    }
+
+  g_auto (BundleEntry) end = { 0 };
+  if (!bundle_reader_next (reader, &end, error))
+    return FALSE;
+
+  if (end.type != VALIDATOR_BUNDLE_END)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "Invalid index in bundle '%s'",
+                   reader->path);
+      return FALSE;
+    }
+
+  guint64 left = end.content_len;
+  while (left > 0)
+    {
+      guchar entry_header[12];
+      guint32 path_len_le;
+
+      if (left < sizeof (entry_header)
+          || !bundle_reader_read (reader, entry_header, sizeof (entry_header), error))
+        return FALSE;
+      memcpy (&path_len_le, entry_header + 8, 4);
+      guint32 path_len = GUINT32_FROM_LE (path_len_le);
+      left -= sizeof (entry_header);
+
+      if (path_len > left || path_len > PATH_MAX)
+        {
+          g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "Invalid index in bundle '%s'",
+                       reader->path);
+          return FALSE;
+        }
+
+      char path[PATH_MAX + 1];
+      if (!bundle_reader_read (reader, path, path_len, error))
+        return FALSE;
+      path[path_len] = 0;
+      left -= path_len;
+
+      g_print ("%s\n", path);
+    }
+
+  return TRUE;
+}
+
+static int
+bundle_list (int argc, char *argv[])
+{
+  g_autoptr (GError) error = NULL;
+
+  if (argc != 2)
+    help_error ("One bundle must be given");
+
+  g_autoptr (BundleReader) reader = bundle_reader_open (argv[1], &error);
+  if (reader == NULL || !bundle_list_index (reader, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      return EXIT_FAILURE;
+    }
+
+  return EXIT_SUCCESS;
+}
+
+int
+cmd_bundle (int argc, char *argv[])
+{
+  if (argc == 1)
+    help_error ("No bundle command given");
+
+  if (strcmp (argv[1], "create") == 0)
+    return bundle_create (argc - 1, argv + 1);
+
+  if (strcmp (argv[1], "list") == 0)
+    return bundle_list (argc - 1, argv + 1);
+
+  help_error ("Unsupported bundle command '%s'", argv[1]);
+  return EXIT_FAILURE;
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright © 2023 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+#include <glib.h>
+#include <sys/stat.h>
+
+/* A bundle is the magic, followed by a record per file: a header
+ * (u8 type, u8 digest type, u16 reserved, u32 path length, u64 content
+ * length, all little endian), the relative path, the content (the
+ * symlink target for symlinks), and the u32 length of the signature
+ * and the signature. The signature is the same as in the .sig file of
+ * the file. The records end with a record of type END, whose content
+ * is an index of the u64 offset, u32 path length and path of each
+ * record, and the file ends with the u64 offset of the END record and
+ * the magic again. Installs read the records in order, so bundles can
+ * be streamed; the index is only for listing. */
+#define VALIDATOR_BUNDLE_MAGIC "VALIDBN\001"
+#define VALIDATOR_BUNDLE_MAGIC_LEN 8
+#define VALIDATOR_BUNDLE_HEADER_LEN 16
+#define VALIDATOR_BUNDLE_FOOTER_LEN (8 + VALIDATOR_BUNDLE_MAGIC_LEN)
+#define VALIDATOR_BUNDLE_MAX_SIGNATURE 4096
+
+typedef enum
+{
+  VALIDATOR_BUNDLE_END = 0,
+  VALIDATOR_BUNDLE_FILE = 1,
+  VALIDATOR_BUNDLE_SYMLINK = 2,
+} ValidatorBundleType;
+
+typedef struct
+{
+  ValidatorBundleType type;
+  ValidatorDigestType digest_type;
+  char *path;
+  guint64 content_len;
+
+  /* Set by bundle_reader_read_content() */
+  char *symlink_target;
+  guchar *signature;
+  gsize signature_len;
+} BundleEntry;
+
+typedef struct BundleReader BundleReader;
+typedef struct BundleWriter BundleWriter;
+
+BundleReader *bundle_reader_open (const char *path, GError **error);
+void bundle_reader_free (BundleReader *reader);
+gboolean bundle_reader_next (BundleReader *reader, BundleEntry *entry, GError **error);
+gboolean bundle_reader_read_content (BundleReader *reader, BundleEntry *entry, int copy_to_fd,
+                                     GError **error);
+void bundle_entry_clear (BundleEntry *entry);
+
+BundleWriter *bundle_writer_new (const char *path, GError **error);
+void bundle_writer_free (BundleWriter *writer);
+gboolean bundle_writer_add (BundleWriter *writer, const char *rel_path, int dir_fd,
+                            const char *name, const char *path, struct stat *st,
+                            ValidatorDigestType digest_type, const guchar *signature,
+                            gsize signature_len, GError **error);
+gboolean bundle_writer_finish (BundleWriter *writer, GError **error);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (BundleReader, bundle_reader_free)
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (BundleWriter, bundle_writer_free)
+G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC (BundleEntry, bundle_entry_clear)
@@ -0,0 +1,257 @@
+/*
+ * Copyright © 2023 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+
+#include "config.h"
+
+#include "utils.h"
+#include "chunked.h"
+#include "stats.h"
+#include "probes.h"
+
+#include <errno.h>
+#include <unistd.h>
+
+/* Don't start threads for files that are only a few chunks */
+#define CHUNKS_PER_THREAD 4
+
+/* The extra hash threads are shared by all files being hashed, so
+ * that hashing many large files in parallel (e.g. from several walker
+ * workers) doesn't start a thread per core for each of them */
+static gint n_hash_threads; /* Atomic */
+
+/* Returns how many of the wanted threads can be started */
+static guint
+reserve_hash_threads (guint wanted)
+{
+  gint max = g_get_num_processors ();
+
+  while (TRUE)
+    {
+      gint used = g_atomic_int_get (&n_hash_threads);
+      guint n = MIN (wanted, (guint)MAX (max - used, 0));
+      if (n == 0 || g_atomic_int_compare_and_exchange (&n_hash_threads, used, used + n))
+        return n;
+    }
+}
+
+static void
+release_hash_threads (guint n)
+{
+  g_atomic_int_add (&n_hash_threads, -(gint)n);
+}
+
+typedef struct
+{
+  int fd;
+  const char *path;
+  int copy_to_fd;
+  guint64 size;
+  guint n_chunks;
+  guchar *chunk_digests; /* n_chunks * VALIDATOR_CHUNKED_DIGEST_LEN */
+  Stats *stats;
+
+  gint next_chunk; /* Atomic */
+  GMutex lock;
+  GError *error; /* The first error */
+} ChunkedHash;
+
+static gboolean
+hash_chunk (ChunkedHash *hash, EVP_MD_CTX *ctx, guchar *buf, guint chunk, GError **error)
+{
+  guint64 offset = (guint64)chunk * VALIDATOR_CHUNKED_CHUNK_SIZE;
+  gsize len = MIN (VALIDATOR_CHUNKED_CHUNK_SIZE, hash->size - offset);
+  gsize n_read = 0;
+
+  while (n_read < len)
+    {
+      VALIDATOR_PROBE2 (hash__read__begin, hash->path, offset + n_read);
+      gssize res = pread (hash->fd, buf + n_read, len - n_read, offset + n_read);
+      VALIDATOR_PROBE2 (hash__read__end, hash->path, (gint64)res);
+      stats_count (STATS_SYSCALLS, 1);
+      if (res < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno), "Can't read %s: %s",
+                       hash->path, strerror (errno));
+          return FALSE;
+        }
+      if (res == 0)
+        {
+          g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "File %s changed while reading",
+                       hash->path);
+          return FALSE;
+        }
+      n_read += res;
+    }
+
+  stats_count (STATS_BYTES_HASHED, len);
+
+  if (EVP_DigestInit_ex (ctx, get_sha512_md (), NULL) == 0
+      || EVP_DigestUpdate (ctx, buf, len) == 0
+      || EVP_DigestFinal_ex (ctx, hash->chunk_digests + chunk * VALIDATOR_CHUNKED_DIGEST_LEN, NULL)
+             == 0)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Can't compute sha512 operation");
+      return FALSE;
+    }
+
+  /* Copy exactly the data we hashed, the chunks can be written in any order */
+  if (hash->copy_to_fd >= 0)
+    {
+      for (gsize written = 0; written < len;)
+        {
+          gssize res = TEMP_FAILURE_RETRY (
+              pwrite (hash->copy_to_fd, buf + written, len - written, offset + written));
+          stats_count (STATS_SYSCALLS, 1);
+          if (res <= 0)
+            {
+              if (res == 0)
+                errno = ENOSPC;
+              g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                           "Can't write copy of %s: %s", hash->path, strerror (errno));
+              return FALSE;
+            }
+          written += res;
+        }
+      stats_count (STATS_BYTES_COPIED, len);
+    }
+
+  return TRUE;
+}
+
+/* Hash chunks until there are none left, or some thread failed */
+static gpointer
+chunked_hash_thread (gpointer data)
+{
+  ChunkedHash *hash = data;
+  g_autoptr (EVP_MD_CTX) ctx = EVP_MD_CTX_new ();
+  g_autofree guchar *buf = g_malloc (VALIDATOR_CHUNKED_CHUNK_SIZE);
+  g_autoptr (GError) error = NULL;
+
+  stats_set_current (hash->stats);
+
+  if (ctx == NULL)
+    g_set_error (&error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Can't init context");
+
+  while (error == NULL)
+    {
+      guint chunk = g_atomic_int_add (&hash->next_chunk, 1);
+      if (chunk >= hash->n_chunks)
+        break;
+
+      if (!hash_chunk (hash, ctx, buf, chunk, &error))
+        {
+          /* Make the other threads stop */
+          g_atomic_int_set (&hash->next_chunk, hash->n_chunks);
+        }
+    }
+
+  if (error)
+    {
+      g_mutex_lock (&hash->lock);
+      if (hash->error == NULL)
+        hash->error = g_steal_pointer (&error);
+      g_mutex_unlock (&hash->lock);
+    }
+
+  return NULL;
+}
+
+/* Returns the chunked digest of the file, using up to one thread per
+ * core for large files. If copy_to_fd is >= 0 the content is also
+ * copied there. */
+char *
+chunked_digest_fd (int fd, const char *path, gsize *digest_len_out, int copy_to_fd,
+                   GError **error)
+{
+  struct stat st;
+
+  if (fstat (fd, &st) < 0)
+    {
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno), "Can't stat %s: %s",
+                   path, strerror (errno));
+      return NULL;
+    }
+
+  ChunkedHash hash = { 0 };
+  hash.fd = fd;
+  hash.path = path;
+  hash.copy_to_fd = copy_to_fd;
+  hash.size = st.st_size;
+  hash.n_chunks = (hash.size + VALIDATOR_CHUNKED_CHUNK_SIZE - 1) / VALIDATOR_CHUNKED_CHUNK_SIZE;
+  hash.stats = stats_get_current ();
+  g_mutex_init (&hash.lock);
+
+  g_autofree guchar *chunk_digests = g_malloc ((gsize)hash.n_chunks * VALIDATOR_CHUNKED_DIGEST_LEN);
+  hash.chunk_digests = chunk_digests;
+
+  guint n_threads = MIN (g_get_num_processors (), hash.n_chunks / CHUNKS_PER_THREAD);
+  guint n_reserved = n_threads > 1 ? reserve_hash_threads (n_threads - 1) : 0;
+  g_autoptr (GPtrArray) threads = g_ptr_array_new ();
+
+  /* This thread does its share too, and all of it if no other thread
+   * could be started */
+  for (guint i = 0; i < n_reserved; i++)
+    {
+      g_autoptr (GError) thread_error = NULL;
+      GThread *thread = g_thread_try_new ("hash", chunked_hash_thread, &hash, &thread_error);
+      if (thread == NULL)
+        {
+          g_debug ("Can't start hash thread: %s", thread_error->message);
+          break;
+        }
+      g_ptr_array_add (threads, thread);
+    }
+  release_hash_threads (n_reserved - threads->len);
+  chunked_hash_thread (&hash);
+  for (guint i = 0; i < threads->len; i++)
+    g_thread_join (g_ptr_array_index (threads, i));
+  release_hash_threads (threads->len);
+
+  g_mutex_clear (&hash.lock);
+
+  if (hash.error)
+    {
+      g_propagate_error (error, hash.error);
+      return NULL;
+    }
+
+  /* The chunk size is included, so it can change in a later version */
+  guint64 size_le = GUINT64_TO_LE (hash.size);
+  guint32 chunk_size_le = GUINT32_TO_LE (VALIDATOR_CHUNKED_CHUNK_SIZE);
+
+  g_autoptr (EVP_MD_CTX) ctx = EVP_MD_CTX_new ();
+  g_autofree char *digest = g_malloc (VALIDATOR_CHUNKED_DIGEST_LEN);
+  if (ctx == NULL || EVP_DigestInit_ex (ctx, get_sha512_md (), NULL) == 0
+      || EVP_DigestUpdate (ctx, &size_le, sizeof (size_le)) == 0
+      || EVP_DigestUpdate (ctx, &chunk_size_le, sizeof (chunk_size_le)) == 0
+      || EVP_DigestUpdate (ctx, chunk_digests, (gsize)hash.n_chunks * VALIDATOR_CHUNKED_DIGEST_LEN)
+             == 0
+      || EVP_DigestFinal_ex (ctx, (guchar *)digest, NULL) == 0)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Can't compute sha512 operation");
+      return NULL;
+    }
+
+  *digest_len_out = VALIDATOR_CHUNKED_DIGEST_LEN;
+  return g_steal_pointer (&digest);
+}
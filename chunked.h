@@ -0,0 +1,32 @@
+/*
+ * Copyright © 2023 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+
+#include <glib.h>
+
+/* Files signed by their chunked digest are split into 1 MiB chunks
+ * which are hashed independently (and so in parallel), the digest is
+ * the sha512 of the file size, the chunk size and the sha512 of each
+ * chunk in order. */
+#define VALIDATOR_CHUNKED_CHUNK_SIZE (1024 * 1024)
+#define VALIDATOR_CHUNKED_DIGEST_LEN 64
+
+char *chunked_digest_fd (int fd, const char *path, gsize *digest_len_out, int copy_to_fd,
+                         GError **error);
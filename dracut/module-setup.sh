@@ -34,7 +34,7 @@ depends() {
 install() {
     dracut_install /usr/bin/validator
     for r in /usr/lib /etc; do
-        inst_multiple -o "$r/validator/boot.d/*.conf" "$r/validator/keys/*"
+        inst_multiple -o "$r/validator/boot.d/*.conf" "$r/validator/keys/*" "$r/validator/*.keyring"
     done
     inst_simple "${moddir}/validator-boot.service" "${systemdsystemunitdir}/validator-boot.service"
     $SYSTEMCTL -q --root "$initdir" add-wants initrd.target validator-boot.service
@@ -0,0 +1,287 @@
+/*
+ * Copyright © 2023 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+
+#include "config.h"
+
+#include "utils.h"
+#include "fsverity.h"
+#include "stats.h"
+#include "probes.h"
+
+#include <errno.h>
+#include <openssl/sha.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#ifdef HAVE_LINUX_FSVERITY_H
+#include <linux/fsverity.h>
+#endif
+
+#define FSVERITY_HASH_ALG_SHA256 1
+#define FSVERITY_LOG_BLOCK_SIZE 12
+#define FSVERITY_BLOCK_SIZE (1 << FSVERITY_LOG_BLOCK_SIZE)
+#define FSVERITY_HASHES_PER_BLOCK (FSVERITY_BLOCK_SIZE / VALIDATOR_FSVERITY_DIGEST_LEN)
+
+/* The on-disk struct fsverity_descriptor, which the digest is a hash of */
+typedef struct
+{
+  guint8 version;
+  guint8 hash_algorithm;
+  guint8 log_blocksize;
+  guint8 salt_size;
+  guint32 sig_size;  /* le */
+  guint64 data_size; /* le */
+  guint8 root_hash[64];
+  guint8 salt[32];
+  guint8 reserved[144];
+} FsverityDescriptor;
+
+G_STATIC_ASSERT (sizeof (FsverityDescriptor) == 256);
+
+static char *
+make_formatted_digest (const guchar *digest, gsize *digest_len_out)
+{
+  char *res = g_malloc (VALIDATOR_FSVERITY_CONTENT_LEN);
+  guint16 alg = GUINT16_TO_LE (FSVERITY_HASH_ALG_SHA256);
+  guint16 size = GUINT16_TO_LE (VALIDATOR_FSVERITY_DIGEST_LEN);
+
+  memcpy (res, VALIDATOR_FSVERITY_MAGIC, VALIDATOR_FSVERITY_MAGIC_LEN);
+  memcpy (res + VALIDATOR_FSVERITY_MAGIC_LEN, &alg, 2);
+  memcpy (res + VALIDATOR_FSVERITY_MAGIC_LEN + 2, &size, 2);
+  memcpy (res + VALIDATOR_FSVERITY_MAGIC_LEN + 4, digest, VALIDATOR_FSVERITY_DIGEST_LEN);
+
+  *digest_len_out = VALIDATOR_FSVERITY_CONTENT_LEN;
+  return res;
+}
+
+/* If the file has fs-verity enabled the kernel has the digest, and
+ * ensures that the content matches it when it is read */
+static gboolean
+measure_verity (int fd, guchar *digest_out)
+{
+#ifdef FS_IOC_MEASURE_VERITY
+  struct
+  {
+    struct fsverity_digest header;
+    guchar digest[64];
+  } measured;
+
+  measured.header.digest_size = sizeof (measured.digest);
+  if (ioctl (fd, FS_IOC_MEASURE_VERITY, &measured) < 0)
+    return FALSE; /* Not enabled, or not supported */
+
+  if (measured.header.digest_algorithm != FS_VERITY_HASH_ALG_SHA256
+      || measured.header.digest_size != VALIDATOR_FSVERITY_DIGEST_LEN)
+    return FALSE; /* Different parameters, compute it ourselves */
+
+  /* The measurement doesn't include the block size and salt, which
+   * change the digest, so they are read from the descriptor */
+#ifdef FS_IOC_READ_VERITY_METADATA
+  FsverityDescriptor desc = { 0 };
+  struct fsverity_read_metadata_arg arg = {
+    .metadata_type = FS_VERITY_METADATA_TYPE_DESCRIPTOR,
+    .offset = 0,
+    .length = sizeof (desc),
+    .buf_ptr = (uintptr_t)&desc,
+  };
+  int res = ioctl (fd, FS_IOC_READ_VERITY_METADATA, &arg);
+  stats_count (STATS_SYSCALLS, 1);
+  if (res < (int)offsetof (FsverityDescriptor, sig_size))
+    return FALSE; /* Not supported, compute it ourselves */
+
+  if (desc.log_blocksize != FSVERITY_LOG_BLOCK_SIZE || desc.salt_size != 0)
+    return FALSE; /* Different parameters, compute it ourselves */
+#else
+  return FALSE;
+#endif
+
+  memcpy (digest_out, measured.digest, VALIDATOR_FSVERITY_DIGEST_LEN);
+  return TRUE;
+#else
+  return FALSE;
+#endif
+}
+
+static gboolean
+hash_block (EVP_MD_CTX *ctx, const guchar *block, guchar *digest_out, GError **error)
+{
+  if (EVP_DigestInit_ex (ctx, get_sha256_md (), NULL) == 0
+      || EVP_DigestUpdate (ctx, block, FSVERITY_BLOCK_SIZE) == 0
+      || EVP_DigestFinal_ex (ctx, digest_out, NULL) == 0)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Can't compute sha256 operation");
+      return FALSE;
+    }
+  return TRUE;
+}
+
+/* Reads a full block (zero padded at the end of the file), returns
+ * the number of bytes read */
+static gssize
+read_block (int fd, guchar *block)
+{
+  gsize n_read = 0;
+
+  while (n_read < FSVERITY_BLOCK_SIZE)
+    {
+      ssize_t res = read (fd, block + n_read, FSVERITY_BLOCK_SIZE - n_read);
+      stats_count (STATS_SYSCALLS, 1);
+      if (res < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return -1;
+        }
+      if (res == 0)
+        break;
+      n_read += res;
+    }
+
+  memset (block + n_read, 0, FSVERITY_BLOCK_SIZE - n_read);
+  return n_read;
+}
+
+/* Compute the digest the same way the kernel does: The data blocks
+ * are hashed, and the hashes packed into blocks, which are hashed
+ * again until there is a single (root) block left. */
+static gboolean
+compute_verity (int fd, const char *path, int copy_to_fd, guchar *digest_out, GError **error)
+{
+  g_autoptr (EVP_MD_CTX) ctx = EVP_MD_CTX_new ();
+  g_autoptr (GByteArray) level = g_byte_array_new ();
+  guchar block[FSVERITY_BLOCK_SIZE];
+  guchar hash[VALIDATOR_FSVERITY_DIGEST_LEN];
+  guint64 data_size = 0;
+  FsverityDescriptor desc = { 0 };
+
+  if (ctx == NULL)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Can't init context");
+      return FALSE;
+    }
+
+  while (TRUE)
+    {
+      VALIDATOR_PROBE2 (hash__read__begin, path, data_size);
+      gssize n_read = read_block (fd, block);
+      VALIDATOR_PROBE2 (hash__read__end, path, (gint64)n_read);
+      if (n_read < 0)
+        {
+          g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno), "Can't read %s: %s",
+                       path, strerror (errno));
+          return FALSE;
+        }
+      if (n_read == 0)
+        break;
+
+      /* As for sha512, copy exactly the data we hashed */
+      if (copy_to_fd >= 0 && write_to_fd (copy_to_fd, block, n_read) < 0)
+        {
+          g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                       "Can't write copy of %s: %s", path, strerror (errno));
+          return FALSE;
+        }
+
+      if (copy_to_fd >= 0)
+        stats_count (STATS_BYTES_COPIED, n_read);
+
+      data_size += n_read;
+      stats_count (STATS_BYTES_HASHED, n_read);
+
+      if (!hash_block (ctx, block, hash, error))
+        return FALSE;
+      g_byte_array_append (level, hash, sizeof (hash));
+
+      if (n_read < FSVERITY_BLOCK_SIZE)
+        break;
+    }
+
+  /* The root hash of an empty file is all zeros */
+  if (data_size > 0)
+    {
+      /* level has the hashes of the blocks at the level below, until
+       * that level was a single block, whose hash is the root hash */
+      while (level->len > VALIDATOR_FSVERITY_DIGEST_LEN)
+        {
+          g_autoptr (GByteArray) next = g_byte_array_new ();
+
+          for (guint offset = 0; offset < level->len; offset += FSVERITY_BLOCK_SIZE)
+            {
+              guint len = MIN (FSVERITY_BLOCK_SIZE, level->len - offset);
+
+              memcpy (block, level->data + offset, len);
+              memset (block + len, 0, FSVERITY_BLOCK_SIZE - len);
+              if (!hash_block (ctx, block, hash, error))
+                return FALSE;
+              g_byte_array_append (next, hash, sizeof (hash));
+            }
+
+          g_byte_array_unref (level);
+          level = g_steal_pointer (&next);
+        }
+
+      memcpy (desc.root_hash, level->data, VALIDATOR_FSVERITY_DIGEST_LEN);
+    }
+
+  desc.version = 1;
+  desc.hash_algorithm = FSVERITY_HASH_ALG_SHA256;
+  desc.log_blocksize = FSVERITY_LOG_BLOCK_SIZE;
+  desc.data_size = GUINT64_TO_LE (data_size);
+
+  if (EVP_Digest (&desc, sizeof (desc), digest_out, NULL, get_sha256_md (), NULL) == 0)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Can't compute sha256 operation");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Returns the fs-verity formatted digest of the file. This is measured
+ * by the kernel if possible, and computed otherwise. If copy_to_fd is
+ * >= 0 the content is also copied there. */
+char *
+fsverity_digest_fd (int fd, const char *path, gsize *digest_len_out, int copy_to_fd,
+                    GError **error)
+{
+  guchar digest[VALIDATOR_FSVERITY_DIGEST_LEN];
+
+  if (measure_verity (fd, digest))
+    {
+      /* Files with fs-verity are immutable, so any copy we make has the
+       * validated content */
+      if (copy_to_fd >= 0 && copy_fd (fd, copy_to_fd) < 0)
+        {
+          g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                       "Can't write copy of %s: %s", path, strerror (errno));
+          return NULL;
+        }
+
+      return make_formatted_digest (digest, digest_len_out);
+    }
+
+  if (!compute_verity (fd, path, copy_to_fd, digest, error))
+    return NULL;
+
+  return make_formatted_digest (digest, digest_len_out);
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright © 2023 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+
+#include <glib.h>
+
+/* Files signed by their fs-verity digest use the fs-verity "formatted
+ * digest": "FSVerity", then the le16 hash algorithm and digest size,
+ * and the digest. Only SHA-256 with 4096 byte blocks and no salt (the
+ * fsverity defaults) is supported. */
+#define VALIDATOR_FSVERITY_MAGIC "FSVerity"
+#define VALIDATOR_FSVERITY_MAGIC_LEN 8
+#define VALIDATOR_FSVERITY_DIGEST_LEN 32
+#define VALIDATOR_FSVERITY_CONTENT_LEN \
+  (VALIDATOR_FSVERITY_MAGIC_LEN + 4 + VALIDATOR_FSVERITY_DIGEST_LEN)
+
+char *fsverity_digest_fd (int fd, const char *path, gsize *digest_len_out, int copy_to_fd,
+                          GError **error);
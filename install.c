@@ -20,234 +20,1498 @@
 
 #include "config.h"
 #include "main.h"
+#include "watch.h"
+#include "probes.h"
 
+#include <dirent.h>
 #include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/syscall.h>
+#include <sys/xattr.h>
 #include <unistd.h>
 
+#ifndef HAVE_RENAMEAT2
+static int
+renameat2 (int olddirfd, const char *oldpath, int newdirfd, const char *newpath,
+           unsigned int flags)
+{
+  return syscall (SYS_renameat2, olddirfd, oldpath, newdirfd, newpath, flags);
+}
+#endif
+
+/* How installed files are made durable before they replace the old ones */
+typedef enum
+{
+  INSTALL_DURABILITY_NONE,  /* Just rename into place and let the kernel write it back */
+  INSTALL_DURABILITY_BATCH, /* One syncfs() before all the renames, and one after */
+  INSTALL_DURABILITY_FILE,  /* fsync() each file before, and its directory after, the rename */
+} InstallDurability;
+
+typedef struct InstallBatch InstallBatch;
+
 typedef struct
 {
   gboolean recursive;
   gboolean force;
+  gboolean incremental;
   char *path_relative;
   char *path_prefix;
-  GList *public_keys;
+  Keyring *public_keys;
+  gboolean files_from; /* Also install the files listed in --files-from */
+  InstallDurability durability;
+  gboolean staged;
+  char *bundle;              /* Installed instead of the sources, if set */
+  VerifyCache *verify_cache; /* Shared by all configs, if any */
+  InstallBatch *batch;       /* While installing, with durability=batch */
+  const char *destination;   /* The root installed into, while installing */
+  int jobs;                  /* Walker workers, as for --jobs */
+
+  /* Statistics, updated from worker threads */
+  gint n_installed;
+  gint n_unchanged;
 } InstallOptions;
 
+/* In incremental mode installed files get an xattr with the digest of
+ * the content and the mtime of the file when it was written, so later
+ * installs can detect an unchanged destination without re-hashing it. */
+#define INSTALLED_DIGEST_XATTR "user.validator.sha512"
+#define INSTALLED_DIGEST_LEN 64
+#define INSTALLED_DIGEST_XATTR_LEN (INSTALLED_DIGEST_LEN + 12)
+
+static void
+make_installed_digest_xattr (guchar *buf, const guchar *digest, struct stat *st)
+{
+  guint64 mtime_sec = GUINT64_TO_LE (st->st_mtim.tv_sec);
+  guint32 mtime_nsec = GUINT32_TO_LE (st->st_mtim.tv_nsec);
+
+  memcpy (buf, digest, INSTALLED_DIGEST_LEN);
+  memcpy (buf + INSTALLED_DIGEST_LEN, &mtime_sec, 8);
+  memcpy (buf + INSTALLED_DIGEST_LEN + 8, &mtime_nsec, 4);
+}
+
+/* Best effort, not all filesystems support user xattrs */
+static void
+set_installed_digest (int fd, const char *path, const guchar *digest, gsize digest_len)
+{
+  guchar buf[INSTALLED_DIGEST_XATTR_LEN];
+  struct stat st;
+
+  if (digest_len != INSTALLED_DIGEST_LEN)
+    return;
+
+  int res = fd >= 0 ? fstat (fd, &st) : lstat (path, &st);
+  if (res < 0)
+    return;
+
+  make_installed_digest_xattr (buf, digest, &st);
+
+  if (fd >= 0)
+    res = fsetxattr (fd, INSTALLED_DIGEST_XATTR, buf, sizeof (buf), 0);
+  else
+    res = lsetxattr (path, INSTALLED_DIGEST_XATTR, buf, sizeof (buf), 0);
+  if (res < 0)
+    log_debug ("Can't set digest xattr on '%s': %s", path, strerror (errno));
+}
+
+/* Checks if an existing destination (of the same type and size as the
+ * source) already has the validated content. This uses the digest
+ * xattr if it is up to date, otherwise the file is hashed, and the
+ * xattr is added if update_xattr is set. That must not be set when the
+ * destination is a hardlink to the live tree (--staged), since that
+ * would modify the live inode before anything is published. */
 static gboolean
-replace_file (const char *destination_file, int content_fd, GError **error)
+destination_is_unchanged (const char *destination_file, struct stat *dest_st, int type,
+                          ValidatorDigestType digest_type, const guchar *content,
+                          gsize content_len, gboolean update_xattr)
 {
-  g_autofree gchar *destination_file_tmp = g_strdup_printf ("%s.XXXXXX", destination_file);
+  if (type == S_IFREG && digest_type == VALIDATOR_DIGEST_SHA512
+      && content_len == INSTALLED_DIGEST_LEN)
+    {
+      guchar expected[INSTALLED_DIGEST_XATTR_LEN];
+      guchar buf[INSTALLED_DIGEST_XATTR_LEN];
+
+      make_installed_digest_xattr (expected, content, dest_st);
+      ssize_t len = lgetxattr (destination_file, INSTALLED_DIGEST_XATTR, buf, sizeof (buf));
+      if (len == sizeof (buf) && memcmp (buf, expected, sizeof (buf)) == 0)
+        return TRUE;
+    }
 
-  errno = 0;
-  autofd int tmp_fd = g_mkstemp_full (destination_file_tmp, O_RDWR, 0644);
-  if (tmp_fd == -1)
+  g_autoptr (GError) error = NULL;
+  g_autofree guchar *dest_content = NULL;
+  gsize dest_content_len = 0;
+  if (!load_file_data_for_sign (destination_file, dest_st, digest_type, NULL, &dest_content,
+                                &dest_content_len, -1, &error))
     {
-      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
-                   "Can't open tempfile for '%s': %s\n", destination_file, strerror (errno));
+      log_debug ("Can't check existing '%s': %s", destination_file, error->message);
       return FALSE;
     }
 
-  int res = copy_fd (content_fd, tmp_fd);
-  if (res < 0)
+  if (dest_content_len != content_len || memcmp (dest_content, content, content_len) != 0)
+    return FALSE;
+
+  /* Up to date, but without a valid xattr, so add one for next time */
+  if (update_xattr && type == S_IFREG && digest_type == VALIDATOR_DIGEST_SHA512)
+    set_installed_digest (-1, destination_file, content, content_len);
+
+  return TRUE;
+}
+
+/* The content of an installed file is written to a temporary file
+ * while it is being hashed, and then renamed into place once
+ * validated. Since the destination directory must not be created until
+ * we know the file is valid, the temporary file may live in a parent
+ * directory, but never outside the destination. Where supported it is
+ * an O_TMPFILE, so unvalidated content never has a name, and it is only
+ * linked into the destination directory once validated. */
+typedef struct
+{
+  char *path; /* NULL while it is an unnamed O_TMPFILE */
+  char *dir;  /* Where it was created */
+  int fd;
+} TmpFile;
+
+#define TMP_FILE_INIT { NULL, NULL, -1 }
+
+static void
+tmp_file_clear (TmpFile *tmp)
+{
+  if (tmp->path)
     {
-      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
-                   "Can't write to '%s': %s\n", destination_file_tmp, strerror (errno));
-      (void)unlink (destination_file_tmp);
-      return FALSE;
+      (void)unlink (tmp->path);
+      g_clear_pointer (&tmp->path, g_free);
     }
+  g_clear_pointer (&tmp->dir, g_free);
+  close_fd (&tmp->fd);
+}
 
-  res = rename (destination_file_tmp, destination_file);
-  if (res < 0)
+G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC (TmpFile, tmp_file_clear)
+
+static int
+tmp_file_open_in (TmpFile *tmp, const char *dir, const char *basename)
+{
+  g_autofree char *path = NULL;
+
+  stats_count (STATS_SYSCALLS, 1);
+  int fd = open (dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0644);
+  if (fd == -1 && (errno == EOPNOTSUPP || errno == EISDIR || errno == EINVAL))
     {
-      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno), "Can't create '%s': %s\n",
-                   destination_file, strerror (errno));
-      (void)unlink (destination_file_tmp);
-      return FALSE;
+      /* No O_TMPFILE support, in the kernel or the filesystem */
+      path = g_strdup_printf ("%s/%s.XXXXXX", dir, basename);
+      errno = 0;
+      fd = g_mkstemp_full (path, O_RDWR, 0644);
+      stats_count (STATS_SYSCALLS, 1);
     }
+  if (fd == -1)
+    return -1;
 
-  return TRUE;
+  tmp->path = g_steal_pointer (&path);
+  tmp->dir = g_strdup (dir);
+  tmp->fd = fd;
+  return 0;
 }
 
+/* Opens the temporary file in destination_dir, or if that wasn't
+ * created yet in its nearest existing parent inside root (which is
+ * created if needed) */
 static gboolean
-install (InstallOptions *opt, const char *path, const char *relative_to,
-         const char *destination_dir, gboolean toplevel)
+tmp_file_open (TmpFile *tmp, const char *root, const char *destination_dir, const char *basename,
+               GError **error)
 {
-  struct stat st;
-  gboolean success = TRUE;
+  g_autofree char *dir = g_strdup (destination_dir);
+  gboolean created_root = FALSE;
 
-  int res = lstat (path, &st);
-  if (res < 0)
+  while (tmp_file_open_in (tmp, dir, basename) < 0)
     {
-      g_printerr ("Can't access '%s': %s\n", path, strerror (errno));
+      int errsv = errno;
+      g_autofree char *parent = g_path_get_dirname (dir);
+
+      if (errsv == ENOENT && has_path_prefix (parent, root) && strcmp (parent, dir) != 0)
+        {
+          g_free (dir);
+          dir = g_steal_pointer (&parent);
+          continue;
+        }
+
+      if (errsv == ENOENT && has_path_prefix (dir, root) && !created_root)
+        {
+          created_root = TRUE;
+          stats_count (STATS_SYSCALLS, 1);
+          if (g_mkdir_with_parents (dir, 0755) == 0)
+            continue;
+          errsv = errno;
+        }
+
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errsv),
+                   "Can't open tempfile for '%s/%s': %s", destination_dir, basename,
+                   strerror (errsv));
       return FALSE;
     }
 
-  int type = st.st_mode & S_IFMT;
-  if (type == S_IFREG || type == S_IFLNK)
+  return TRUE;
+}
+
+/* Gives an unnamed temporary file a (temporary) name in dir */
+static int
+tmp_file_link_in (TmpFile *tmp, const char *dir, const char *basename)
+{
+  g_autofree char *fd_path = g_strdup_printf ("/proc/self/fd/%d", tmp->fd);
+
+  while (TRUE)
     {
-      g_autofree char *sig_path = g_strconcat (path, ".sig", NULL);
+      g_autofree char *path
+          = g_strdup_printf ("%s/%s.%06x", dir, basename, g_random_int () & 0xffffff);
 
-      g_autofree char *signature = NULL;
-      gsize signature_len = 0;
+      /* AT_EMPTY_PATH needs CAP_DAC_READ_SEARCH, /proc works for all */
+      stats_count (STATS_SYSCALLS, 1);
+      int res = linkat (tmp->fd, "", AT_FDCWD, path, AT_EMPTY_PATH);
+      if (res < 0 && errno == ENOENT)
+        {
+          stats_count (STATS_SYSCALLS, 1);
+          res = linkat (AT_FDCWD, fd_path, AT_FDCWD, path, AT_SYMLINK_FOLLOW);
+        }
 
-      g_autoptr (GError) error = NULL;
-      if (!g_file_get_contents (sig_path, &signature, &signature_len, &error))
+      if (res == 0)
         {
-          if (g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
-            g_printerr ("No signature for '%s'\n", path);
-          else
-            g_printerr ("Failed to load '%s': %s\n", sig_path, error->message);
-          return FALSE;
+          tmp->path = g_steal_pointer (&path);
+          g_free (tmp->dir);
+          tmp->dir = g_strdup (dir);
+          return 0;
         }
+      if (errno != EEXIST)
+        return -1;
+    }
+}
 
-      g_autofree guchar *content = NULL;
-      gsize content_len = 0;
-      autofd int content_fd = -1;
-      if (!load_file_data_for_sign (path, &st, NULL, &content, &content_len, &content_fd, &error))
+/* Names the temporary file in dir, moving it there if it was put in a
+ * parent because dir didn't exist yet. If the parent is on a different
+ * filesystem (a mount inside the destination) the (validated) file is
+ * copied instead. */
+static gboolean
+tmp_file_move_to (TmpFile *tmp, const char *dir, const char *basename, GError **error)
+{
+  if (tmp->path == NULL)
+    {
+      if (tmp_file_link_in (tmp, dir, basename) == 0)
+        return TRUE;
+      if (errno != EXDEV)
         {
-          g_printerr ("Failed to load '%s': %s\n", path, error->message);
+          g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                       "Can't create tempfile for '%s/%s': %s", dir, basename, strerror (errno));
           return FALSE;
         }
+    }
+  else if (strcmp (tmp->dir, dir) == 0)
+    return TRUE;
+
+  g_auto (TmpFile) moved = TMP_FILE_INIT;
+  if (!tmp_file_open (&moved, dir, dir, basename, error)
+      || (moved.path == NULL && tmp_file_link_in (&moved, dir, basename) < 0))
+    {
+      if (error && *error == NULL)
+        g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                     "Can't create tempfile for '%s/%s': %s", dir, basename, strerror (errno));
+      return FALSE;
+    }
+
+  stats_count (STATS_SYSCALLS, 1);
+  if (tmp->path && rename (tmp->path, moved.path) == 0)
+    {
+      /* moved.path is now our file, not the one moved.fd was opened for */
+      g_clear_pointer (&tmp->path, g_free);
+      close_fd (&moved.fd);
+      moved.fd = steal_fd (&tmp->fd);
+    }
+  else if (tmp->path && errno != EXDEV)
+    {
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno), "Can't move '%s': %s",
+                   tmp->path, strerror (errno));
+      return FALSE;
+    }
+  else if (lseek (tmp->fd, 0, SEEK_SET) < 0 || copy_fd (tmp->fd, moved.fd) < 0)
+    {
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno), "Can't write to '%s': %s",
+                   moved.path, strerror (errno));
+      return FALSE;
+    }
+
+  tmp_file_clear (tmp);
+  *tmp = moved;
+  moved.path = NULL;
+  moved.dir = NULL;
+  moved.fd = -1;
+  return TRUE;
+}
 
-      g_autofree char *rel_path = opt_get_relative_path (path, relative_to, opt->path_prefix);
-      if (rel_path == NULL)
+static gboolean
+fsync_dir (const char *dir, GError **error)
+{
+  autofd int fd = open (dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  stats_count (STATS_SYSCALLS, 2);
+  if (fd < 0 || fsync (fd) < 0)
+    {
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno), "Can't sync '%s': %s",
+                   dir, strerror (errno));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+tmp_file_replace (TmpFile *tmp, const char *destination_file, const char *basename,
+                  InstallDurability durability, GError **error)
+{
+  g_autofree char *destination_dir = g_path_get_dirname (destination_file);
+
+  /* Rename within the destination filesystem */
+  if (!tmp_file_move_to (tmp, destination_dir, basename, error))
+    return FALSE;
+
+  if (durability == INSTALL_DURABILITY_FILE)
+    {
+      stats_count (STATS_SYSCALLS, 1);
+      if (fsync (tmp->fd) < 0)
         {
-          g_printerr ("File '%s' not inside relative dir\n", path);
+          g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                       "Can't sync '%s': %s", tmp->path, strerror (errno));
           return FALSE;
         }
+    }
+
+  stats_count (STATS_SYSCALLS, 1);
+  if (rename (tmp->path, destination_file) < 0)
+    {
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno), "Can't create '%s': %s",
+                   destination_file, strerror (errno));
+      return FALSE;
+    }
+
+  /* Renamed, nothing to clean up */
+  g_clear_pointer (&tmp->path, g_free);
+
+  if (durability == INSTALL_DURABILITY_FILE)
+    return fsync_dir (destination_dir, error);
+
+  return TRUE;
+}
+
+/* With durability=batch, regular files are renamed into place only
+ * after all of them are written, and a single syncfs() per destination
+ * filesystem has made their content durable. A second syncfs() after
+ * the renames makes them (and the new directories and symlinks)
+ * durable too. */
+typedef struct
+{
+  char *tmp_path;
+  char *destination_file;
+} InstallRename;
+
+struct InstallBatch
+{
+  GMutex lock;
+  GPtrArray *renames;      /* InstallRename, in the order they were validated */
+  GHashTable *filesystems; /* st_dev -> a destination dir on it */
+};
+
+static void
+install_rename_free (InstallRename *rename)
+{
+  g_free (rename->tmp_path);
+  g_free (rename->destination_file);
+  g_free (rename);
+}
+
+static void
+install_batch_init (InstallBatch *batch)
+{
+  g_mutex_init (&batch->lock);
+  batch->renames = g_ptr_array_new_with_free_func ((GDestroyNotify)install_rename_free);
+  batch->filesystems = g_hash_table_new_full (g_int64_hash, g_int64_equal, g_free, g_free);
+}
+
+static void
+install_batch_clear (InstallBatch *batch)
+{
+  /* Temporary files of renames that didn't happen */
+  for (guint i = 0; i < batch->renames->len; i++)
+    {
+      InstallRename *rename = g_ptr_array_index (batch->renames, i);
+      if (rename->tmp_path)
+        (void)unlink (rename->tmp_path);
+    }
+
+  g_ptr_array_unref (batch->renames);
+  g_hash_table_unref (batch->filesystems);
+  g_mutex_clear (&batch->lock);
+}
+
+/* Takes over the temporary file, to be renamed when the batch is committed */
+static gboolean
+install_batch_add (InstallBatch *batch, TmpFile *tmp, const char *destination_file,
+                   const char *basename, GError **error)
+{
+  g_autofree char *destination_dir = g_path_get_dirname (destination_file);
+  if (!tmp_file_move_to (tmp, destination_dir, basename, error))
+    return FALSE;
+
+  struct stat st;
+  stats_count (STATS_SYSCALLS, 1);
+  if (fstat (tmp->fd, &st) < 0)
+    {
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                   "Can't access '%s': %s", tmp->path, strerror (errno));
+      return FALSE;
+    }
+
+  InstallRename *rename = g_new0 (InstallRename, 1);
+  rename->tmp_path = g_steal_pointer (&tmp->path);
+  rename->destination_file = g_strdup (destination_file);
+  close_fd (&tmp->fd);
+
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&batch->lock);
+  g_ptr_array_add (batch->renames, rename);
+
+  guint64 dev = st.st_dev;
+  if (!g_hash_table_contains (batch->filesystems, &dev))
+    g_hash_table_insert (batch->filesystems, g_memdup2 (&dev, sizeof (dev)),
+                         g_steal_pointer (&destination_dir));
+
+  return TRUE;
+}
+
+static gboolean
+install_batch_sync (InstallBatch *batch)
+{
+  gboolean res = TRUE;
+  GHashTableIter iter;
+  gpointer value;
+
+  g_hash_table_iter_init (&iter, batch->filesystems);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      const char *dir = value;
+      autofd int fd = open (dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      stats_count (STATS_SYSCALLS, 2);
+      if (fd < 0 || syncfs (fd) < 0)
+        {
+          g_printerr ("Can't sync filesystem of '%s': %s\n", dir, strerror (errno));
+          res = FALSE;
+        }
+    }
+
+  return res;
+}
+
+static gboolean
+install_batch_commit (InstallBatch *batch, InstallOptions *opt)
+{
+  if (batch->renames->len == 0)
+    return TRUE;
+
+  /* Nothing is replaced unless all the new content is on disk */
+  gint64 start = stats_begin ();
+  if (!install_batch_sync (batch))
+    {
+      stats_end (STATS_PHASE_INSTALL, start);
+      return FALSE;
+    }
 
-      g_autoptr (GError) validate_error = NULL;
-      if (!validate_data (rel_path, type, content, content_len, signature, signature_len,
-                          opt->public_keys, &validate_error))
+  gboolean res = TRUE;
+  for (guint i = 0; i < batch->renames->len; i++)
+    {
+      InstallRename *rename = g_ptr_array_index (batch->renames, i);
+
+      VALIDATOR_PROBE1 (replace__begin, rename->destination_file);
+      stats_count (STATS_SYSCALLS, 1);
+      gboolean renamed = renameat (AT_FDCWD, rename->tmp_path, AT_FDCWD, rename->destination_file)
+                         == 0;
+      VALIDATOR_PROBE2 (replace__end, rename->destination_file, renamed);
+      if (!renamed)
         {
-          if (validate_error)
-            g_printerr ("Signature of '%s' (as '%s') is invalid: %s\n", path, rel_path,
-                        validate_error->message);
-          else
-            g_printerr ("Signature of '%s' (as '%s') is invalid\n", path, rel_path);
-          return FALSE;
+          g_printerr ("Can't create '%s': %s\n", rename->destination_file, strerror (errno));
+          g_atomic_int_add (&opt->n_installed, -1);
+          res = FALSE;
+          continue;
         }
 
-      g_autofree char *basename = g_path_get_basename (path);
-      g_autofree char *destination_file = g_build_filename (destination_dir, basename, NULL);
+      g_clear_pointer (&rename->tmp_path, g_free);
+    }
+
+  if (!install_batch_sync (batch))
+    res = FALSE;
+  stats_end (STATS_PHASE_INSTALL, start);
+
+  return res;
+}
+
+/* Put a validated file in place: creates the directory, then the
+ * symlink, or renames the temporary copy of a regular file */
+static gboolean
+install_validated (InstallOptions *opt, const char *destination_dir, const char *destination_file,
+                   const char *basename, int type, const guchar *content, TmpFile *tmp,
+                   GError **error)
+{
+  int res;
+
+  stats_count (STATS_SYSCALLS, 1);
+  if (g_mkdir_with_parents (destination_dir, 0755) < 0)
+    {
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                   "Unable to create dir '%s': %s", destination_dir, strerror (errno));
+      return FALSE;
+    }
 
-      if (!opt->force && g_file_test (destination_file, G_FILE_TEST_EXISTS))
+  if (type == S_IFLNK)
+    {
+      res = unlink (destination_file);
+      if (res < 0 && errno != ENOENT)
+        {
+          g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                       "Can't remove old symlink '%s': %s", destination_file, strerror (errno));
+          return FALSE;
+        }
+      res = symlink ((const char *)content, destination_file);
+      if (res < 0)
         {
-          g_info ("File '%s' already exist, ignoring", destination_file);
-          return TRUE;
+          g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                       "Can't create symlink '%s': %s", destination_file, strerror (errno));
+          return FALSE;
         }
+      stats_count (STATS_SYSCALLS, 2);
+
+      if (opt->durability == INSTALL_DURABILITY_FILE && !fsync_dir (destination_dir, error))
+        return FALSE;
+    }
+  else if (opt->batch)
+    {
+      g_assert (tmp->fd != -1);
+
+      if (!install_batch_add (opt->batch, tmp, destination_file, basename, error))
+        return FALSE;
+    }
+  else
+    {
+      g_assert (tmp->fd != -1);
+
+      VALIDATOR_PROBE1 (replace__begin, destination_file);
+      gboolean replaced
+          = tmp_file_replace (tmp, destination_file, basename, opt->durability, error);
+      VALIDATOR_PROBE2 (replace__end, destination_file, replaced);
+      if (!replaced)
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+install_file (WalkItem *item, gpointer user_data, GError **error)
+{
+  InstallOptions *opt = user_data;
+  const char *path = item->path;
+  const char *destination_dir = item->destination_dir;
+  Manifest *manifest = item->root_data;
+  int type = item->type;
+
+  g_autofree char *rel_path = opt_get_relative_path (path, item->relative_to, opt->path_prefix);
+  if (rel_path == NULL)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "File '%s' not inside relative dir",
+                   path);
+      return FALSE;
+    }
+
+  const char *basename = item->name;
+  g_autofree char *destination_file = g_build_filename (destination_dir, basename, NULL);
+
+  /* Without --force existing destinations are kept whatever the source
+   * is, so that is checked first, and the source isn't read at all */
+  if (!opt->force && g_file_test (destination_file, G_FILE_TEST_EXISTS))
+    {
+      log_info ("File '%s' already exist, ignoring", destination_file);
+      stats_count (STATS_FILES_KEPT, 1);
+      stats_count (STATS_BYTES_KEPT, item->st.st_size);
+      g_atomic_int_inc (&opt->n_unchanged);
+      return TRUE;
+    }
+
+  /* Files not in the manifest (if any) need a separate signature */
+  gboolean in_manifest
+      = manifest != NULL && manifest_lookup (manifest, rel_path, NULL, NULL, NULL);
+
+  g_autofree char *signature = NULL;
+  gsize signature_len = 0;
+
+  if (!in_manifest)
+    {
+      if (!sigpack_load_signature (item->sigpack, item->dir_fd, item->name, path, &signature,
+                                   &signature_len, error))
+        return FALSE;
+    }
 
-      if (g_mkdir_with_parents (destination_dir, 0755) < 0)
+  /* In incremental mode, a destination that may already be up to date is
+   * compared to the source after validation, before copying anything. */
+  struct stat dest_st;
+  gboolean maybe_unchanged = opt->incremental && lstat (destination_file, &dest_st) == 0
+                             && (dest_st.st_mode & S_IFMT) == type
+                             && (type != S_IFREG || dest_st.st_size == item->st.st_size);
+
+  /* An unchanged source that was verified before isn't hashed and
+   * verified again, its content is only checked when it is copied. */
+  guchar cache_key[VERIFY_CACHE_KEY_LEN];
+  gboolean use_cache = opt->verify_cache && !in_manifest
+                       && verify_cache_make_key (&item->st, rel_path, signature, signature_len,
+                                                 opt->public_keys, cache_key);
+  g_autofree guchar *content = NULL;
+  gsize content_len = 0;
+  if (use_cache)
+    content = verify_cache_lookup (opt->verify_cache, path, cache_key, &content_len);
+  gboolean cached = content != NULL;
+
+  /* Regular files are copied while hashing, so we read each file only
+   * once, and what we install is exactly what was validated. */
+  g_auto (TmpFile) tmp = TMP_FILE_INIT;
+  if (type == S_IFREG && !maybe_unchanged && !cached
+      && !tmp_file_open (&tmp, opt->destination, destination_dir, basename, error))
+    return FALSE;
+
+  ValidatorDigestType digest_type = in_manifest
+                                        ? VALIDATOR_DIGEST_SHA512
+                                        : signature_get_digest_type (signature, signature_len);
+  if (cached)
+    log_debug ("'%s' (as '%s') was verified before", path, rel_path);
+  else
+    {
+      if (!load_file_data_for_sign_at (item->dir_fd, item->name, path, &item->st, digest_type,
+                                       NULL, &content, &content_len, tmp.fd, error))
         {
-          g_printerr ("Unable to create dir '%s': %s", destination_file, strerror (errno));
+          g_prefix_error (error, "Failed to load '%s': ", path);
           return FALSE;
         }
 
-      if (type == S_IFLNK)
+      if (in_manifest)
         {
-          res = unlink (destination_file);
-          if (res < 0 && errno != ENOENT)
-            {
-              g_printerr ("Can't remove old symlink '%s': %s\n", destination_file,
-                          strerror (errno));
-              return FALSE;
-            }
-          res = symlink ((char *)content, destination_file);
-          if (res < 0)
+          if (!manifest_validate (manifest, rel_path, type, content, content_len))
             {
-              g_printerr ("Can't create symlink '%s': %s\n", destination_file, strerror (errno));
+              g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                           "Signature of '%s' (as '%s') is invalid: Doesn't match manifest",
+                           path, rel_path);
               return FALSE;
             }
         }
       else
         {
-          g_assert (content_fd != -1);
-
-          g_autoptr (GError) replace_error = NULL;
-          if (!replace_file (destination_file, content_fd, &replace_error))
+          g_autoptr (GError) validate_error = NULL;
+          if (!validate_data (rel_path, type, content, content_len, signature, signature_len,
+                              opt->public_keys, &validate_error))
             {
-              g_printerr ("%s\n", replace_error->message);
+              if (validate_error)
+                g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                             "Signature of '%s' (as '%s') is invalid: %s", path, rel_path,
+                             validate_error->message);
+              else
+                g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                             "Signature of '%s' (as '%s') is invalid", path, rel_path);
               return FALSE;
             }
+
+          if (use_cache)
+            verify_cache_add (opt->verify_cache, path, cache_key, content, content_len);
         }
+    }
 
-      g_info ("Installed file '%s'", destination_file);
+  if (maybe_unchanged
+      && destination_is_unchanged (destination_file, &dest_st, type, digest_type, content,
+                                   content_len, !opt->staged))
+    {
+      log_info ("File '%s' is unchanged, ignoring", destination_file);
+      g_atomic_int_inc (&opt->n_unchanged);
+      return TRUE;
     }
-  else if (type == S_IFDIR)
+
+  if (type == S_IFREG && tmp.fd == -1)
     {
-      /* NOTE: It is important that we don't actually create a target directory
-       * here until we have a validated source file in this directory, because
-       * otherwise that would allow the creation of arbitrary directory names
-       * without validation. */
+      /* We didn't copy while validating, so copy now, and make sure
+       * the copy is still what we validated */
+      g_autofree guchar *copied_content = NULL;
+      gsize copied_content_len = 0;
 
-      g_autoptr (GError) dir_error = NULL;
-      g_autoptr (GDir) dir = g_dir_open (path, 0, &dir_error);
-      if (dir == NULL)
-        {
-          if (g_error_matches (dir_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
-            return TRUE;
+      if (!tmp_file_open (&tmp, opt->destination, destination_dir, basename, error))
+        return FALSE;
 
-          g_printerr ("Failed to open dir '%s': %s\n", path, strerror (errno));
+      if (!load_file_data_for_sign_at (item->dir_fd, item->name, path, &item->st, digest_type,
+                                       NULL, &copied_content, &copied_content_len, tmp.fd, error))
+        {
+          g_prefix_error (error, "Failed to load '%s': ", path);
           return FALSE;
         }
 
-      g_autofree char *basename = g_path_get_basename (path);
-      g_autofree char *destination_subdir
-          = g_build_filename (destination_dir, toplevel ? NULL : basename, NULL);
-
-      const char *child;
-      while ((child = g_dir_read_name (dir)) != NULL)
+      if (copied_content_len != content_len || memcmp (copied_content, content, content_len) != 0)
         {
-          if (g_str_has_suffix (child, ".sig"))
-            continue; /* Skip existing signatures */
-
-          g_autofree char *child_path = g_build_filename (path, child, NULL);
-          if (!install (opt, child_path, relative_to, destination_subdir, FALSE))
-            success = FALSE;
+          g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                       "File '%s' changed while being installed", path);
+          return FALSE;
         }
     }
-  else
-    {
-      g_printerr ("Can't validate '%s' due to unsupported file type'\n", path);
-      success = FALSE;
-    }
 
-  return success;
+  if (opt->incremental && type == S_IFREG && digest_type == VALIDATOR_DIGEST_SHA512)
+    set_installed_digest (tmp.fd, destination_file, content, content_len);
+
+  /* NOTE: It is important that we don't actually create a target directory
+   * until we have a validated source file in this directory, because
+   * otherwise that would allow the creation of arbitrary directory names
+   * without validation. */
+  gint64 start = stats_begin ();
+  gboolean installed = install_validated (opt, destination_dir, destination_file, basename, type,
+                                          content, &tmp, error);
+  stats_end (STATS_PHASE_INSTALL, start);
+  if (!installed)
+    return FALSE;
+
+  log_info ("Installed file '%s'", destination_file);
+  g_atomic_int_inc (&opt->n_installed);
+
+  return TRUE;
 }
 
-static gboolean
-install_for_config (InstallOptions *opt, const char **sources, const char *destination)
+typedef struct
 {
-  gboolean res = TRUE;
-  for (gsize i = 0; sources[i] != NULL; i++)
-    {
-      g_autofree char *path = g_canonicalize_filename (sources[i], NULL);
+  InstallOptions *opt;
+  Walker *walker;
+  GHashTable *manifests;
+  const char *destination;
+} InstallList;
 
-      if (g_file_test (path, G_FILE_TEST_IS_DIR))
+/* Listed files keep their path below the relative dir in the destination */
+static void
+install_list_entry (const char *path, gpointer user_data)
+{
+  InstallList *list = user_data;
+  InstallOptions *opt = list->opt;
+  g_autofree char *dirname = g_path_get_dirname (path);
+  const char *relative_to = opt->path_relative ? opt->path_relative : dirname;
+
+  g_autofree char *rel_dir = opt_get_relative_path (dirname, relative_to, NULL);
+  if (rel_dir == NULL)
+    {
+      walker_add_error (list->walker, g_error_new (G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                                                   "File '%s' not inside relative dir", path));
+      return;
+    }
+
+  g_autoptr (GError) error = NULL;
+  Manifest *manifest = manifest_cache_load (list->manifests, relative_to, opt->path_prefix,
+                                            opt->public_keys, &error);
+  if (error)
+    walker_add_error (list->walker, g_steal_pointer (&error));
+
+  g_autofree char *destination_dir = g_build_filename (list->destination, rel_dir, NULL);
+  walker_set_root_data (list->walker, manifest);
+  walker_walk_file (list->walker, path, relative_to, destination_dir);
+}
+
+static void
+install_begin (InstallOptions *opt, const char *destination, InstallBatch *batch)
+{
+  opt->destination = destination;
+
+  if (opt->durability == INSTALL_DURABILITY_BATCH)
+    {
+      install_batch_init (batch);
+      opt->batch = batch;
+    }
+}
+
+/* After the walker finished, commits what was batched */
+static gboolean
+install_end (InstallOptions *opt)
+{
+  gboolean res = TRUE;
+
+  opt->destination = NULL;
+
+  /* Files that were validated are installed even if others failed */
+  if (opt->batch)
+    {
+      res = install_batch_commit (opt->batch, opt);
+      install_batch_clear (opt->batch);
+      opt->batch = NULL;
+    }
+
+  return res;
+}
+
+static gboolean
+install_tree (InstallOptions *opt, const char **sources, const char *destination)
+{
+  g_autoptr (GHashTable) manifests = manifest_cache_new ();
+  g_autoptr (Walker) walker = walker_new (opt->jobs, install_file, opt);
+
+  gboolean res = TRUE;
+
+  InstallBatch batch;
+  install_begin (opt, destination, &batch);
+
+  for (gsize i = 0; sources[i] != NULL; i++)
+    {
+      g_autofree char *path = g_canonicalize_filename (sources[i], NULL);
+      g_autofree char *dirname = NULL;
+      const char *relative_to;
+
+      if (g_file_test (path, G_FILE_TEST_IS_DIR))
         {
           if (!opt->recursive)
             {
               g_printerr ("error: '%s' is a directory and not in recursive mode\n", path);
-              return EXIT_FAILURE;
+              res = FALSE;
+              break;
             }
 
-          if (!install (opt, path, opt->path_relative ? opt->path_relative : path, destination,
-                        TRUE))
-            res = FALSE;
+          relative_to = opt->path_relative ? opt->path_relative : path;
         }
       else if (g_file_test (path, G_FILE_TEST_IS_REGULAR))
         {
-          g_autofree char *dirname = g_path_get_dirname (path);
+          /* TODO: Handle opt->path_relative here?? */
+          dirname = g_path_get_dirname (path);
+          relative_to = dirname;
+        }
+      else
+        continue;
+
+      g_autoptr (GError) error = NULL;
+      Manifest *manifest = manifest_cache_load (manifests, relative_to, opt->path_prefix,
+                                                opt->public_keys, &error);
+      if (error)
+        walker_add_error (walker, g_steal_pointer (&error));
+
+      walker_set_root_data (walker, manifest);
+      walker_walk (walker, path, relative_to, destination, TRUE);
+    }
+
+  if (res && opt->files_from)
+    {
+      InstallList list = { opt, walker, manifests, destination };
+      g_autoptr (GError) error = NULL;
+      if (!opt_read_files_from (install_list_entry, &list, &error))
+        walker_add_error (walker, g_steal_pointer (&error));
+    }
+
+  if (!walker_finish (walker))
+    res = FALSE;
+
+  if (!install_end (opt))
+    res = FALSE;
+
+  g_info ("Installed %d files into '%s', %d were already up to date", opt->n_installed,
+          destination, opt->n_unchanged);
+
+  return res;
+}
+
+/* Reads the content of the entry, into a temporary file for regular
+ * files, and installs it if it is valid. Only sets fatal_out if the
+ * bundle can't be read, after other errors the next entry can be. */
+static gboolean
+install_bundle_entry (InstallOptions *opt, BundleReader *reader, BundleEntry *entry,
+                      const char *destination, gboolean *fatal_out, GError **error)
+{
+  g_autoptr (GError) entry_error = NULL;
+  g_autofree char *destination_file = g_build_filename (destination, entry->path, NULL);
+  g_autofree char *destination_dir = g_path_get_dirname (destination_file);
+  g_autofree char *basename = g_path_get_basename (destination_file);
+  int type = entry->type == VALIDATOR_BUNDLE_SYMLINK ? S_IFLNK : S_IFREG;
+
+  /* Bundle paths must stay inside the destination */
+  if (!is_safe_relative_path (entry->path))
+    g_set_error (&entry_error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "Invalid path '%s' in bundle",
+                 entry->path);
+
+  /* Like for files in a tree, an existing destination is kept
+   * (without --force) before looking at the entry */
+  if (entry_error == NULL && !opt->force && g_file_test (destination_file, G_FILE_TEST_EXISTS))
+    {
+      if (!bundle_reader_read_content (reader, entry, -1, error))
+        {
+          *fatal_out = TRUE;
+          return FALSE;
+        }
+
+      log_info ("File '%s' already exist, ignoring", destination_file);
+      stats_count (STATS_FILES_KEPT, 1);
+      stats_count (STATS_BYTES_KEPT, entry->content_len);
+      opt->n_unchanged++;
+      return TRUE;
+    }
+
+  g_auto (TmpFile) tmp = TMP_FILE_INIT;
+  if (entry_error == NULL && type == S_IFREG)
+    tmp_file_open (&tmp, opt->destination, destination_dir, basename, &entry_error);
+
+  /* The content is skipped if the entry can't be installed anyway */
+  if (!bundle_reader_read_content (reader, entry, tmp.fd, error))
+    {
+      *fatal_out = TRUE;
+      return FALSE;
+    }
+
+  if (entry_error)
+    {
+      g_propagate_error (error, g_steal_pointer (&entry_error));
+      return FALSE;
+    }
+
+  ValidatorDigestType digest_type
+      = signature_get_digest_type ((char *)entry->signature, entry->signature_len);
+  if (digest_type == VALIDATOR_DIGEST_FSVERITY)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                   "Bundled '%s' has an unsupported fs-verity signature", entry->path);
+      return FALSE;
+    }
+
+  /* What is validated is the copy, which is then installed */
+  g_autofree guchar *content = NULL;
+  gsize content_len = 0;
+  if (type == S_IFLNK)
+    {
+      content = (guchar *)g_strdup (entry->symlink_target);
+      content_len = strlen (entry->symlink_target);
+    }
+  else
+    {
+      stats_count (STATS_SYSCALLS, 1);
+      if (lseek (tmp.fd, 0, SEEK_SET) < 0)
+        {
+          g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                       "Can't seek in copy of '%s': %s", entry->path, strerror (errno));
+          return FALSE;
+        }
+
+      content
+          = (guchar *)digest_file_fd (tmp.fd, entry->path, digest_type, &content_len, -1, error);
+      if (content == NULL)
+        return FALSE;
+    }
+
+  g_autofree char *rel_path
+      = opt->path_prefix ? g_build_filename (opt->path_prefix, entry->path, NULL)
+                         : g_strdup (entry->path);
+  g_autoptr (GError) validate_error = NULL;
+  if (!validate_data (rel_path, type, content, content_len, (char *)entry->signature,
+                      entry->signature_len, opt->public_keys, &validate_error))
+    {
+      if (validate_error)
+        g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                     "Signature of bundled '%s' (as '%s') is invalid: %s", entry->path, rel_path,
+                     validate_error->message);
+      else
+        g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                     "Signature of bundled '%s' (as '%s') is invalid", entry->path, rel_path);
+      return FALSE;
+    }
+
+  struct stat dest_st;
+  if (opt->incremental && lstat (destination_file, &dest_st) == 0
+      && (dest_st.st_mode & S_IFMT) == type
+      && (type != S_IFREG || dest_st.st_size == entry->content_len)
+      && destination_is_unchanged (destination_file, &dest_st, type, digest_type, content,
+                                   content_len, !opt->staged))
+    {
+      log_info ("File '%s' is unchanged, ignoring", destination_file);
+      opt->n_unchanged++;
+      return TRUE;
+    }
+
+  if (opt->incremental && type == S_IFREG && digest_type == VALIDATOR_DIGEST_SHA512)
+    set_installed_digest (tmp.fd, destination_file, content, content_len);
+
+  gint64 start = stats_begin ();
+  gboolean installed = install_validated (opt, destination_dir, destination_file, basename, type,
+                                          content, &tmp, error);
+  stats_end (STATS_PHASE_INSTALL, start);
+  if (!installed)
+    return FALSE;
+
+  log_info ("Installed file '%s'", destination_file);
+  opt->n_installed++;
+
+  return TRUE;
+}
+
+/* Bundles are installed in one pass over the stream, in the order of
+ * the records. Invalid entries are reported and skipped like invalid
+ * files in a tree, but an unreadable bundle stops the install. */
+static gboolean
+install_bundle (InstallOptions *opt, const char *destination)
+{
+  g_autoptr (GError) error = NULL;
+  g_autoptr (BundleReader) reader = bundle_reader_open (opt->bundle, &error);
+  if (reader == NULL)
+    {
+      g_printerr ("%s\n", error->message);
+      return FALSE;
+    }
+
+  gboolean res = TRUE;
+
+  InstallBatch batch;
+  install_begin (opt, destination, &batch);
+
+  while (TRUE)
+    {
+      g_auto (BundleEntry) entry = { 0 };
+      gboolean fatal = FALSE;
+
+      if (!bundle_reader_next (reader, &entry, &error))
+        fatal = TRUE;
+      else if (entry.type == VALIDATOR_BUNDLE_END)
+        break;
+      else if (!install_bundle_entry (opt, reader, &entry, destination, &fatal, &error))
+        res = FALSE;
+
+      if (error)
+        {
+          g_printerr ("%s\n", error->message);
+          g_clear_error (&error);
+        }
+
+      if (fatal)
+        {
+          res = FALSE;
+          break;
+        }
+    }
+
+  if (!install_end (opt))
+    res = FALSE;
+
+  g_info ("Installed %d files into '%s', %d were already up to date", opt->n_installed,
+          destination, opt->n_unchanged);
+
+  return res;
+}
+
+static gboolean
+install_sources (InstallOptions *opt, const char **sources, const char *destination)
+{
+  if (opt->bundle)
+    return install_bundle (opt, destination);
+
+  return install_tree (opt, sources, destination);
+}
+
+/* Staged installs build the new destination in a sibling directory,
+ * starting out with hardlinks (or reflinked copies) of its current
+ * content so the result is the same as installing in place, and then
+ * publish it by exchanging the two directories. Readers never see a
+ * partially installed tree. */
+
+static GPtrArray *
+read_dir_names (int fd, const char *path, GError **error)
+{
+  int stream_fd = fcntl (fd, F_DUPFD_CLOEXEC, 0);
+  DIR *stream = stream_fd >= 0 ? fdopendir (stream_fd) : NULL;
+  if (stream == NULL)
+    {
+      int errsv = errno;
+      if (stream_fd >= 0)
+        close (stream_fd);
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errsv),
+                   "Failed to read dir '%s': %s", path, strerror (errsv));
+      return NULL;
+    }
+
+  g_autoptr (GPtrArray) names = g_ptr_array_new_with_free_func (g_free);
+  while (TRUE)
+    {
+      errno = 0;
+      struct dirent *dirent = readdir (stream);
+      stats_count (STATS_SYSCALLS, 1);
+      if (dirent == NULL)
+        break;
+
+      if (strcmp (dirent->d_name, ".") != 0 && strcmp (dirent->d_name, "..") != 0)
+        g_ptr_array_add (names, g_strdup (dirent->d_name));
+    }
+
+  int errsv = errno;
+  closedir (stream);
+  if (errsv != 0)
+    {
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errsv),
+                   "Failed to read dir '%s': %s", path, strerror (errsv));
+      return NULL;
+    }
+
+  return g_steal_pointer (&names);
+}
+
+/* Ownership is only kept if we are allowed to */
+static void
+stage_chown (int dir_fd, const char *name, struct stat *st)
+{
+  if (fchownat (dir_fd, name, st->st_uid, st->st_gid, AT_SYMLINK_NOFOLLOW) < 0)
+    g_debug ("Can't keep ownership of staged '%s': %s", name, strerror (errno));
+}
+
+/* All xattrs, so SELinux labels and ACLs are kept. Best effort, like
+ * the ownership, as not all of them can be set by everybody. */
+static void
+stage_copy_xattrs (int src_fd, int dst_fd, const char *path)
+{
+  ssize_t names_len = flistxattr (src_fd, NULL, 0);
+  if (names_len <= 0)
+    return;
+
+  g_autofree char *names = g_malloc (names_len);
+  names_len = flistxattr (src_fd, names, names_len);
+  stats_count (STATS_SYSCALLS, 2);
+  for (ssize_t i = 0; i < names_len; i += strlen (names + i) + 1)
+    {
+      const char *name = names + i;
+      ssize_t value_len = fgetxattr (src_fd, name, NULL, 0);
+      if (value_len < 0)
+        continue;
+
+      g_autofree char *value = g_malloc (MAX (value_len, 1));
+      value_len = fgetxattr (src_fd, name, value, value_len);
+      stats_count (STATS_SYSCALLS, 3);
+      if (value_len < 0 || fsetxattr (dst_fd, name, value, value_len, 0) < 0)
+        g_debug ("Can't keep xattr %s of staged '%s': %s", name, path, strerror (errno));
+    }
+}
+
+/* Of name in dir_fd, or of dir_fd itself if name is NULL */
+static void
+stage_copy_times (int dir_fd, const char *name, struct stat *st, const char *path)
+{
+  struct timespec times[2] = { st->st_atim, st->st_mtim };
+
+  stats_count (STATS_SYSCALLS, 1);
+  int res = name ? utimensat (dir_fd, name, times, AT_SYMLINK_NOFOLLOW) : futimens (dir_fd, times);
+  if (res < 0)
+    g_debug ("Can't keep times of staged '%s': %s", path, strerror (errno));
+}
+
+/* Once its content is staged, the directory gets the owner, xattrs and
+ * times of the one it is a copy of */
+static void
+stage_copy_dir_metadata (int src_fd, int dst_fd, struct stat *st, const char *path)
+{
+  stats_count (STATS_SYSCALLS, 1);
+  if (fchown (dst_fd, st->st_uid, st->st_gid) < 0)
+    g_debug ("Can't keep ownership of staged '%s': %s", path, strerror (errno));
+  stage_copy_xattrs (src_fd, dst_fd, path);
+  stage_copy_times (dst_fd, NULL, st, path);
+}
+
+/* Anything but a directory is hardlinked, which keeps all its
+ * metadata. Only if that isn't allowed, it is copied. */
+static gboolean
+stage_clone_file (int src_fd, int dst_fd, const char *name, const char *path, struct stat *st,
+                  GError **error)
+{
+  stats_count (STATS_SYSCALLS, 1);
+  if (linkat (src_fd, name, dst_fd, name, 0) == 0)
+    return TRUE;
+
+  if (S_ISREG (st->st_mode))
+    {
+      /* E.g. protected_hardlinks for files owned by others, copy_fd()
+       * reflinks where the filesystem supports it */
+      autofd int from_fd = openat (src_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+      autofd int to_fd = -1;
+      if (from_fd >= 0)
+        to_fd = openat (dst_fd, name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+                        st->st_mode & 07777);
+      stats_count (STATS_SYSCALLS, 2);
+      if (to_fd < 0 || copy_fd (from_fd, to_fd) < 0)
+        {
+          g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                       "Can't stage '%s': %s", path, strerror (errno));
+          return FALSE;
+        }
+
+      stage_copy_xattrs (from_fd, to_fd, path);
+    }
+  else if (S_ISLNK (st->st_mode))
+    {
+      g_autofree char *target = read_link_at (src_fd, name, path, error);
+      if (target == NULL)
+        return FALSE;
+
+      stats_count (STATS_SYSCALLS, 1);
+      if (symlinkat (target, dst_fd, name) < 0)
+        {
+          g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                       "Can't stage '%s': %s", path, strerror (errno));
+          return FALSE;
+        }
+    }
+  else
+    {
+      /* Fifos, sockets and device nodes, which are never installed */
+      stats_count (STATS_SYSCALLS, 1);
+      if (mknodat (dst_fd, name, st->st_mode, st->st_rdev) < 0)
+        {
+          g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                       "Can't stage '%s': %s", path, strerror (errno));
+          return FALSE;
+        }
+    }
+
+  stage_chown (dst_fd, name, st);
+  stage_copy_times (dst_fd, name, st, path);
+  return TRUE;
+}
+
+static gboolean
+stage_clone_dir (int src_fd, int dst_fd, const char *path, GError **error)
+{
+  g_autoptr (GPtrArray) names = read_dir_names (src_fd, path, error);
+  if (names == NULL)
+    return FALSE;
+
+  for (guint i = 0; i < names->len; i++)
+    {
+      const char *name = g_ptr_array_index (names, i);
+      g_autofree char *child_path = g_build_filename (path, name, NULL);
+      struct stat st;
+
+      stats_count (STATS_SYSCALLS, 1);
+      if (fstatat (src_fd, name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+        {
+          g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                       "Can't access '%s': %s", child_path, strerror (errno));
+          return FALSE;
+        }
+
+      if (!S_ISDIR (st.st_mode))
+        {
+          if (!stage_clone_file (src_fd, dst_fd, name, child_path, &st, error))
+            return FALSE;
+        }
+      else
+        {
+          stats_count (STATS_SYSCALLS, 1);
+          if (mkdirat (dst_fd, name, 0700) < 0)
+            {
+              g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                           "Can't stage '%s': %s", child_path, strerror (errno));
+              return FALSE;
+            }
+
+          autofd int child_src_fd
+              = openat (src_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+          autofd int child_dst_fd
+              = openat (dst_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+          stats_count (STATS_SYSCALLS, 2);
+          if (child_src_fd < 0 || child_dst_fd < 0)
+            {
+              g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                           "Failed to open dir '%s': %s", child_path, strerror (errno));
+              return FALSE;
+            }
+
+          if (!stage_clone_dir (child_src_fd, child_dst_fd, child_path, error))
+            return FALSE;
+
+          /* After the content, so a read-only dir can be filled */
+          (void)fchmod (child_dst_fd, st.st_mode & 07777);
+          stage_copy_dir_metadata (child_src_fd, child_dst_fd, &st, child_path);
+        }
+    }
+
+  return TRUE;
+}
+
+static gboolean
+remove_dir_at (int parent_fd, const char *name, const char *path, GError **error)
+{
+  autofd int fd = openat (parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  stats_count (STATS_SYSCALLS, 1);
+  if (fd < 0)
+    {
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                   "Failed to open dir '%s': %s", path, strerror (errno));
+      return FALSE;
+    }
+
+  g_autoptr (GPtrArray) names = read_dir_names (fd, path, error);
+  if (names == NULL)
+    return FALSE;
+
+  for (guint i = 0; i < names->len; i++)
+    {
+      const char *child = g_ptr_array_index (names, i);
+
+      stats_count (STATS_SYSCALLS, 1);
+      if (unlinkat (fd, child, 0) == 0)
+        continue;
+
+      g_autofree char *child_path = g_build_filename (path, child, NULL);
+      if (errno != EISDIR || !remove_dir_at (fd, child, child_path, error))
+        {
+          if (error && *error == NULL)
+            g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                         "Can't remove '%s': %s", child_path, strerror (errno));
+          return FALSE;
+        }
+    }
+
+  stats_count (STATS_SYSCALLS, 1);
+  if (unlinkat (parent_fd, name, AT_REMOVEDIR) < 0)
+    {
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno), "Can't remove '%s': %s",
+                   path, strerror (errno));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+install_staged (InstallOptions *opt, const char **sources, const char *destination)
+{
+  g_autoptr (GError) error = NULL;
+  g_autofree char *canonical = g_canonicalize_filename (destination, NULL);
+  g_autofree char *parent = g_path_get_dirname (canonical);
+  g_autofree char *basename = g_path_get_basename (canonical);
+
+  struct stat st;
+  gboolean exists = lstat (canonical, &st) == 0;
+  if (!exists && errno != ENOENT)
+    {
+      g_printerr ("Can't access '%s': %s\n", canonical, strerror (errno));
+      return FALSE;
+    }
+  if (exists && !S_ISDIR (st.st_mode))
+    {
+      g_printerr ("Staged destination '%s' is not a directory\n", canonical);
+      return FALSE;
+    }
+
+  if (g_mkdir_with_parents (parent, 0755) < 0)
+    {
+      g_printerr ("Unable to create dir '%s': %s\n", parent, strerror (errno));
+      return FALSE;
+    }
+
+  autofd int parent_fd = open (parent, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  g_autofree char *staging = g_strdup_printf ("%s/.%s.staged.XXXXXX", parent, basename);
+  if (parent_fd < 0 || g_mkdtemp_full (staging, 0700) == NULL)
+    {
+      g_printerr ("Can't create staging dir for '%s': %s\n", canonical, strerror (errno));
+      return FALSE;
+    }
+
+  g_autofree char *staging_name = g_path_get_basename (staging);
+  g_info ("Staging '%s' in '%s'", canonical, staging);
+
+  gboolean res = TRUE;
+  if (exists)
+    {
+      gint64 start = stats_begin ();
+      autofd int src_fd = openat (parent_fd, basename, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      autofd int dst_fd = openat (parent_fd, staging_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (src_fd < 0 || dst_fd < 0)
+        g_set_error (&error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                     "Failed to open dir '%s': %s", canonical, strerror (errno));
+      res = src_fd >= 0 && dst_fd >= 0 && stage_clone_dir (src_fd, dst_fd, canonical, &error);
+      /* The mode is only set at the end, so the staging dir stays private */
+      if (res)
+        stage_copy_dir_metadata (src_fd, dst_fd, &st, canonical);
+      stats_end (STATS_PHASE_INSTALL, start);
+      if (!res)
+        g_printerr ("%s\n", error->message);
+      g_clear_error (&error);
+    }
+
+  /* The files only need to be durable once, before the exchange */
+  InstallDurability durability = opt->durability;
+  opt->durability = INSTALL_DURABILITY_NONE;
+  if (res && !install_sources (opt, sources, staging))
+    res = FALSE;
+  opt->durability = durability;
+
+  if (res && chmod (staging, exists ? st.st_mode & 07777 : 0755) < 0)
+    {
+      g_printerr ("Can't change mode of '%s': %s\n", staging, strerror (errno));
+      res = FALSE;
+    }
+
+  if (res && durability != INSTALL_DURABILITY_NONE && syncfs (parent_fd) < 0)
+    {
+      g_printerr ("Can't sync filesystem of '%s': %s\n", staging, strerror (errno));
+      res = FALSE;
+    }
+
+  gboolean published = FALSE;
+  if (res)
+    {
+      gint64 start = stats_begin ();
+      VALIDATOR_PROBE1 (replace__begin, canonical);
+      published = renameat2 (parent_fd, staging_name, parent_fd, basename,
+                             exists ? RENAME_EXCHANGE : RENAME_NOREPLACE)
+                  == 0;
+      stats_count (STATS_SYSCALLS, 1);
+      VALIDATOR_PROBE2 (replace__end, canonical, published);
+      stats_end (STATS_PHASE_INSTALL, start);
+
+      if (!published)
+        {
+          g_printerr ("Can't publish '%s': %s\n", canonical, strerror (errno));
+          res = FALSE;
+        }
+      else if (durability != INSTALL_DURABILITY_NONE && fsync (parent_fd) < 0)
+        {
+          g_printerr ("Can't sync '%s': %s\n", parent, strerror (errno));
+          res = FALSE;
+        }
+      else
+        g_info ("Published '%s'", canonical);
+    }
+  else
+    g_printerr ("Not publishing '%s', as not all files could be installed\n", canonical);
 
-          /* TODO: Handle opt->path_relative here?? */
-          if (!install (opt, path, dirname, destination, TRUE))
-            res = FALSE;
-        }
+  /* The old tree after an exchange, or the unpublished new one */
+  if ((exists || !published) && !remove_dir_at (parent_fd, staging_name, staging, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      res = FALSE;
     }
 
   return res;
 }
 
+static gboolean
+install_for_config (InstallOptions *opt, const char **sources, const char *destination)
+{
+  if (opt->staged)
+    return install_staged (opt, sources, destination);
+
+  return install_sources (opt, sources, destination);
+}
+
+static gboolean
+parse_durability (const char *value, InstallDurability *durability_out, GError **error)
+{
+  if (value == NULL || strcmp (value, "none") == 0)
+    *durability_out = INSTALL_DURABILITY_NONE;
+  else if (strcmp (value, "batch") == 0)
+    *durability_out = INSTALL_DURABILITY_BATCH;
+  else if (strcmp (value, "file") == 0)
+    *durability_out = INSTALL_DURABILITY_FILE;
+  else
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                   "Unsupported durability '%s', must be none, batch or file", value);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
 static void
 get_install_options_from_cmdline (InstallOptions *opt)
 {
@@ -255,9 +1519,18 @@ get_install_options_from_cmdline (InstallOptions *opt)
 
   opt->recursive = opt_recursive;
   opt->force = opt_force;
+  opt->incremental = opt_incremental;
   opt->path_relative = opt_path_relative;
   opt->path_prefix = opt_path_prefix;
   opt->public_keys = opt_public_keys;
+  opt->files_from = opt_files_from != NULL;
+  opt->staged = opt_staged;
+  opt->bundle = opt_bundle;
+  opt->jobs = opt_jobs;
+
+  g_autoptr (GError) error = NULL;
+  if (!parse_durability (opt_durability, &opt->durability, &error))
+    help_error (error->message);
 }
 
 static void
@@ -265,8 +1538,9 @@ free_install_options (InstallOptions *opt)
 {
   g_free (opt->path_relative);
   g_free (opt->path_prefix);
+  g_free (opt->bundle);
 
-  free_keys (opt->public_keys);
+  keyring_free (opt->public_keys);
 }
 
 static gboolean
@@ -274,6 +1548,7 @@ get_install_options_from_file (InstallOptions *opt, const char *config_path, cha
                                char ***sources_out)
 {
   memset (opt, 0, sizeof (InstallOptions));
+  opt->jobs = opt_jobs;
 
   g_autoptr (GKeyFile) config = g_key_file_new ();
 
@@ -295,12 +1570,33 @@ get_install_options_from_file (InstallOptions *opt, const char *config_path, cha
       return FALSE;
     }
 
-  g_auto (GStrv) sources = g_key_file_get_string_list (config, "install", "sources", NULL, &error);
-  if (sources == NULL)
+  g_autofree char *bundle = NULL;
+  if (!keyfile_get_value_with_default (config, "install", "bundle", NULL, &bundle, &error))
+    {
+      g_printerr ("Can't parse bundle option from config file '%s': %s\n", config_path,
+                  error->message);
+      return FALSE;
+    }
+
+  /* A bundle replaces the sources */
+  g_auto (GStrv) sources = NULL;
+  if (bundle && g_key_file_has_key (config, "install", "sources", NULL))
     {
-      g_printerr ("Can't get sources from config file '%s': %s\n", config_path, error->message);
+      g_printerr ("Config file '%s' has both sources and a bundle\n", config_path);
       return FALSE;
     }
+  else if (bundle)
+    sources = g_new0 (char *, 1);
+  else
+    {
+      sources = g_key_file_get_string_list (config, "install", "sources", NULL, &error);
+      if (sources == NULL)
+        {
+          g_printerr ("Can't get sources from config file '%s': %s\n", config_path,
+                      error->message);
+          return FALSE;
+        }
+    }
 
   /* Default for force and recursive is TRUE, as it is more common */
 
@@ -319,6 +1615,32 @@ get_install_options_from_file (InstallOptions *opt, const char *config_path, cha
       return FALSE;
     }
 
+  if (!keyfile_get_boolean_with_default (config, "install", "incremental", FALSE,
+                                         &opt->incremental, &error))
+    {
+      g_printerr ("Can't parse incremental option from config file '%s': %s\n", config_path,
+                  error->message);
+      return FALSE;
+    }
+
+  if (!keyfile_get_boolean_with_default (config, "install", "staged", FALSE, &opt->staged,
+                                         &error))
+    {
+      g_printerr ("Can't parse staged option from config file '%s': %s\n", config_path,
+                  error->message);
+      return FALSE;
+    }
+
+  g_autofree char *durability = NULL;
+  if (!keyfile_get_value_with_default (config, "install", "durability", NULL, &durability,
+                                       &error)
+      || !parse_durability (durability, &opt->durability, &error))
+    {
+      g_printerr ("Can't parse durability option from config file '%s': %s\n", config_path,
+                  error->message);
+      return FALSE;
+    }
+
   g_autofree char *path_relative = NULL;
   if (!keyfile_get_value_with_default (config, "install", "path_relative", NULL, &path_relative,
                                        &error))
@@ -358,6 +1680,7 @@ get_install_options_from_file (InstallOptions *opt, const char *config_path, cha
 
   opt->path_relative = g_steal_pointer (&path_relative);
   opt->path_prefix = g_steal_pointer (&path_prefix);
+  opt->bundle = g_steal_pointer (&bundle);
 
   *destination_out = g_steal_pointer (&destination);
   *sources_out = g_steal_pointer (&sources);
@@ -365,50 +1688,511 @@ get_install_options_from_file (InstallOptions *opt, const char *config_path, cha
   return TRUE;
 }
 
-int
-cmd_install (int argc, char *argv[])
+/* A config file to install, with the paths it reads and writes */
+typedef struct
+{
+  char *path;
+  Stats *stats;
+  InstallOptions opt;
+  char *destination; /* NULL if nothing to install */
+  char **sources;
+  gboolean res;
+  GString *output; /* Printed for it while chains run concurrently */
+} InstallConfig;
+
+static void
+install_config_free (InstallConfig *config)
+{
+  if (config->destination)
+    free_install_options (&config->opt);
+  g_free (config->destination);
+  g_strfreev (config->sources);
+  g_free (config->path);
+  if (config->output)
+    g_string_free (config->output, TRUE);
+  g_free (config);
+}
+
+static int
+compare_strings (gconstpointer a, gconstpointer b)
+{
+  return strcmp (*(const char **)a, *(const char **)b);
+}
+
+static gboolean
+paths_overlap (const char *a, const char *b)
+{
+  g_autofree char *canonical_a = g_canonicalize_filename (a, NULL);
+  g_autofree char *canonical_b = g_canonicalize_filename (b, NULL);
+
+  return has_path_prefix (canonical_a, canonical_b) || has_path_prefix (canonical_b, canonical_a);
+}
+
+/* b has to run after a if it writes where a reads or writes, or
+ * reads where a writes */
+static gboolean
+install_configs_conflict (InstallConfig *a, InstallConfig *b)
+{
+  if (paths_overlap (a->destination, b->destination))
+    return TRUE;
+
+  for (gsize i = 0; b->sources[i] != NULL; i++)
+    if (paths_overlap (a->destination, b->sources[i]))
+      return TRUE;
+
+  for (gsize i = 0; a->sources[i] != NULL; i++)
+    if (paths_overlap (b->destination, a->sources[i]))
+      return TRUE;
+
+  if (a->opt.bundle && paths_overlap (b->destination, a->opt.bundle))
+    return TRUE;
+
+  if (b->opt.bundle && paths_overlap (a->destination, b->opt.bundle))
+    return TRUE;
+
+  return FALSE;
+}
+
+static void
+install_config (InstallConfig *config)
+{
+  stats_set_current (config->stats);
+  config->res = install_for_config (&config->opt, (const char **)config->sources,
+                                    config->destination);
+  stats_set_current (NULL);
+}
+
+/* A chain is a GPtrArray of InstallConfigs that run in order */
+static void
+install_chain (gpointer data, gpointer user_data)
+{
+  GPtrArray *chain = data;
+
+  for (guint i = 0; i < chain->len; i++)
+    install_config (g_ptr_array_index (chain, i));
+}
+
+/* While chains run concurrently, what is printed for each config is
+ * kept in its output, and printed in config order once all are done.
+ * The config is found by its stats, which the walker workers inherit,
+ * so their messages are kept too. */
+static GMutex config_output_lock;
+static GHashTable *config_output; /* Stats -> GString */
+
+static void
+print_config_output (const gchar *string)
+{
+  g_mutex_lock (&config_output_lock);
+  GString *output = g_hash_table_lookup (config_output, stats_get_current ());
+  if (output)
+    g_string_append (output, string);
+  g_mutex_unlock (&config_output_lock);
+
+  if (output == NULL)
+    fputs (string, stderr);
+}
+
+static guint
+find_chain (guint *chain_of, guint i)
+{
+  while (chain_of[i] != i)
+    i = chain_of[i];
+  return i;
+}
+
+/* All configs are loaded first, on this thread, so the key loading
+ * is shared and the errors are in order */
+static GPtrArray *
+load_install_configs (GPtrArray *config_files, gboolean *res)
+{
+  GPtrArray *configs = g_ptr_array_new_with_free_func ((GDestroyNotify)install_config_free);
+
+  for (guint i = 0; i < config_files->len; i++)
+    {
+      InstallConfig *config = g_new0 (InstallConfig, 1);
+      config->path = g_strdup (g_ptr_array_index (config_files, i));
+
+      g_info ("Loading config file %s", config->path);
+
+      /* Accounted separately, for finding the expensive configs */
+      config->stats = stats_new (config->path);
+      stats_set_current (config->stats);
+      if (!get_install_options_from_file (&config->opt, config->path, &config->destination,
+                                          &config->sources))
+        *res = FALSE;
+      stats_set_current (NULL);
+
+      if (config->destination == NULL)
+        {
+          install_config_free (config);
+          continue;
+        }
+
+      g_ptr_array_add (configs, config);
+    }
+
+  return configs;
+}
+
+/* Configs that have overlapping paths are put in the same chain and
+ * run in order of the config files, while independent chains run
+ * concurrently. */
+static gboolean
+install_configs (GPtrArray *configs)
 {
   gboolean res = TRUE;
 
-  if (argc > 1)
+  g_autofree guint *chain_of = g_new (guint, configs->len);
+  for (guint i = 0; i < configs->len; i++)
     {
-      if (argc == 2)
-        help_error ("No destination given");
+      chain_of[i] = i;
 
-      InstallOptions main_opt;
-      get_install_options_from_cmdline (&main_opt);
+      /* Join with the chains of all earlier conflicting configs, the
+       * chain is identified by its first config */
+      for (guint j = 0; j < i; j++)
+        {
+          if (!install_configs_conflict (g_ptr_array_index (configs, j),
+                                         g_ptr_array_index (configs, i)))
+            continue;
+
+          guint chain_i = find_chain (chain_of, i);
+          guint chain_j = find_chain (chain_of, j);
+          chain_of[MAX (chain_i, chain_j)] = MIN (chain_i, chain_j);
+        }
+    }
 
-      const char *destination = argv[argc - 1];
+  g_autoptr (GPtrArray) chains = g_ptr_array_new_with_free_func ((GDestroyNotify)g_ptr_array_unref);
+  g_autofree GPtrArray **chain_for_config = g_new0 (GPtrArray *, configs->len);
+  for (guint i = 0; i < configs->len; i++)
+    {
+      guint first = find_chain (chain_of, i);
+      if (chain_for_config[first] == NULL)
+        {
+          chain_for_config[first] = g_ptr_array_new ();
+          g_ptr_array_add (chains, chain_for_config[first]);
+        }
+      g_ptr_array_add (chain_for_config[first], g_ptr_array_index (configs, i));
+    }
 
-      g_autoptr (GPtrArray) sources = g_ptr_array_new ();
-      for (gsize i = 1; i < argc - 1; i++)
-        g_ptr_array_add (sources, argv[i]);
-      g_ptr_array_add (sources, NULL);
+  if (chains->len > 1 && opt_jobs != 1)
+    {
+      /* The chains share the workers --jobs allows, rather than each
+       * walker starting one per job */
+      guint n_jobs = opt_jobs > 0 ? opt_jobs : g_get_num_processors ();
+      guint n_running = MIN (n_jobs, chains->len);
+
+      g_info ("Installing %u configs in %u independent chains, %u at a time", configs->len,
+              chains->len, n_running);
+
+      config_output = g_hash_table_new (g_direct_hash, g_direct_equal);
+      for (guint i = 0; i < configs->len; i++)
+        {
+          InstallConfig *config = g_ptr_array_index (configs, i);
+          config->opt.jobs = MAX (n_jobs / n_running, 1);
+          config->output = g_string_new (NULL);
+          g_hash_table_insert (config_output, config->stats, config->output);
+        }
+      GPrintFunc old_printerr = g_set_printerr_handler (print_config_output);
+
+      GThreadPool *pool = g_thread_pool_new (install_chain, NULL, n_running, FALSE, NULL);
+      for (guint i = 0; i < chains->len; i++)
+        g_thread_pool_push (pool, g_ptr_array_index (chains, i), NULL);
+      g_thread_pool_free (pool, FALSE, TRUE);
+
+      g_set_printerr_handler (old_printerr);
+      g_clear_pointer (&config_output, g_hash_table_unref);
+      for (guint i = 0; i < configs->len; i++)
+        {
+          InstallConfig *config = g_ptr_array_index (configs, i);
+          fputs (config->output->str, stderr);
+        }
+    }
+  else
+    {
+      for (guint i = 0; i < configs->len; i++)
+        install_config (g_ptr_array_index (configs, i));
+    }
 
-      res &= install_for_config (&main_opt, (const char **)sources->pdata, destination);
+  for (guint i = 0; i < configs->len; i++)
+    {
+      InstallConfig *config = g_ptr_array_index (configs, i);
+      res &= config->res;
     }
 
-  for (gsize i = 0; opt_configs != NULL && opt_configs[i] != NULL; i++)
+  return res;
+}
+
+/* In watch mode the sources are installed once, and then each change
+ * is installed as it happens, with a walker and keys that are kept
+ * around between changes. Only the changed files are validated and
+ * installed again, except in staged mode where the whole tree is, and
+ * for bundles, which are installed again when the bundle changes. */
+typedef struct
+{
+  InstallOptions *opt;
+  const char **sources;
+  const char *destination;
+  Walker *walker;
+  InstallBatch batch;
+  GHashTable *manifests; /* Loaded again for each set of changes */
+  gboolean changed;
+} InstallWatch;
+
+typedef struct
+{
+  InstallWatch *target;
+  char *path;
+  gboolean is_dir;
+} InstallWatchSource;
+
+static InstallWatch *
+install_watch_new (InstallOptions *opt, const char **sources, const char *destination)
+{
+  InstallWatch *target = g_new0 (InstallWatch, 1);
+  target->opt = opt;
+  target->sources = sources;
+  target->destination = destination;
+  target->walker = walker_new (opt->jobs, install_file, opt);
+  return target;
+}
+
+static void
+install_watch_free (InstallWatch *target)
+{
+  walker_free (target->walker);
+  g_clear_pointer (&target->manifests, g_hash_table_unref);
+  g_free (target);
+}
+
+static void
+install_watch_source_free (InstallWatchSource *source)
+{
+  g_free (source->path);
+  g_free (source);
+}
+
+static void
+install_watch_change (InstallWatchSource *source, const char *path)
+{
+  InstallWatch *target = source->target;
+  InstallOptions *opt = target->opt;
+
+  if (!target->changed)
+    {
+      target->changed = TRUE;
+      target->manifests = manifest_cache_new ();
+      opt->n_installed = 0;
+      opt->n_unchanged = 0;
+      if (!opt->staged && !opt->bundle)
+        install_begin (opt, target->destination, &target->batch);
+    }
+
+  if (opt->staged || opt->bundle)
+    return; /* The whole tree is installed again */
+
+  struct stat st;
+  if (lstat (path, &st) < 0)
+    {
+      /* Removed, or a temporary file that was renamed since */
+      if (errno == ENOENT)
+        log_debug ("'%s' was removed, ignoring", path);
+      else
+        walker_add_error (target->walker,
+                          g_error_new (G_FILE_ERROR, g_file_error_from_errno (errno),
+                                       "Can't access '%s': %s", path, strerror (errno)));
+      return;
+    }
+
+  g_autofree char *dirname = S_ISDIR (st.st_mode) ? g_strdup (path) : g_path_get_dirname (path);
+  g_autofree char *source_dirname = NULL;
+  const char *relative_to;
+  g_autofree char *destination_dir = NULL;
+
+  /* Same as for the initial install of the source */
+  if (source->is_dir)
+    {
+      relative_to = opt->path_relative ? opt->path_relative : source->path;
+      g_autofree char *rel_dir = opt_get_relative_path (dirname, source->path, NULL);
+      g_assert (rel_dir != NULL);
+      destination_dir = g_build_filename (target->destination, rel_dir, NULL);
+    }
+  else
+    {
+      source_dirname = g_path_get_dirname (source->path);
+      relative_to = source_dirname;
+      destination_dir = g_strdup (target->destination);
+    }
+
+  g_autoptr (GError) error = NULL;
+  Manifest *manifest = manifest_cache_load (target->manifests, relative_to, opt->path_prefix,
+                                            opt->public_keys, &error);
+  if (error)
+    walker_add_error (target->walker, g_steal_pointer (&error));
+
+  walker_set_root_data (target->walker, manifest);
+  if (S_ISDIR (st.st_mode))
+    walker_walk (target->walker, path, relative_to, destination_dir, TRUE);
+  else if (S_ISREG (st.st_mode) || S_ISLNK (st.st_mode))
+    walker_walk_file (target->walker, path, relative_to, destination_dir);
+}
+
+static void
+install_watch_finish (InstallWatch *target)
+{
+  InstallOptions *opt = target->opt;
+
+  if (!target->changed)
+    return;
+
+  gboolean res;
+  if (opt->staged || opt->bundle)
+    res = install_for_config (opt, target->sources, target->destination);
+  else
+    {
+      res = walker_finish (target->walker);
+      if (!install_end (opt))
+        res = FALSE;
+    }
+
+  g_info ("Installed %d changed files into '%s'%s", opt->n_installed, target->destination,
+          res ? "" : ", some failed");
+
+  g_clear_pointer (&target->manifests, g_hash_table_unref);
+  target->changed = FALSE;
+}
+
+/* Only returns on errors watching the sources, failures to install
+ * are reported and the next change is waited for */
+static gboolean
+install_watch (GPtrArray *targets, VerifyCache *verify_cache)
+{
+  g_autoptr (GError) error = NULL;
+  g_autoptr (Watch) watch = watch_new (&error);
+  if (watch == NULL)
+    {
+      g_printerr ("%s\n", error->message);
+      return FALSE;
+    }
+
+  g_autoptr (GPtrArray) sources
+      = g_ptr_array_new_with_free_func ((GDestroyNotify)install_watch_source_free);
+  for (guint i = 0; i < targets->len; i++)
     {
-      const char *config_file = opt_configs[i];
+      InstallWatch *target = g_ptr_array_index (targets, i);
+
+      for (gsize j = 0; target->sources[j] != NULL; j++)
+        {
+          g_autofree char *path = g_canonicalize_filename (target->sources[j], NULL);
+          gboolean is_dir = g_file_test (path, G_FILE_TEST_IS_DIR);
 
-      g_info ("Loading config file %s", config_file);
+          /* What the initial install didn't install isn't watched either */
+          if (is_dir ? !target->opt->recursive : !g_file_test (path, G_FILE_TEST_IS_REGULAR))
+            continue;
+
+          InstallWatchSource *source = g_new0 (InstallWatchSource, 1);
+          source->target = target;
+          source->path = g_steal_pointer (&path);
+          source->is_dir = is_dir;
+          g_ptr_array_add (sources, source);
+
+          if (!watch_add (watch, source->path, source, &error))
+            {
+              g_printerr ("%s\n", error->message);
+              return FALSE;
+            }
+        }
 
-      g_autofree char *destination = NULL;
-      g_auto (GStrv) sources = NULL;
-      InstallOptions opt;
-      if (!get_install_options_from_file (&opt, config_file, &destination, &sources))
+      /* A bundle read from stdin can't change */
+      if (target->opt->bundle && strcmp (target->opt->bundle, "-") != 0)
         {
-          res = FALSE;
-          continue;
+          InstallWatchSource *source = g_new0 (InstallWatchSource, 1);
+          source->target = target;
+          source->path = g_canonicalize_filename (target->opt->bundle, NULL);
+          g_ptr_array_add (sources, source);
+
+          if (!watch_add (watch, source->path, source, &error))
+            {
+              g_printerr ("%s\n", error->message);
+              return FALSE;
+            }
+        }
+    }
+
+  if (sources->len == 0)
+    {
+      g_printerr ("Nothing to watch\n");
+      return FALSE;
+    }
+
+  g_info ("Watching %u sources for changes", sources->len);
+
+  while (TRUE)
+    {
+      g_autoptr (GPtrArray) changes = watch_wait (watch, &error);
+      if (changes == NULL)
+        {
+          g_printerr ("%s\n", error->message);
+          return FALSE;
+        }
+
+      for (guint i = 0; i < changes->len; i++)
+        {
+          WatchChange *change = g_ptr_array_index (changes, i);
+          g_debug ("Changed: %s", change->path);
+          install_watch_change (change->root_data, change->path);
+        }
+
+      for (guint i = 0; i < targets->len; i++)
+        install_watch_finish (g_ptr_array_index (targets, i));
+
+      /* The entries of the changed files replace their old ones */
+      if (verify_cache && !verify_cache_save (verify_cache, &error))
+        {
+          g_printerr ("Can't save verification cache: %s\n", error->message);
+          g_clear_error (&error);
+        }
+    }
+}
+
+int
+cmd_install (int argc, char *argv[])
+{
+  gboolean res = TRUE;
+  InstallOptions main_opt;
+  g_autoptr (GPtrArray) main_sources = g_ptr_array_new ();
+  const char *main_destination = NULL;
+
+  g_autoptr (VerifyCache) verify_cache = NULL;
+  if (opt_verify_cache)
+    verify_cache = verify_cache_open (opt_verify_cache, TRUE);
+
+  if (argc > 1 || opt_files_from || opt_bundle)
+    {
+      if (opt_bundle)
+        {
+          if (argc != 2 || opt_files_from)
+            help_error ("Only a destination can be given with --bundle");
         }
+      else if (argc == 1 || (argc == 2 && !opt_files_from))
+        help_error ("No destination given");
 
-      if (destination)
-        res &= install_for_config (&opt, (const char **)sources, destination);
+      get_install_options_from_cmdline (&main_opt);
+      main_opt.verify_cache = verify_cache;
+
+      main_destination = argv[argc - 1];
+
+      for (gsize i = 1; i < argc - 1; i++)
+        g_ptr_array_add (main_sources, argv[i]);
+      g_ptr_array_add (main_sources, NULL);
 
-      free_install_options (&opt);
+      res &= install_for_config (&main_opt, (const char **)main_sources->pdata, main_destination);
     }
 
+  g_autoptr (GPtrArray) config_files = g_ptr_array_new_with_free_func (g_free);
+
+  for (gsize i = 0; opt_configs != NULL && opt_configs[i] != NULL; i++)
+    g_ptr_array_add (config_files, g_strdup (opt_configs[i]));
+
   for (gsize i = 0; opt_config_dirs != NULL && opt_config_dirs[i] != NULL; i++)
     {
       const char *config_dir = opt_config_dirs[i];
@@ -426,27 +2210,44 @@ cmd_install (int argc, char *argv[])
           continue;
         }
 
+      /* Sorted, so the order doesn't depend on the filesystem */
+      g_autoptr (GPtrArray) filenames = g_ptr_array_new_with_free_func (g_free);
       const char *filename;
       while ((filename = g_dir_read_name (dir)) != NULL)
-        {
-          g_autofree char *config_file = g_build_filename (config_dir, filename, NULL);
+        g_ptr_array_add (filenames, g_build_filename (config_dir, filename, NULL));
+      g_ptr_array_sort (filenames, compare_strings);
 
-          g_info ("Loading config file %s", config_file);
+      for (guint j = 0; j < filenames->len; j++)
+        g_ptr_array_add (config_files, g_strdup (g_ptr_array_index (filenames, j)));
+    }
 
-          g_autofree char *destination = NULL;
-          g_auto (GStrv) sources = NULL;
-          InstallOptions opt;
-          if (!get_install_options_from_file (&opt, config_file, &destination, &sources))
-            {
-              res = FALSE;
-              continue;
-            }
+  g_autoptr (GPtrArray) configs = load_install_configs (config_files, &res);
+  for (guint i = 0; i < configs->len; i++)
+    ((InstallConfig *)g_ptr_array_index (configs, i))->opt.verify_cache = verify_cache;
+  if (configs->len > 0)
+    res &= install_configs (configs);
 
-          if (destination)
-            res &= install_for_config (&opt, (const char **)sources, destination);
+  /* Failing to save only makes the next run slower */
+  g_autoptr (GError) error = NULL;
+  if (verify_cache && !verify_cache_save (verify_cache, &error))
+    g_printerr ("Can't save verification cache: %s\n", error->message);
 
-          free_install_options (&opt);
+  if (opt_watch)
+    {
+      g_autoptr (GPtrArray) targets
+          = g_ptr_array_new_with_free_func ((GDestroyNotify)install_watch_free);
+      if (main_destination)
+        g_ptr_array_add (targets, install_watch_new (&main_opt, (const char **)main_sources->pdata,
+                                                     main_destination));
+      for (guint i = 0; i < configs->len; i++)
+        {
+          InstallConfig *config = g_ptr_array_index (configs, i);
+          g_ptr_array_add (targets, install_watch_new (&config->opt,
+                                                       (const char **)config->sources,
+                                                       config->destination));
         }
+
+      res &= install_watch (targets, verify_cache);
     }
 
   return res ? 0 : 1;
@@ -0,0 +1,74 @@
+/*
+ * Copyright © 2023 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+#include "config.h"
+#include "main.h"
+
+static int
+keyring_build (int argc, char *argv[])
+{
+  g_autoptr (GError) error = NULL;
+
+  if (argc == 1)
+    help_error ("No output file given");
+
+  if (argc > 2)
+    help_error ("Only one output file supported");
+
+  const char *output = argv[1];
+
+  if (opt_public_keys->keys->len == 0)
+    {
+      g_printerr ("No public keys found\n");
+      return EXIT_FAILURE;
+    }
+
+  gsize data_len;
+  g_autofree guchar *data = keyring_compile (opt_public_keys, &data_len, &error);
+  if (data == NULL)
+    {
+      g_printerr ("%s\n", error->message);
+      return EXIT_FAILURE;
+    }
+
+  if (!g_file_set_contents (output, (char *)data, data_len, &error))
+    {
+      g_printerr ("Failed to write keyring '%s': %s\n", output, error->message);
+      return EXIT_FAILURE;
+    }
+
+  g_info ("Wrote keyring '%s' with %u keys", output,
+          (guint)((data_len - VALIDATOR_KEYRING_HEADER_LEN) / VALIDATOR_KEYRING_ENTRY_LEN));
+
+  return EXIT_SUCCESS;
+}
+
+int
+cmd_keyring (int argc, char *argv[])
+{
+  if (argc == 1)
+    help_error ("No keyring command given");
+
+  if (strcmp (argv[1], "build") == 0)
+    return keyring_build (argc - 1, argv + 1);
+
+  help_error ("Unsupported keyring command '%s'", argv[1]);
+  return EXIT_FAILURE;
+}
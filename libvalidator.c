@@ -0,0 +1,285 @@
+/*
+ * Copyright © 2023 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+#include "config.h"
+
+#include "libvalidator.h"
+#include "utils.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+G_DEFINE_QUARK (validator-error-quark, validator_error)
+
+struct ValidatorKeyring
+{
+  gint ref_count;
+  Keyring *keyring;
+};
+
+struct ValidatorVerifier
+{
+  ValidatorKeyring *keyring;
+  char *path_prefix;
+};
+
+struct ValidatorSigningKey
+{
+  EVP_PKEY *pkey;
+};
+
+ValidatorKeyring *
+validator_keyring_new (void)
+{
+  ValidatorKeyring *keyring = g_new0 (ValidatorKeyring, 1);
+
+  keyring->ref_count = 1;
+  keyring->keyring = keyring_new ();
+
+  return keyring;
+}
+
+ValidatorKeyring *
+validator_keyring_ref (ValidatorKeyring *keyring)
+{
+  g_atomic_int_inc (&keyring->ref_count);
+  return keyring;
+}
+
+void
+validator_keyring_unref (ValidatorKeyring *keyring)
+{
+  if (g_atomic_int_dec_and_test (&keyring->ref_count))
+    {
+      keyring_free (keyring->keyring);
+      g_free (keyring);
+    }
+}
+
+/* Adds the keys of a PEM or DER public key file, or a compiled keyring */
+gboolean
+validator_keyring_load (ValidatorKeyring *keyring, const char *path, GError **error)
+{
+  return load_pub_keys (path, keyring->keyring, error);
+}
+
+gboolean
+validator_keyring_load_dir (ValidatorKeyring *keyring, const char *dir, GError **error)
+{
+  return load_pub_keys_from_dir (dir, keyring->keyring, error);
+}
+
+guint
+validator_keyring_get_n_keys (ValidatorKeyring *keyring)
+{
+  return keyring->keyring->keys->len;
+}
+
+/* The keyring must not get more keys while the verifier is used */
+ValidatorVerifier *
+validator_verifier_new (ValidatorKeyring *keyring)
+{
+  ValidatorVerifier *verifier = g_new0 (ValidatorVerifier, 1);
+
+  verifier->keyring = validator_keyring_ref (keyring);
+
+  return verifier;
+}
+
+void
+validator_verifier_free (ValidatorVerifier *verifier)
+{
+  validator_keyring_unref (verifier->keyring);
+  g_free (verifier->path_prefix);
+  g_free (verifier);
+}
+
+/* Like --path-prefix, prepended to the relative paths of all files */
+void
+validator_verifier_set_path_prefix (ValidatorVerifier *verifier, const char *path_prefix)
+{
+  g_free (verifier->path_prefix);
+  verifier->path_prefix = g_strdup (path_prefix);
+}
+
+static gboolean
+rewind_fd (int fd, const char *path, GError **error)
+{
+  if (lseek (fd, 0, SEEK_SET) < 0)
+    {
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno), "Can't read '%s': %s",
+                   path, strerror (errno));
+      return FALSE;
+    }
+  return TRUE;
+}
+
+static gboolean
+verifier_verify (ValidatorVerifier *verifier, const char *rel_path, int type,
+                 const guchar *content, gsize content_len, const guint8 *signature,
+                 gsize signature_len, GError **error)
+{
+  g_autofree char *signed_path = NULL;
+  if (verifier->path_prefix)
+    signed_path = g_build_filename (verifier->path_prefix, rel_path, NULL);
+  else
+    signed_path = g_strdup (rel_path);
+
+  g_autoptr (GError) local_error = NULL;
+  if (!validate_data (signed_path, type, (guchar *)content, content_len, (char *)signature,
+                      signature_len, verifier->keyring->keyring, &local_error))
+    {
+      /* A malformed signature is invalid too, not an I/O error */
+      if (local_error)
+        g_set_error (error, VALIDATOR_ERROR, VALIDATOR_ERROR_INVALID_SIGNATURE,
+                     "Signature of '%s' is invalid: %s", signed_path, local_error->message);
+      else
+        g_set_error (error, VALIDATOR_ERROR, VALIDATOR_ERROR_INVALID_SIGNATURE,
+                     "Signature of '%s' is invalid", signed_path);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Verifies the file (regular or symlink) name in dir_fd against the
+ * signature next to it, as signed as rel_path. Symlinks are not
+ * followed. */
+gboolean
+validator_verifier_verify_at (ValidatorVerifier *verifier, int dir_fd, const char *name,
+                              const char *rel_path, GError **error)
+{
+  g_autofree char *sig_name = g_strconcat (name, ".sig", NULL);
+  g_autofree char *signature = NULL;
+  gsize signature_len;
+  g_autoptr (GError) local_error = NULL;
+
+  if (!load_file_at (dir_fd, sig_name, sig_name, &signature, &signature_len, &local_error))
+    {
+      if (g_error_matches (local_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        g_set_error (error, VALIDATOR_ERROR, VALIDATOR_ERROR_NOT_SIGNED, "No signature for '%s'",
+                     name);
+      else
+        g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+
+  int type;
+  g_autofree guchar *content = NULL;
+  gsize content_len;
+  if (!load_file_data_for_sign_at (dir_fd, name, name, NULL,
+                                   signature_get_digest_type (signature, signature_len), &type,
+                                   &content, &content_len, -1, error))
+    return FALSE;
+
+  return verifier_verify (verifier, rel_path, type, content, content_len, (guint8 *)signature,
+                          signature_len, error);
+}
+
+/* Verifies the content of the regular file fd, which is read from the
+ * start */
+gboolean
+validator_verifier_verify_fd (ValidatorVerifier *verifier, int fd, const char *rel_path,
+                              const guint8 *signature, gsize signature_len, GError **error)
+{
+  if (!rewind_fd (fd, rel_path, error))
+    return FALSE;
+
+  gsize content_len;
+  g_autofree guchar *content = (guchar *)digest_file_fd (
+      fd, rel_path, signature_get_digest_type ((char *)signature, signature_len), &content_len,
+      -1, error);
+  if (content == NULL)
+    return FALSE;
+
+  return verifier_verify (verifier, rel_path, S_IFREG, content, content_len, signature,
+                          signature_len, error);
+}
+
+gboolean
+validator_verifier_verify_symlink (ValidatorVerifier *verifier, const char *target,
+                                   const char *rel_path, const guint8 *signature,
+                                   gsize signature_len, GError **error)
+{
+  return verifier_verify (verifier, rel_path, S_IFLNK, (const guchar *)target, strlen (target),
+                          signature, signature_len, error);
+}
+
+/* Loads a PEM encoded Ed25519 private key */
+ValidatorSigningKey *
+validator_signing_key_load (const char *path, GError **error)
+{
+  EVP_PKEY *pkey = load_priv_key (path, error);
+  if (pkey == NULL)
+    return NULL;
+
+  ValidatorSigningKey *key = g_new0 (ValidatorSigningKey, 1);
+  key->pkey = pkey;
+  return key;
+}
+
+void
+validator_signing_key_free (ValidatorSigningKey *key)
+{
+  EVP_PKEY_free (key->pkey);
+  g_free (key);
+}
+
+/* Returns the content of the signature file for the regular file fd,
+ * signed as rel_path */
+guint8 *
+validator_sign_fd (ValidatorSigningKey *key, int fd, const char *rel_path,
+                   ValidatorDigestType digest_type, gsize *signature_len_out, GError **error)
+{
+  if (!rewind_fd (fd, rel_path, error))
+    return NULL;
+
+  gsize content_len;
+  g_autofree guchar *content
+      = (guchar *)digest_file_fd (fd, rel_path, digest_type, &content_len, -1, error);
+  if (content == NULL)
+    return NULL;
+
+  guchar *signature = NULL;
+  if (!sign_data (S_IFREG, digest_type, rel_path, content, content_len, key->pkey, &signature,
+                  signature_len_out, error))
+    return NULL;
+
+  return signature;
+}
+
+/* Returns the data to sign for the regular file fd, for signing with
+ * an external tool (see validator-blob(1)) */
+guint8 *
+validator_make_sign_blob_fd (int fd, const char *rel_path, ValidatorDigestType digest_type,
+                             gsize *blob_len_out, GError **error)
+{
+  if (!rewind_fd (fd, rel_path, error))
+    return NULL;
+
+  gsize content_len;
+  g_autofree guchar *content
+      = (guchar *)digest_file_fd (fd, rel_path, digest_type, &content_len, -1, error);
+  if (content == NULL)
+    return NULL;
+
+  return make_sign_blob (rel_path, S_IFREG, digest_type, content, content_len, blob_len_out,
+                         error);
+}
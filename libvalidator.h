@@ -0,0 +1,95 @@
+/*
+ * Copyright © 2023 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+/* The public API of libvalidator, for checking (and making) validator
+ * signatures in-process. Everything here is stable, so it must not
+ * expose the internal types of utils.h. */
+
+#ifndef LIBVALIDATOR_H
+#define LIBVALIDATOR_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef enum
+{
+  VALIDATOR_DIGEST_SHA512,
+  VALIDATOR_DIGEST_FSVERITY,
+  VALIDATOR_DIGEST_CHUNKED,
+} ValidatorDigestType;
+
+#define VALIDATOR_ERROR (validator_error_quark ())
+
+/* A missing or failed signature is reported in VALIDATOR_ERROR (also
+ * when the signature is malformed), I/O errors in G_FILE_ERROR */
+typedef enum
+{
+  VALIDATOR_ERROR_NOT_SIGNED,        /* There is no signature for the file */
+  VALIDATOR_ERROR_INVALID_SIGNATURE, /* Not validly signed by any key of the keyring */
+} ValidatorError;
+
+GQuark validator_error_quark (void);
+
+/* A set of public keys, refcounted and safe to share between threads
+ * once loaded */
+typedef struct ValidatorKeyring ValidatorKeyring;
+
+ValidatorKeyring *validator_keyring_new (void);
+ValidatorKeyring *validator_keyring_ref (ValidatorKeyring *keyring);
+void validator_keyring_unref (ValidatorKeyring *keyring);
+gboolean validator_keyring_load (ValidatorKeyring *keyring, const char *path, GError **error);
+gboolean validator_keyring_load_dir (ValidatorKeyring *keyring, const char *dir, GError **error);
+guint validator_keyring_get_n_keys (ValidatorKeyring *keyring);
+
+/* Verifies files against a keyring. A verifier can be reused for any
+ * number of files, but only by one thread at a time. */
+typedef struct ValidatorVerifier ValidatorVerifier;
+
+ValidatorVerifier *validator_verifier_new (ValidatorKeyring *keyring);
+void validator_verifier_free (ValidatorVerifier *verifier);
+void validator_verifier_set_path_prefix (ValidatorVerifier *verifier, const char *path_prefix);
+gboolean validator_verifier_verify_at (ValidatorVerifier *verifier, int dir_fd, const char *name,
+                                       const char *rel_path, GError **error);
+gboolean validator_verifier_verify_fd (ValidatorVerifier *verifier, int fd, const char *rel_path,
+                                       const guint8 *signature, gsize signature_len,
+                                       GError **error);
+gboolean validator_verifier_verify_symlink (ValidatorVerifier *verifier, const char *target,
+                                            const char *rel_path, const guint8 *signature,
+                                            gsize signature_len, GError **error);
+
+/* A private key, for signing */
+typedef struct ValidatorSigningKey ValidatorSigningKey;
+
+ValidatorSigningKey *validator_signing_key_load (const char *path, GError **error);
+void validator_signing_key_free (ValidatorSigningKey *key);
+guint8 *validator_sign_fd (ValidatorSigningKey *key, int fd, const char *rel_path,
+                           ValidatorDigestType digest_type, gsize *signature_len_out,
+                           GError **error);
+guint8 *validator_make_sign_blob_fd (int fd, const char *rel_path, ValidatorDigestType digest_type,
+                                     gsize *blob_len_out, GError **error);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (ValidatorKeyring, validator_keyring_unref)
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (ValidatorVerifier, validator_verifier_free)
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (ValidatorSigningKey, validator_signing_key_free)
+
+G_END_DECLS
+
+#endif /* LIBVALIDATOR_H */
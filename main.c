@@ -21,6 +21,7 @@
 #include "config.h"
 
 #include <glib.h>
+#include <openssl/crypto.h>
 #include <stdarg.h>
 
 #include <sys/stat.h>
@@ -29,6 +30,17 @@
 
 gboolean opt_recursive;
 gboolean opt_force;
+gboolean opt_incremental;
+char *opt_durability;
+gboolean opt_staged;
+gboolean opt_watch;
+char *opt_bundle;
+char *opt_verify_cache;
+gboolean opt_boot;
+gboolean opt_manifest;
+gboolean opt_pack;
+gboolean opt_fsverity;
+gboolean opt_chunked;
 char *opt_key;
 char **opt_keys;
 char **opt_key_dirs;
@@ -36,13 +48,21 @@ char **opt_configs;
 char **opt_config_dirs;
 char *opt_path_prefix;
 char *opt_path_relative;
+int opt_jobs;
+char *opt_timings;
+int opt_readahead;
+char *opt_files_from;
+gboolean opt_null;
+gboolean opt_stream;
 static int opt_verbose;
 static gboolean opt_help;
 static gboolean opt_version;
 
 /* Computed */
-GList *opt_public_keys;
+Keyring *opt_public_keys;
 EVP_PKEY *opt_private_key;
+gboolean opt_log_info;
+gboolean opt_log_debug;
 
 static gboolean
 opt_verbose_cb (const gchar *option_name, const gchar *value, gpointer data, GError **error)
@@ -51,12 +71,32 @@ opt_verbose_cb (const gchar *option_name, const gchar *value, gpointer data, GEr
   return TRUE;
 }
 
+static gboolean
+opt_stats_cb (const gchar *option_name, const gchar *value, gpointer data, GError **error)
+{
+  if (value != NULL && strcmp (value, "json") != 0 && strcmp (value, "text") != 0)
+    {
+      g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                   "Unsupported stats format '%s'", value);
+      return FALSE;
+    }
+
+  stats_enable (value != NULL && strcmp (value, "json") == 0);
+  return TRUE;
+}
+
 GOptionEntry global_entries[]
     = { { "verbose", 'v', G_OPTION_FLAG_NO_ARG, G_OPTION_ARG_CALLBACK, &opt_verbose_cb,
           "Show debug information", NULL },
         { "help", '?', G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_NONE, &opt_help, NULL, NULL },
         { "version", 0, 0, G_OPTION_ARG_NONE, &opt_version, "Print version information and exit",
           NULL },
+        { "stats", 0, G_OPTION_FLAG_OPTIONAL_ARG, G_OPTION_ARG_CALLBACK, &opt_stats_cb,
+          "Print statistics on exit (text or json)", "FORMAT" },
+        { "timings", 0, G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_FILENAME, &opt_timings,
+          "Append per-file processing times to this file", "FILE" },
+        { "readahead", 0, 0, G_OPTION_ARG_INT, &opt_readahead,
+          "Prefetch files this many files before they are processed (default: 0, off)", "N" },
         { NULL } };
 
 GOptionEntry privkey_entries[]
@@ -77,6 +117,21 @@ GOptionEntry sign_entries[]
           "Add prefix to signed paths", NULL },
         { "force", 'f', 0, G_OPTION_ARG_NONE, &opt_force, "Force signatures (replace existing)",
           NULL },
+        { "manifest", 0, 0, G_OPTION_ARG_NONE, &opt_manifest,
+          "Write a single signed manifest instead of a signature per file", NULL },
+        { "pack", 0, 0, G_OPTION_ARG_NONE, &opt_pack,
+          "Put the signatures in a signature pack per directory instead of .sig files", NULL },
+        { "fsverity", 0, 0, G_OPTION_ARG_NONE, &opt_fsverity,
+          "Sign the fs-verity digest of files instead of the sha512", NULL },
+        { "chunked", 0, 0, G_OPTION_ARG_NONE, &opt_chunked,
+          "Sign the chunked digest of files, which large files are hashed in parallel for",
+          NULL },
+        { "files-from", 0, 0, G_OPTION_ARG_FILENAME, &opt_files_from,
+          "Sign the files listed in this file (- for stdin), one per line", "FILE" },
+        { "null", '0', 0, G_OPTION_ARG_NONE, &opt_null,
+          "Files in --files-from are separated by NUL instead of newline", NULL },
+        { "jobs", 'j', 0, G_OPTION_ARG_INT, &opt_jobs,
+          "Number of parallel jobs (default: number of CPUs)", "N" },
         { NULL } };
 
 GOptionEntry validate_entries[]
@@ -84,6 +139,14 @@ GOptionEntry validate_entries[]
           "Validate relative to this directory", NULL },
         { "recursive", 'r', 0, G_OPTION_ARG_NONE, &opt_recursive, "Validate files recursively",
           NULL },
+        { "files-from", 0, 0, G_OPTION_ARG_FILENAME, &opt_files_from,
+          "Validate the files listed in this file (- for stdin), one per line", "FILE" },
+        { "null", '0', 0, G_OPTION_ARG_NONE, &opt_null,
+          "Files in --files-from are separated by NUL instead of newline", NULL },
+        { "verify-cache", 0, 0, G_OPTION_ARG_FILENAME, &opt_verify_cache,
+          "Skip verifying unchanged files that an install verified before", "FILE" },
+        { "jobs", 'j', 0, G_OPTION_ARG_INT, &opt_jobs,
+          "Number of parallel jobs (default: number of CPUs)", "N" },
         { NULL } };
 
 GOptionEntry install_entries[]
@@ -105,13 +168,72 @@ GOptionEntry install_entries[]
             &opt_force,
             "Replace existing files",
         },
+        { "files-from", 0, 0, G_OPTION_ARG_FILENAME, &opt_files_from,
+          "Install the files listed in this file (- for stdin), one per line", "FILE" },
+        { "null", '0', 0, G_OPTION_ARG_NONE, &opt_null,
+          "Files in --files-from are separated by NUL instead of newline", NULL },
+        { "incremental", 0, 0, G_OPTION_ARG_NONE, &opt_incremental,
+          "Don't rewrite destination files that are already up to date", NULL },
+        { "durability", 0, 0, G_OPTION_ARG_STRING, &opt_durability,
+          "How installed files are synced to disk (none, batch or file)", "MODE" },
+        { "staged", 0, 0, G_OPTION_ARG_NONE, &opt_staged,
+          "Build the new destination next to it, and swap it in when complete", NULL },
+        { "watch", 0, 0, G_OPTION_ARG_NONE, &opt_watch,
+          "Keep running, and install changed files as they change", NULL },
+        { "bundle", 0, 0, G_OPTION_ARG_FILENAME, &opt_bundle,
+          "Install the files in this bundle (- for stdin) instead of sources", "FILE" },
+        { "verify-cache", 0, 0, G_OPTION_ARG_FILENAME, &opt_verify_cache,
+          "Skip verifying unchanged sources verified before, and record new ones", "FILE" },
+        { "boot", 0, 0, G_OPTION_ARG_NONE, &opt_boot,
+          "Start quickly for early boot, by default with the boot config dirs", NULL },
+        { "jobs", 'j', 0, G_OPTION_ARG_INT, &opt_jobs,
+          "Number of parallel jobs (default: number of CPUs)", "N" },
         { NULL } };
 
-GOptionEntry blob_entries[] = { { "relative-to", 0, 0, G_OPTION_ARG_FILENAME, &opt_path_relative,
-                                  "Paths relative to this directory", NULL },
-                                { "path-prefix", 'p', 0, G_OPTION_ARG_FILENAME, &opt_path_prefix,
-                                  "Add prefix to relative paths", NULL },
-                                { NULL } };
+/* Where validator-boot.service (from the dracut module) finds its configs */
+static const char *boot_config_dirs[]
+    = { "/etc/validator/boot.d", "/usr/lib/validator/boot.d", NULL };
+
+GOptionEntry blob_entries[]
+    = { { "relative-to", 0, 0, G_OPTION_ARG_FILENAME, &opt_path_relative,
+          "Paths relative to this directory", NULL },
+        { "path-prefix", 'p', 0, G_OPTION_ARG_FILENAME, &opt_path_prefix,
+          "Add prefix to relative paths", NULL },
+        { "fsverity", 0, 0, G_OPTION_ARG_NONE, &opt_fsverity,
+          "Use the fs-verity digest of the file", NULL },
+        { "chunked", 0, 0, G_OPTION_ARG_NONE, &opt_chunked, "Use the chunked digest of the file",
+          NULL },
+        { "stream", 0, 0, G_OPTION_ARG_NONE, &opt_stream,
+          "Output a stream of path and blob records, for any number of files", NULL },
+        { "recursive", 'r', 0, G_OPTION_ARG_NONE, &opt_recursive,
+          "Output blobs for files recursively (with --stream)", NULL },
+        { "jobs", 'j', 0, G_OPTION_ARG_INT, &opt_jobs,
+          "Number of parallel jobs (default: number of CPUs)", "N" },
+        { NULL } };
+
+GOptionEntry import_signatures_entries[]
+    = { { "path-prefix", 'p', 0, G_OPTION_ARG_FILENAME, &opt_path_prefix,
+          "The prefix the blobs were made with", NULL },
+        { "fsverity", 0, 0, G_OPTION_ARG_NONE, &opt_fsverity,
+          "The blobs were for fs-verity digests", NULL },
+        { "chunked", 0, 0, G_OPTION_ARG_NONE, &opt_chunked, "The blobs were for chunked digests",
+          NULL },
+        { NULL } };
+
+GOptionEntry keyring_entries[] = { { NULL } };
+
+GOptionEntry bundle_entries[]
+    = { { "recursive", 'r', 0, G_OPTION_ARG_NONE, &opt_recursive, "Bundle files recursively",
+          NULL },
+        { "relative-to", 0, 0, G_OPTION_ARG_FILENAME, &opt_path_relative,
+          "Bundle relative to this directory", NULL },
+        { "path-prefix", 'p', 0, G_OPTION_ARG_FILENAME, &opt_path_prefix,
+          "Add prefix to signed paths", NULL },
+        { "key", 0, 0, G_OPTION_ARG_FILENAME, &opt_key,
+          "Private key to sign with, instead of using the existing signatures", "FILE" },
+        { "chunked", 0, 0, G_OPTION_ARG_NONE, &opt_chunked,
+          "Sign the chunked digest of files instead of the sha512", NULL },
+        { NULL } };
 
 static void
 message_handler (const gchar *log_domain, GLogLevelFlags log_level, const gchar *message,
@@ -151,41 +273,38 @@ read_private_key (void)
     }
 }
 
-GList *
+Keyring *
 read_public_keys (const char **keys, const char **key_dirs)
 {
-  GList *res = NULL;
+  g_autoptr (Keyring) res = keyring_new ();
+  gint64 start = stats_begin ();
 
   for (int i = 0; keys != NULL && keys[i] != NULL; i++)
     {
       const char *key_path = keys[i];
       g_autoptr (GError) error = NULL;
-      g_autoptr (EVP_PKEY) key = load_pub_key (key_path, &error);
-      if (key == NULL)
+      if (!load_pub_keys (key_path, res, &error))
         {
           g_printerr ("error: %s\n", error->message);
           exit (EXIT_FAILURE);
         }
-
-      res = g_list_append (res, g_steal_pointer (&key));
     }
 
   for (int i = 0; key_dirs != NULL && key_dirs[i] != NULL; i++)
     {
       const char *key_dir_path = key_dirs[i];
 
-      GList *dir_keys;
       g_autoptr (GError) error = NULL;
-      if (!load_pub_keys_from_dir (key_dir_path, &dir_keys, &error))
+      if (!load_pub_keys_from_dir (key_dir_path, res, &error))
         {
           g_printerr ("error: %s\n", error->message);
           exit (EXIT_FAILURE);
         }
-
-      res = g_list_concat (res, dir_keys);
     }
 
-  return res;
+  stats_end (STATS_PHASE_KEYS, start);
+
+  return g_steal_pointer (&res);
 }
 
 static const char *
@@ -219,6 +338,12 @@ extract_command (int *argc, char **argv)
 static void
 canonicalize_opts (void)
 {
+  if (opt_jobs < 0)
+    help_error ("Invalid number of jobs %d", opt_jobs);
+
+  if (opt_readahead < 0)
+    help_error ("Invalid readahead %d", opt_readahead);
+
   if (opt_path_relative)
     {
       g_autofree char *old = g_steal_pointer (&opt_path_relative);
@@ -254,7 +379,11 @@ static struct CommandInfo commands[] = {
   { "validate", validate_entries, COMMAND_PUBKEYS, cmd_validate, "validate FILE [FILE...]" },
   { "install", install_entries, COMMAND_PUBKEYS, cmd_install,
     "install SOURCE [SOURCE..] DESTINATION" },
-  { "blob", blob_entries, 0, cmd_blob, "blob FILE" },
+  { "blob", blob_entries, 0, cmd_blob, "blob FILE [FILE...]" },
+  { "import-signatures", import_signatures_entries, COMMAND_PUBKEYS, cmd_import_signatures,
+    "import-signatures DIR" },
+  { "keyring", keyring_entries, COMMAND_PUBKEYS, cmd_keyring, "keyring build OUTPUT" },
+  { "bundle", bundle_entries, 0, cmd_bundle, "bundle create BUNDLE FILE [FILE...]" },
 };
 
 static struct CommandInfo *
@@ -268,6 +397,20 @@ find_command (const char *name)
   return NULL;
 }
 
+/* The digest type selected by --fsverity or --chunked */
+ValidatorDigestType
+opt_get_digest_type (void)
+{
+  if (opt_fsverity && opt_chunked)
+    help_error ("--fsverity and --chunked can't be used together");
+
+  if (opt_fsverity)
+    return VALIDATOR_DIGEST_FSVERITY;
+  if (opt_chunked)
+    return VALIDATOR_DIGEST_CHUNKED;
+  return VALIDATOR_DIGEST_SHA512;
+}
+
 char *
 opt_get_relative_path (const char *path, const char *relative_to, const char *optional_path_prefix)
 {
@@ -284,6 +427,54 @@ opt_get_relative_path (const char *path, const char *relative_to, const char *op
   return g_strdup (rel_path);
 }
 
+/* Calls func with the canonical path of each file listed in
+ * --files-from. The list is read one entry at a time, so it is never
+ * all in memory, and the walker bounds the files queued from it. */
+gboolean
+opt_read_files_from (OptFileFunc func, gpointer user_data, GError **error)
+{
+  FILE *f = stdin;
+  if (strcmp (opt_files_from, "-") != 0)
+    {
+      f = fopen (opt_files_from, "re");
+      if (f == NULL)
+        {
+          g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno), "Can't open '%s': %s",
+                       opt_files_from, strerror (errno));
+          return FALSE;
+        }
+    }
+
+  /* g_canonicalize_filename() would look this up for each entry */
+  g_autofree char *cwd = g_get_current_dir ();
+  int separator = opt_null ? '\0' : '\n';
+  char *entry = NULL;
+  size_t entry_size = 0;
+  ssize_t len;
+
+  while ((len = getdelim (&entry, &entry_size, separator, f)) >= 0)
+    {
+      if (len > 0 && entry[len - 1] == separator)
+        entry[--len] = 0;
+      if (len == 0)
+        continue;
+
+      g_autofree char *path = g_canonicalize_filename (entry, cwd);
+      func (path, user_data);
+    }
+
+  gboolean res = !ferror (f);
+  if (!res)
+    g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno), "Can't read '%s': %s",
+                 opt_files_from, strerror (errno));
+
+  free (entry);
+  if (f != stdin)
+    fclose (f);
+
+  return res;
+}
+
 int
 main (int argc, char *argv[])
 {
@@ -308,7 +499,11 @@ main (int argc, char *argv[])
                                          "  sign         Sign files\n"
                                          "  validate     Validate files\n"
                                          "  install      Install validated files\n"
-                                         "  blob         Output blob for external signing\n");
+                                         "  blob         Output blob for external signing\n"
+                                         "  import-signatures\n"
+                                         "               Import external signatures\n"
+                                         "  keyring      Build compiled keyrings\n"
+                                         "  bundle       Create and list bundles\n");
   g_option_context_add_main_entries (context, global_entries, NULL);
 
   if (command != NULL)
@@ -330,6 +525,11 @@ main (int argc, char *argv[])
   if (opt_verbose > 1)
     g_log_set_handler (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, message_handler, NULL);
 
+  /* G_MESSAGES_DEBUG makes the default handler print them too */
+  gboolean messages_debug = g_getenv ("G_MESSAGES_DEBUG") != NULL;
+  opt_log_info = opt_verbose > 0 || messages_debug;
+  opt_log_debug = opt_verbose > 1 || messages_debug;
+
   if (opt_version)
     {
       g_print ("%s\n", PACKAGE_STRING);
@@ -339,6 +539,20 @@ main (int argc, char *argv[])
   if (command == NULL)
     help_error ("No command given");
 
+  /* Boot mode runs in the initramfs, where the startup time adds to
+   * the boot time. OpenSSL doesn't read its config file there, which
+   * can load providers and engines, so only the built-in
+   * implementations we use are fetched. This has to happen before
+   * anything else uses OpenSSL. */
+  if (opt_boot)
+    {
+      OPENSSL_init_crypto (OPENSSL_INIT_NO_LOAD_CONFIG, NULL);
+
+      if (argc == 1 && opt_files_from == NULL && opt_bundle == NULL && opt_configs == NULL
+          && opt_config_dirs == NULL)
+        opt_config_dirs = g_strdupv ((char **)boot_config_dirs);
+    }
+
   if (command->flags & COMMAND_PRIVKEY)
     read_private_key ();
 
@@ -353,5 +567,9 @@ main (int argc, char *argv[])
 
   canonicalize_opts ();
 
-  return command->cmd (argc, argv);
+  int res = command->cmd (argc, argv);
+
+  stats_print ();
+
+  return res;
 }
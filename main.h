@@ -19,10 +19,27 @@
  */
 
 #include "utils.h"
+#include "manifest.h"
+#include "sigpack.h"
+#include "walk.h"
+#include "bundle.h"
+#include "verifycache.h"
+#include "stats.h"
 #include <glib.h>
 
 extern gboolean opt_recursive;
 extern gboolean opt_force;
+extern gboolean opt_incremental;
+extern char *opt_durability;
+extern gboolean opt_staged;
+extern gboolean opt_watch;
+extern char *opt_bundle;
+extern char *opt_verify_cache;
+extern gboolean opt_boot;
+extern gboolean opt_manifest;
+extern gboolean opt_pack;
+extern gboolean opt_fsverity;
+extern gboolean opt_chunked;
 extern char *opt_key;
 extern char **opt_keys;
 extern char **opt_key_dirs;
@@ -30,18 +47,50 @@ extern char **opt_configs;
 extern char **opt_config_dirs;
 extern char *opt_path_prefix;
 extern char *opt_path_relative;
+extern int opt_jobs;
+extern char *opt_timings;
+extern int opt_readahead;
+extern char *opt_files_from;
+extern gboolean opt_null;
+extern gboolean opt_stream;
 
 /* Computed */
-extern GList *opt_public_keys;
+extern Keyring *opt_public_keys;
 extern EVP_PKEY *opt_private_key;
+extern gboolean opt_log_info;
+extern gboolean opt_log_debug;
+
+/* g_info() and g_debug() format the message even when it is then
+ * dropped, so the messages logged for each file check these first */
+#define log_info(...)                                                                              \
+  G_STMT_START                                                                                     \
+  {                                                                                                \
+    if (opt_log_info)                                                                              \
+      g_info (__VA_ARGS__);                                                                        \
+  }                                                                                                \
+  G_STMT_END
+#define log_debug(...)                                                                             \
+  G_STMT_START                                                                                     \
+  {                                                                                                \
+    if (opt_log_debug)                                                                             \
+      g_debug (__VA_ARGS__);                                                                       \
+  }                                                                                                \
+  G_STMT_END
 
 int cmd_sign (int argc, char *argv[]);
 int cmd_validate (int argc, char *argv[]);
 int cmd_install (int argc, char *argv[]);
 int cmd_blob (int argc, char *argv[]);
+int cmd_import_signatures (int argc, char *argv[]);
+int cmd_keyring (int argc, char *argv[]);
+int cmd_bundle (int argc, char *argv[]);
 
 void help_error (const char *error_msg_fmt, ...);
+ValidatorDigestType opt_get_digest_type (void);
 char *opt_get_relative_path (const char *path, const char *relative_to,
                              const char *optional_path_prefix);
 
-GList *read_public_keys (const char **keys, const char **key_dirs);
+typedef void (*OptFileFunc) (const char *path, gpointer user_data);
+gboolean opt_read_files_from (OptFileFunc func, gpointer user_data, GError **error);
+
+Keyring *read_public_keys (const char **keys, const char **key_dirs);
@@ -0,0 +1,431 @@
+/*
+ * Copyright © 2023 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+#include "config.h"
+#include "main.h"
+
+#include <fcntl.h>
+
+/* A manifest lists the content of all files in a tree, so only the
+ * manifest itself needs a signature (as a regular file, in
+ * VALIDATOR_MANIFEST_NAME.sig). The format is designed so that lookups
+ * can be done directly on the file data (e.g. from a mmap) without
+ * parsing it. All integers are little-endian:
+ *
+ *   magic      "VALIDMF\001"
+ *   guint32    n_entries
+ *   guint32    reserved (0)
+ *   guint32    offset[n_entries]  (sorted by path)
+ *
+ * followed by the entries the offsets point to:
+ *
+ *   guint8     type (0 = regular file, 1 = symlink)
+ *   char       path[]             (nul terminated, as signed)
+ *   guint32    content_len
+ *   guchar     content[content_len] (sha512 or symlink target)
+ */
+
+#define MANIFEST_HEADER_LEN (VALIDATOR_MANIFEST_MAGIC_LEN + 4 + 4)
+
+struct Manifest
+{
+  guchar *data;
+  gsize size;
+  guint32 n_entries;
+};
+
+typedef struct
+{
+  char *path;
+  int type;
+  guchar *content;
+  gsize content_len;
+} ManifestEntry;
+
+struct ManifestBuilder
+{
+  char *dir;
+  GMutex lock;
+  GPtrArray *entries;
+};
+
+static gboolean
+digest_data (const guchar *data, gsize len, guchar *digest, gsize *digest_len, GError **error)
+{
+  guint len_out = 0;
+
+  if (EVP_Digest (data, len, digest, &len_out, get_sha512_md (), NULL) == 0)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Can't compute sha512 operation");
+      return FALSE;
+    }
+
+  *digest_len = len_out;
+  return TRUE;
+}
+
+/* Loads and validates the manifest in dir, if any. Returns NULL without
+ * setting error if there is no manifest. */
+Manifest *
+manifest_load (const char *dir, const char *relative_to, const char *path_prefix,
+               Keyring *pub_keys, GError **error)
+{
+  g_autofree char *path = g_build_filename (dir, VALIDATOR_MANIFEST_NAME, NULL);
+  g_autofree char *sig_path = g_strconcat (path, ".sig", NULL);
+
+  g_autofree char *contents = NULL;
+  gsize size = 0;
+  g_autoptr (GError) local_error = NULL;
+  if (!load_file_at (AT_FDCWD, path, path, &contents, &size, &local_error))
+    {
+      if (g_error_matches (local_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        return NULL;
+
+      g_propagate_prefixed_error (error, g_steal_pointer (&local_error),
+                                  "Failed to load manifest '%s': ", path);
+      return NULL;
+    }
+
+  g_autofree char *signature = NULL;
+  gsize signature_len = 0;
+  if (!g_file_get_contents (sig_path, &signature, &signature_len, &local_error))
+    {
+      if (g_error_matches (local_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_NOENT, "No signature for '%s'", path);
+      else
+        g_propagate_prefixed_error (error, g_steal_pointer (&local_error),
+                                    "Failed to load '%s': ", sig_path);
+      return NULL;
+    }
+
+  const guchar *data = (const guchar *)contents;
+
+  g_autofree char *rel_path = opt_get_relative_path (path, relative_to, path_prefix);
+  if (rel_path == NULL)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "File '%s' not inside relative dir",
+                   path);
+      return NULL;
+    }
+
+  guchar digest[EVP_MAX_MD_SIZE];
+  gsize digest_len;
+  if (!digest_data (data, size, digest, &digest_len, error))
+    return NULL;
+
+  if (!validate_data (rel_path, S_IFREG, digest, digest_len, signature, signature_len, pub_keys,
+                      &local_error))
+    {
+      if (local_error)
+        g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                     "Signature of '%s' is invalid (as %s): %s", path, rel_path,
+                     local_error->message);
+      else
+        g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                     "Signature of '%s' is invalid (as %s)", path, rel_path);
+      return NULL;
+    }
+
+  if (size < MANIFEST_HEADER_LEN
+      || memcmp (data, VALIDATOR_MANIFEST_MAGIC, VALIDATOR_MANIFEST_MAGIC_LEN) != 0)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "Invalid manifest '%s'", path);
+      return NULL;
+    }
+
+  guint32 n_entries = read_uint32 (data + VALIDATOR_MANIFEST_MAGIC_LEN);
+  if (n_entries > (size - MANIFEST_HEADER_LEN) / 4)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "Invalid manifest '%s'", path);
+      return NULL;
+    }
+
+  g_info ("Loaded manifest '%s' with %u entries", path, n_entries);
+
+  Manifest *manifest = g_new0 (Manifest, 1);
+  manifest->data = (guchar *)g_steal_pointer (&contents);
+  manifest->size = size;
+  manifest->n_entries = n_entries;
+
+  return manifest;
+}
+
+void
+manifest_free (Manifest *manifest)
+{
+  if (manifest == NULL)
+    return;
+
+  g_free (manifest->data);
+  g_free (manifest);
+}
+
+/* Returns the path of entry i, and the position after it */
+static const char *
+manifest_get_path (Manifest *manifest, guint32 i, gsize *end_out)
+{
+  guint32 offset = read_uint32 (manifest->data + MANIFEST_HEADER_LEN + i * 4);
+  if (offset >= manifest->size - 1)
+    return NULL;
+
+  const guchar *path = manifest->data + offset + 1;
+  const guchar *nul = memchr (path, 0, manifest->size - offset - 1);
+  if (nul == NULL)
+    return NULL;
+
+  *end_out = (nul + 1) - manifest->data;
+  return (const char *)path;
+}
+
+/* Reads the type and content of the entry whose path ends at end */
+static gboolean
+manifest_get_content (Manifest *manifest, const char *path, gsize end, int *type_out,
+                      const guchar **content_out, gsize *content_len_out)
+{
+  guint8 type = *((const guchar *)path - 1);
+  if (end + 4 > manifest->size)
+    return FALSE;
+  guint32 content_len = read_uint32 (manifest->data + end);
+  if (content_len > manifest->size - end - 4)
+    return FALSE;
+
+  if (type_out)
+    *type_out = type == 0 ? S_IFREG : S_IFLNK;
+  if (content_out)
+    *content_out = manifest->data + end + 4;
+  if (content_len_out)
+    *content_len_out = content_len;
+  return TRUE;
+}
+
+/* Binary search for rel_path, returns FALSE if not in the manifest */
+gboolean
+manifest_lookup (Manifest *manifest, const char *rel_path, int *type_out,
+                 const guchar **content_out, gsize *content_len_out)
+{
+  guint32 lo = 0;
+  guint32 hi = manifest->n_entries;
+
+  while (lo < hi)
+    {
+      guint32 mid = lo + (hi - lo) / 2;
+      gsize end;
+      const char *path = manifest_get_path (manifest, mid, &end);
+      if (path == NULL)
+        return FALSE; /* Corrupt */
+
+      int cmp = strcmp (rel_path, path);
+      if (cmp < 0)
+        hi = mid;
+      else if (cmp > 0)
+        lo = mid + 1;
+      else
+        return manifest_get_content (manifest, path, end, type_out, content_out,
+                                     content_len_out);
+    }
+
+  return FALSE;
+}
+
+/* Returns TRUE if rel_path is in the manifest with the given content */
+gboolean
+manifest_validate (Manifest *manifest, const char *rel_path, int type, const guchar *content,
+                   gsize content_len)
+{
+  int manifest_type;
+  const guchar *manifest_content;
+  gsize manifest_content_len;
+
+  if (!manifest_lookup (manifest, rel_path, &manifest_type, &manifest_content,
+                        &manifest_content_len))
+    return FALSE;
+
+  return manifest_type == type && manifest_content_len == content_len
+         && memcmp (manifest_content, content, content_len) == 0;
+}
+
+/* Manifests are loaded once per directory, and kept in a hashtable
+ * for the lifetime of the walk using them. If loading fails the
+ * error is returned once, and after that the dir is treated as having
+ * no manifest. */
+GHashTable *
+manifest_cache_new (void)
+{
+  return g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify)manifest_free);
+}
+
+Manifest *
+manifest_cache_load (GHashTable *cache, const char *dir, const char *path_prefix,
+                     Keyring *pub_keys, GError **error)
+{
+  gpointer cached = NULL;
+
+  if (g_hash_table_lookup_extended (cache, dir, NULL, &cached))
+    return cached;
+
+  Manifest *manifest = manifest_load (dir, dir, path_prefix, pub_keys, error);
+  g_hash_table_insert (cache, g_strdup (dir), manifest);
+  return manifest;
+}
+
+static void
+manifest_entry_free (ManifestEntry *entry)
+{
+  g_free (entry->path);
+  g_free (entry->content);
+  g_free (entry);
+}
+
+ManifestBuilder *
+manifest_builder_new (const char *dir)
+{
+  ManifestBuilder *builder = g_new0 (ManifestBuilder, 1);
+
+  builder->dir = g_strdup (dir);
+  builder->entries = g_ptr_array_new_with_free_func ((GDestroyNotify)manifest_entry_free);
+  g_mutex_init (&builder->lock);
+
+  return builder;
+}
+
+void
+manifest_builder_free (ManifestBuilder *builder)
+{
+  g_ptr_array_unref (builder->entries);
+  g_mutex_clear (&builder->lock);
+  g_free (builder->dir);
+  g_free (builder);
+}
+
+const char *
+manifest_builder_get_dir (ManifestBuilder *builder)
+{
+  return builder->dir;
+}
+
+/* This may be called from multiple threads */
+void
+manifest_builder_add (ManifestBuilder *builder, const char *rel_path, int type,
+                      const guchar *content, gsize content_len)
+{
+  ManifestEntry *entry = g_new0 (ManifestEntry, 1);
+
+  entry->path = g_strdup (rel_path);
+  entry->type = type;
+  entry->content = g_malloc (content_len);
+  memcpy (entry->content, content, content_len);
+  entry->content_len = content_len;
+
+  g_mutex_lock (&builder->lock);
+  g_ptr_array_add (builder->entries, entry);
+  g_mutex_unlock (&builder->lock);
+}
+
+/* Adds the entries of existing that were not added to the builder, so
+ * that a manifest can be updated with only some of its files */
+void
+manifest_builder_merge (ManifestBuilder *builder, Manifest *existing)
+{
+  g_autoptr (GHashTable) added = g_hash_table_new (g_str_hash, g_str_equal);
+  for (guint i = 0; i < builder->entries->len; i++)
+    {
+      ManifestEntry *entry = g_ptr_array_index (builder->entries, i);
+      g_hash_table_add (added, entry->path);
+    }
+
+  for (guint32 i = 0; i < existing->n_entries; i++)
+    {
+      gsize end;
+      int type;
+      const guchar *content;
+      gsize content_len;
+      const char *path = manifest_get_path (existing, i, &end);
+      if (path == NULL
+          || !manifest_get_content (existing, path, end, &type, &content, &content_len))
+        break; /* Corrupt, so it is replaced by what was added */
+
+      if (!g_hash_table_contains (added, path))
+        manifest_builder_add (builder, path, type, content, content_len);
+    }
+}
+
+static int
+compare_entries (gconstpointer a, gconstpointer b)
+{
+  const ManifestEntry *entry_a = *(const ManifestEntry **)a;
+  const ManifestEntry *entry_b = *(const ManifestEntry **)b;
+
+  return strcmp (entry_a->path, entry_b->path);
+}
+
+gboolean
+manifest_builder_write (ManifestBuilder *builder, const char *path, GError **error)
+{
+  GPtrArray *entries = builder->entries;
+
+  g_ptr_array_sort (entries, compare_entries);
+
+  g_autoptr (GString) s = g_string_new (NULL);
+  g_string_append_len (s, VALIDATOR_MANIFEST_MAGIC, VALIDATOR_MANIFEST_MAGIC_LEN);
+  append_uint32 (s, entries->len);
+  append_uint32 (s, 0);
+
+  gsize offset = MANIFEST_HEADER_LEN + entries->len * 4;
+  ManifestEntry *prev = NULL;
+  for (guint i = 0; i < entries->len; i++)
+    {
+      ManifestEntry *entry = g_ptr_array_index (entries, i);
+
+      if (prev != NULL && strcmp (entry->path, prev->path) == 0)
+        {
+          g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                       "Path '%s' is included twice in manifest", entry->path);
+          return FALSE;
+        }
+
+      if (offset > G_MAXUINT32)
+        {
+          g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "Manifest too large");
+          return FALSE;
+        }
+
+      append_uint32 (s, offset);
+      offset += 1 + strlen (entry->path) + 1 + 4 + entry->content_len;
+      prev = entry;
+    }
+
+  for (guint i = 0; i < entries->len; i++)
+    {
+      ManifestEntry *entry = g_ptr_array_index (entries, i);
+
+      g_string_append_c (s, entry->type == S_IFREG ? 0 : 1);
+      g_string_append_len (s, entry->path, strlen (entry->path) + 1);
+      append_uint32 (s, entry->content_len);
+      g_string_append_len (s, (const char *)entry->content, entry->content_len);
+    }
+
+  if (!g_file_set_contents (path, s->str, s->len, error))
+    {
+      g_prefix_error (error, "Failed to write manifest '%s': ", path);
+      return FALSE;
+    }
+
+  return TRUE;
+}
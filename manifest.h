@@ -0,0 +1,50 @@
+/*
+ * Copyright © 2023 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+#include <glib.h>
+
+#define VALIDATOR_MANIFEST_NAME ".validator-manifest"
+#define VALIDATOR_MANIFEST_MAGIC "VALIDMF\001"
+#define VALIDATOR_MANIFEST_MAGIC_LEN 8
+
+typedef struct Manifest Manifest;
+typedef struct ManifestBuilder ManifestBuilder;
+
+Manifest *manifest_load (const char *dir, const char *relative_to, const char *path_prefix,
+                         Keyring *pub_keys, GError **error);
+void manifest_free (Manifest *manifest);
+gboolean manifest_lookup (Manifest *manifest, const char *rel_path, int *type_out,
+                          const guchar **content_out, gsize *content_len_out);
+gboolean manifest_validate (Manifest *manifest, const char *rel_path, int type,
+                            const guchar *content, gsize content_len);
+GHashTable *manifest_cache_new (void);
+Manifest *manifest_cache_load (GHashTable *cache, const char *dir, const char *path_prefix,
+                               Keyring *pub_keys, GError **error);
+
+ManifestBuilder *manifest_builder_new (const char *dir);
+void manifest_builder_free (ManifestBuilder *builder);
+const char *manifest_builder_get_dir (ManifestBuilder *builder);
+void manifest_builder_add (ManifestBuilder *builder, const char *rel_path, int type,
+                           const guchar *content, gsize content_len);
+void manifest_builder_merge (ManifestBuilder *builder, Manifest *existing);
+gboolean manifest_builder_write (ManifestBuilder *builder, const char *path, GError **error);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (Manifest, manifest_free)
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (ManifestBuilder, manifest_builder_free)
@@ -0,0 +1,37 @@
+/*
+ * Copyright © 2023 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+
+/* Static (USDT) probes for tracing with perf or bpftrace. These are
+ * only a nop instruction when nothing is attached. Without
+ * --enable-usdt they compile to nothing. See README.md for the list. */
+
+#ifdef HAVE_USDT
+#include <sys/sdt.h>
+#define VALIDATOR_PROBE(name) DTRACE_PROBE (validator, name)
+#define VALIDATOR_PROBE1(name, a) DTRACE_PROBE1 (validator, name, a)
+#define VALIDATOR_PROBE2(name, a, b) DTRACE_PROBE2 (validator, name, a, b)
+#define VALIDATOR_PROBE3(name, a, b, c) DTRACE_PROBE3 (validator, name, a, b, c)
+#else
+#define VALIDATOR_PROBE(name)
+#define VALIDATOR_PROBE1(name, a)
+#define VALIDATOR_PROBE2(name, a, b)
+#define VALIDATOR_PROBE3(name, a, b, c)
+#endif
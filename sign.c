@@ -21,95 +21,225 @@
 #include "config.h"
 #include "main.h"
 
+#include <fcntl.h>
+#include <unistd.h>
+
+/* With --pack, the signature pack builders of the directories that
+ * are signed in, by path */
+typedef struct
+{
+  GMutex lock;
+  GHashTable *builders;
+} SignPacks;
+
+static SigPackBuilder *
+sign_packs_get_builder (SignPacks *packs, const char *dir)
+{
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&packs->lock);
+
+  SigPackBuilder *builder = g_hash_table_lookup (packs->builders, dir);
+  if (builder == NULL)
+    {
+      builder = sigpack_builder_new (dir);
+      g_hash_table_insert (packs->builders, g_strdup (dir), builder);
+    }
+
+  return builder;
+}
+
+/* The file is name in dir_fd, path is its full path. The signature is
+ * added to pack if given, and otherwise written next to the file. */
 static gboolean
-sign (const char *path, const char *relative_to)
+sign_path (int dir_fd, const char *name, const char *path, struct stat *st,
+           const char *relative_to, ValidatorDigestType digest_type, SigPackBuilder *pack,
+           GError **error)
 {
-  struct stat st;
-  gboolean success = TRUE;
+  int type;
+  g_autofree guchar *content = NULL;
+  gsize content_len = 0;
 
-  int res = lstat (path, &st);
-  if (res < 0)
+  if (!load_file_data_for_sign_at (dir_fd, name, path, st, digest_type, &type, &content,
+                                   &content_len, -1, error))
     {
-      g_printerr ("Can't access '%s': %s\n", path, strerror (errno));
+      g_prefix_error (error, "Failed to read file '%s': ", path);
       return FALSE;
     }
 
-  int type = st.st_mode & S_IFMT;
-  if (type == S_IFREG || type == S_IFLNK)
+  g_autofree char *rel_path = opt_get_relative_path (path, relative_to, opt_path_prefix);
+  if (rel_path == NULL)
     {
-      g_autofree char *sig_path = g_strconcat (path, ".sig", NULL);
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "File '%s' not inside relative dir",
+                   path);
+      return FALSE;
+    }
 
-      if (!opt_force && g_file_test (sig_path, G_FILE_TEST_EXISTS))
-        {
-          g_info ("File '%s' already signed, ignoring", path);
-          return TRUE; /* Already signed */
-        }
+  g_autofree guchar *signature = NULL;
+  gsize signature_len = 0;
 
-      g_autofree guchar *content = NULL;
-      gsize content_len = 0;
+  if (!sign_data (type, digest_type, rel_path, content, content_len, opt_private_key, &signature,
+                  &signature_len, error))
+    {
+      g_prefix_error (error, "Failed to sign file '%s': ", path);
+      return FALSE;
+    }
 
-      g_autoptr (GError) error = NULL;
-      if (!load_file_data_for_sign (path, &st, NULL, &content, &content_len, NULL, &error))
-        {
-          g_printerr ("Failed to read file '%s': %s\n", path, error->message);
-          return FALSE;
-        }
+  if (pack)
+    {
+      sigpack_builder_add (pack, name, signature, signature_len);
+      log_info ("Signed '%s' into signature pack (for path %s)", path, rel_path);
+      return TRUE;
+    }
 
-      g_autofree char *rel_path = opt_get_relative_path (path, relative_to, opt_path_prefix);
-      if (rel_path == NULL)
-        {
-          g_printerr ("File '%s' not inside relative dir\n", path);
-          return FALSE;
-        }
+  g_autofree char *sig_path = g_strconcat (path, ".sig", NULL);
+  if (!g_file_set_contents (sig_path, (char *)signature, signature_len, error))
+    {
+      g_prefix_error (error, "Failed to write file '%s': ", sig_path);
+      return FALSE;
+    }
 
-      g_autofree guchar *signature = NULL;
-      gsize signature_len = 0;
+  log_info ("Wrote signature '%s' (for path %s)", sig_path, rel_path);
 
-      if (!sign_data (type, rel_path, content, content_len, opt_private_key, &signature,
-                      &signature_len, &error))
-        {
-          g_printerr ("Failed to sign file '%s': %s\n", path, error->message);
-          return FALSE;
-        }
+  return TRUE;
+}
+
+static gboolean
+sign_file (WalkItem *item, gpointer user_data, GError **error)
+{
+  SignPacks *packs = user_data;
 
-      if (!g_file_set_contents (sig_path, (char *)signature, signature_len, &error))
+  /* A file that is in its signature pack is signed into it even
+   * without --pack, as the pack is what validate and install use */
+  gboolean in_pack = item->sigpack && sigpack_lookup (item->sigpack, item->name, NULL, NULL);
+  if (opt_pack || in_pack)
+    {
+      if (!opt_force && in_pack)
         {
-          g_printerr ("Failed to write file '%s': %s\n", sig_path, error->message);
-          return FALSE;
+          log_info ("File '%s' already signed, ignoring", item->path);
+          return TRUE; /* Already in the pack */
         }
 
-      g_info ("Wrote signature '%s' (for path %s)", sig_path, rel_path);
+      g_autofree char *dir = g_path_get_dirname (item->path);
+      return sign_path (item->dir_fd, item->name, item->path, &item->st, item->relative_to,
+                        opt_get_digest_type (), sign_packs_get_builder (packs, dir), error);
     }
-  else if (type == S_IFDIR)
+
+  g_autofree char *sig_name = g_strconcat (item->name, ".sig", NULL);
+
+  if (!opt_force && faccessat (item->dir_fd, sig_name, F_OK, AT_SYMLINK_NOFOLLOW) == 0)
     {
-      g_autoptr (GError) dir_error = NULL;
-      g_autoptr (GDir) dir = g_dir_open (path, 0, &dir_error);
-      if (dir == NULL)
-        {
-          if (g_error_matches (dir_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
-            return TRUE;
-          g_printerr ("Failed to open dir '%s': %s\n", path, strerror (errno));
-          return FALSE;
-        }
+      log_info ("File '%s' already signed, ignoring", item->path);
+      return TRUE; /* Already signed */
+    }
 
-      const char *child;
-      while ((child = g_dir_read_name (dir)) != NULL)
-        {
-          if (g_str_has_suffix (child, ".sig"))
-            continue; /* Skip existing signatures */
+  return sign_path (item->dir_fd, item->name, item->path, &item->st, item->relative_to,
+                    opt_get_digest_type (), NULL, error);
+}
 
-          g_autofree char *child_path = g_build_filename (path, child, NULL);
-          if (!sign (child_path, relative_to))
-            success = FALSE;
-        }
+/* In manifest mode we just collect the data for each file, and sign
+ * the resulting manifest at the end */
+static gboolean
+add_file_to_manifest (WalkItem *item, gpointer user_data, GError **error)
+{
+  ManifestBuilder *builder = item->root_data;
+  const char *path = item->path;
+
+  g_autofree guchar *content = NULL;
+  gsize content_len = 0;
+
+  if (!load_file_data_for_sign_at (item->dir_fd, item->name, path, &item->st,
+                                   VALIDATOR_DIGEST_SHA512, NULL, &content, &content_len, -1,
+                                   error))
+    {
+      g_prefix_error (error, "Failed to read file '%s': ", path);
+      return FALSE;
+    }
+
+  g_autofree char *rel_path = opt_get_relative_path (path, item->relative_to, opt_path_prefix);
+  if (rel_path == NULL)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "File '%s' not inside relative dir",
+                   path);
+      return FALSE;
     }
-  else
+
+  manifest_builder_add (builder, rel_path, item->type, content, content_len);
+
+  log_debug ("Added '%s' to manifest (as %s)", path, rel_path);
+
+  return TRUE;
+}
+
+static gboolean
+write_manifest (ManifestBuilder *builder)
+{
+  const char *dir = manifest_builder_get_dir (builder);
+  g_autofree char *path = g_build_filename (dir, VALIDATOR_MANIFEST_NAME, NULL);
+
+  /* Files of an existing manifest that were not signed this time are
+   * kept, as long as the manifest validates with our key (so any key
+   * change needs the whole tree to be signed again) */
+  g_autoptr (Keyring) keys = keyring_new ();
+  EVP_PKEY_up_ref (opt_private_key);
+  keyring_add_key (keys, opt_private_key);
+
+  g_autoptr (GError) error = NULL;
+  g_autoptr (Manifest) existing = manifest_load (dir, dir, opt_path_prefix, keys, &error);
+  if (existing)
+    manifest_builder_merge (builder, existing);
+  else if (error)
     {
-      g_printerr ("Unsupported file type for '%s'\n", path);
-      success = FALSE;
+      log_info ("Replacing existing manifest: %s", error->message);
+      g_clear_error (&error);
     }
 
-  return success;
+  if (!manifest_builder_write (builder, path, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      return FALSE;
+    }
+
+  if (!sign_path (AT_FDCWD, path, path, NULL, dir, VALIDATOR_DIGEST_SHA512, NULL, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* There is one manifest per relative dir, shared by all arguments with it */
+static ManifestBuilder *
+get_manifest_builder (GPtrArray *builders, const char *relative_to)
+{
+  for (guint i = 0; i < builders->len; i++)
+    {
+      ManifestBuilder *builder = g_ptr_array_index (builders, i);
+      if (strcmp (manifest_builder_get_dir (builder), relative_to) == 0)
+        return builder;
+    }
+
+  ManifestBuilder *builder = manifest_builder_new (relative_to);
+  g_ptr_array_add (builders, builder);
+  return builder;
+}
+
+typedef struct
+{
+  Walker *walker;
+  GPtrArray *manifests;
+} SignList;
+
+static void
+sign_list_entry (const char *path, gpointer user_data)
+{
+  SignList *list = user_data;
+  g_autofree char *dirname = g_path_get_dirname (path);
+  const char *relative_to = opt_path_relative ? opt_path_relative : dirname;
+
+  if (opt_manifest)
+    walker_set_root_data (list->walker, get_manifest_builder (list->manifests, relative_to));
+
+  walker_walk_file (list->walker, path, relative_to, NULL);
 }
 
 int
@@ -117,33 +247,87 @@ cmd_sign (int argc, char *argv[])
 {
   g_autoptr (GError) error = NULL;
 
-  if (argc == 1)
+  if (argc == 1 && opt_files_from == NULL)
     help_error ("No input files given");
 
-  gboolean res = TRUE;
+  /* Checks the options, before any file is signed */
+  ValidatorDigestType digest_type = opt_get_digest_type ();
+  if (opt_manifest && digest_type != VALIDATOR_DIGEST_SHA512)
+    help_error ("--fsverity and --chunked are not supported with --manifest");
+  if (opt_manifest && opt_pack)
+    help_error ("--pack can't be used with --manifest");
+
+  SignPacks packs = { 0 };
+  g_mutex_init (&packs.lock);
+  packs.builders = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                          (GDestroyNotify)sigpack_builder_free);
+
+  g_autoptr (GPtrArray) manifests
+      = g_ptr_array_new_with_free_func ((GDestroyNotify)manifest_builder_free);
+  g_autoptr (Walker) walker
+      = walker_new (opt_jobs, opt_manifest ? add_file_to_manifest : sign_file, &packs);
+
   for (gsize i = 1; i < argc; i++)
     {
       g_autofree char *path = g_canonicalize_filename (argv[i], NULL);
+      g_autofree char *dirname = NULL;
+      const char *relative_to;
 
       if (g_file_test (path, G_FILE_TEST_IS_DIR))
         {
           if (!opt_recursive)
             {
+              walker_finish (walker);
               g_printerr ("error: '%s' is a directory and not in recursive mode\n", path);
               return EXIT_FAILURE;
             }
 
-          if (!sign (path, opt_path_relative ? opt_path_relative : path))
-            res = FALSE;
+          relative_to = opt_path_relative ? opt_path_relative : path;
         }
       else
         {
-          g_autofree char *dirname = g_path_get_dirname (path);
+          dirname = g_path_get_dirname (path);
+          relative_to = opt_path_relative ? opt_path_relative : dirname;
+        }
 
-          if (!sign (path, opt_path_relative ? opt_path_relative : dirname))
-            res = FALSE;
+      if (opt_manifest)
+        walker_set_root_data (walker, get_manifest_builder (manifests, relative_to));
+
+      walker_walk (walker, path, relative_to, NULL, TRUE);
+    }
+
+  if (opt_files_from)
+    {
+      SignList list = { walker, manifests };
+      if (!opt_read_files_from (sign_list_entry, &list, &error))
+        walker_add_error (walker, g_steal_pointer (&error));
+    }
+
+  gboolean res = walker_finish (walker);
+
+  /* The signatures that were made are written even if others failed,
+   * like the .sig files are */
+  GHashTableIter iter;
+  gpointer builder;
+  g_hash_table_iter_init (&iter, packs.builders);
+  while (g_hash_table_iter_next (&iter, NULL, &builder))
+    {
+      if (!sigpack_builder_write (builder, &error))
+        {
+          g_printerr ("%s\n", error->message);
+          g_clear_error (&error);
+          res = FALSE;
         }
     }
+  g_hash_table_unref (packs.builders);
+  g_mutex_clear (&packs.lock);
+
+  /* Don't write partial manifests */
+  for (guint i = 0; res && i < manifests->len; i++)
+    {
+      if (!write_manifest (g_ptr_array_index (manifests, i)))
+        res = FALSE;
+    }
 
   return res ? EXIT_SUCCESS : EXIT_FAILURE;
 }
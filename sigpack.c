@@ -0,0 +1,351 @@
+/*
+ * Copyright © 2023 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+#include "config.h"
+#include "main.h"
+
+#include <errno.h>
+#include <fcntl.h>
+
+/* A signature pack holds the signatures of the files in one directory,
+ * so they don't each need a NAME.sig next to them, which costs an open
+ * and read per file and makes the directory twice as large. Each
+ * signature is exactly what sign writes to NAME.sig, so a file can
+ * still be re-signed on its own. Like for manifests, lookups are done
+ * directly on the file data. All integers are little-endian:
+ *
+ *   magic      "VALIDSP\001"
+ *   guint32    n_entries
+ *   guint32    reserved (0)
+ *   guint32    offset[n_entries]  (sorted by name)
+ *
+ * followed by the entries the offsets point to:
+ *
+ *   char       name[]             (nul terminated, a name in the directory)
+ *   guint32    signature_len
+ *   guchar     signature[signature_len]
+ */
+
+#define SIGPACK_HEADER_LEN (VALIDATOR_SIGPACK_MAGIC_LEN + 4 + 4)
+
+struct SigPack
+{
+  guchar *data;
+  gsize size;
+  guint32 n_entries;
+};
+
+typedef struct
+{
+  char *name;
+  guchar *signature;
+  gsize signature_len;
+} SigPackEntry;
+
+struct SigPackBuilder
+{
+  char *dir;
+  GMutex lock;
+  GHashTable *entries; /* name -> SigPackEntry */
+};
+
+/* Loads the pack in dir_fd, dir is its path for messages. Returns NULL
+ * without setting error if there is no pack. */
+SigPack *
+sigpack_load_at (int dir_fd, const char *dir, GError **error)
+{
+  g_autofree char *path = g_build_filename (dir, VALIDATOR_SIGPACK_NAME, NULL);
+
+  g_autofree char *contents = NULL;
+  gsize size = 0;
+  g_autoptr (GError) local_error = NULL;
+  if (!load_file_at (dir_fd, VALIDATOR_SIGPACK_NAME, path, &contents, &size, &local_error))
+    {
+      if (g_error_matches (local_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        return NULL;
+
+      g_propagate_prefixed_error (error, g_steal_pointer (&local_error),
+                                  "Failed to load signature pack '%s': ", path);
+      return NULL;
+    }
+
+  const guchar *data = (const guchar *)contents;
+  if (size < SIGPACK_HEADER_LEN
+      || memcmp (data, VALIDATOR_SIGPACK_MAGIC, VALIDATOR_SIGPACK_MAGIC_LEN) != 0)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "Invalid signature pack '%s'", path);
+      return NULL;
+    }
+
+  guint32 n_entries = read_uint32 (data + VALIDATOR_SIGPACK_MAGIC_LEN);
+  if (n_entries > (size - SIGPACK_HEADER_LEN) / 4)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "Invalid signature pack '%s'", path);
+      return NULL;
+    }
+
+  log_debug ("Loaded signature pack '%s' with %u entries", path, n_entries);
+
+  SigPack *pack = g_new0 (SigPack, 1);
+  pack->data = (guchar *)g_steal_pointer (&contents);
+  pack->size = size;
+  pack->n_entries = n_entries;
+
+  return pack;
+}
+
+void
+sigpack_free (SigPack *pack)
+{
+  if (pack == NULL)
+    return;
+
+  g_free (pack->data);
+  g_free (pack);
+}
+
+/* Returns the name of entry i, and the position after it */
+static const char *
+sigpack_get_name (SigPack *pack, guint32 i, gsize *end_out)
+{
+  guint32 offset = read_uint32 (pack->data + SIGPACK_HEADER_LEN + i * 4);
+  if (offset >= pack->size)
+    return NULL;
+
+  const guchar *name = pack->data + offset;
+  const guchar *nul = memchr (name, 0, pack->size - offset);
+  if (nul == NULL)
+    return NULL;
+
+  *end_out = (nul + 1) - pack->data;
+  return (const char *)name;
+}
+
+/* The signature of the entry whose name ends at end */
+static gboolean
+sigpack_get_signature (SigPack *pack, gsize end, const guchar **signature_out,
+                       gsize *signature_len_out)
+{
+  if (end + 4 > pack->size)
+    return FALSE;
+
+  guint32 signature_len = read_uint32 (pack->data + end);
+  if (signature_len > pack->size - end - 4)
+    return FALSE;
+
+  if (signature_out)
+    *signature_out = pack->data + end + 4;
+  if (signature_len_out)
+    *signature_len_out = signature_len;
+  return TRUE;
+}
+
+/* Binary search for name, returns FALSE if not in the pack */
+gboolean
+sigpack_lookup (SigPack *pack, const char *name, const guchar **signature_out,
+                gsize *signature_len_out)
+{
+  guint32 lo = 0;
+  guint32 hi = pack->n_entries;
+
+  while (lo < hi)
+    {
+      guint32 mid = lo + (hi - lo) / 2;
+      gsize end;
+      const char *entry_name = sigpack_get_name (pack, mid, &end);
+      if (entry_name == NULL)
+        return FALSE; /* Corrupt */
+
+      int cmp = strcmp (name, entry_name);
+      if (cmp < 0)
+        hi = mid;
+      else if (cmp > 0)
+        lo = mid + 1;
+      else
+        return sigpack_get_signature (pack, end, signature_out, signature_len_out);
+    }
+
+  return FALSE;
+}
+
+/* Loads the signature of the file name in dir_fd (at path), from the
+ * pack of the directory if it has one for it, otherwise from NAME.sig */
+gboolean
+sigpack_load_signature (SigPack *pack, int dir_fd, const char *name, const char *path,
+                        char **signature_out, gsize *signature_len_out, GError **error)
+{
+  const guchar *signature;
+  gsize signature_len;
+
+  if (pack != NULL && sigpack_lookup (pack, name, &signature, &signature_len))
+    {
+      /* Zero terminated, like a loaded NAME.sig */
+      char *copy = g_malloc (signature_len + 1);
+      memcpy (copy, signature, signature_len);
+      copy[signature_len] = 0;
+
+      *signature_out = copy;
+      *signature_len_out = signature_len;
+      return TRUE;
+    }
+
+  return load_signature_at (dir_fd, name, path, signature_out, signature_len_out, error);
+}
+
+static void
+sigpack_entry_free (SigPackEntry *entry)
+{
+  g_free (entry->name);
+  g_free (entry->signature);
+  g_free (entry);
+}
+
+SigPackBuilder *
+sigpack_builder_new (const char *dir)
+{
+  SigPackBuilder *builder = g_new0 (SigPackBuilder, 1);
+
+  builder->dir = g_strdup (dir);
+  builder->entries
+      = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify)sigpack_entry_free);
+  g_mutex_init (&builder->lock);
+
+  return builder;
+}
+
+void
+sigpack_builder_free (SigPackBuilder *builder)
+{
+  g_hash_table_unref (builder->entries);
+  g_mutex_clear (&builder->lock);
+  g_free (builder->dir);
+  g_free (builder);
+}
+
+/* Adds (or replaces) the signature of name. This may be called from
+ * multiple threads. */
+void
+sigpack_builder_add (SigPackBuilder *builder, const char *name, const guchar *signature,
+                     gsize signature_len)
+{
+  SigPackEntry *entry = g_new0 (SigPackEntry, 1);
+
+  entry->name = g_strdup (name);
+  entry->signature = g_memdup2 (signature, signature_len);
+  entry->signature_len = signature_len;
+
+  g_mutex_lock (&builder->lock);
+  g_hash_table_replace (builder->entries, entry->name, entry);
+  g_mutex_unlock (&builder->lock);
+}
+
+static int
+compare_entries (gconstpointer a, gconstpointer b)
+{
+  const SigPackEntry *entry_a = *(const SigPackEntry **)a;
+  const SigPackEntry *entry_b = *(const SigPackEntry **)b;
+
+  return strcmp (entry_a->name, entry_b->name);
+}
+
+/* Writes the pack of the builder's directory. The signatures in an
+ * existing pack are kept for the files that weren't added, so files
+ * can be re-signed individually. */
+gboolean
+sigpack_builder_write (SigPackBuilder *builder, GError **error)
+{
+  autofd int dir_fd = open (builder->dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd < 0)
+    {
+      int errsv = errno;
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errsv),
+                   "Failed to open dir '%s': %s", builder->dir, strerror (errsv));
+      return FALSE;
+    }
+
+  g_autoptr (GError) local_error = NULL;
+  g_autoptr (SigPack) existing = sigpack_load_at (dir_fd, builder->dir, &local_error);
+  if (local_error)
+    {
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+
+  for (guint32 i = 0; existing != NULL && i < existing->n_entries; i++)
+    {
+      gsize end;
+      const guchar *signature;
+      gsize signature_len;
+      const char *name = sigpack_get_name (existing, i, &end);
+      if (name == NULL || !sigpack_get_signature (existing, end, &signature, &signature_len))
+        break; /* Corrupt, so it is replaced by what was added */
+
+      if (!g_hash_table_contains (builder->entries, name))
+        sigpack_builder_add (builder, name, signature, signature_len);
+    }
+
+  g_autoptr (GPtrArray) entries = g_ptr_array_new ();
+  GHashTableIter iter;
+  gpointer value;
+  g_hash_table_iter_init (&iter, builder->entries);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    g_ptr_array_add (entries, value);
+  g_ptr_array_sort (entries, compare_entries);
+
+  g_autoptr (GString) s = g_string_new (NULL);
+  g_string_append_len (s, VALIDATOR_SIGPACK_MAGIC, VALIDATOR_SIGPACK_MAGIC_LEN);
+  append_uint32 (s, entries->len);
+  append_uint32 (s, 0);
+
+  gsize offset = SIGPACK_HEADER_LEN + entries->len * 4;
+  for (guint i = 0; i < entries->len; i++)
+    {
+      SigPackEntry *entry = g_ptr_array_index (entries, i);
+
+      if (offset > G_MAXUINT32)
+        {
+          g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "Signature pack too large");
+          return FALSE;
+        }
+
+      append_uint32 (s, offset);
+      offset += strlen (entry->name) + 1 + 4 + entry->signature_len;
+    }
+
+  for (guint i = 0; i < entries->len; i++)
+    {
+      SigPackEntry *entry = g_ptr_array_index (entries, i);
+
+      g_string_append_len (s, entry->name, strlen (entry->name) + 1);
+      append_uint32 (s, entry->signature_len);
+      g_string_append_len (s, (const char *)entry->signature, entry->signature_len);
+    }
+
+  g_autofree char *path = g_build_filename (builder->dir, VALIDATOR_SIGPACK_NAME, NULL);
+  if (!g_file_set_contents (path, s->str, s->len, error))
+    {
+      g_prefix_error (error, "Failed to write signature pack '%s': ", path);
+      return FALSE;
+    }
+
+  g_info ("Wrote signature pack '%s' with %u signatures", path, entries->len);
+
+  return TRUE;
+}
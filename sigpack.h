@@ -0,0 +1,44 @@
+/*
+ * Copyright © 2023 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+#include <glib.h>
+
+#define VALIDATOR_SIGPACK_NAME ".validator-sigpack"
+#define VALIDATOR_SIGPACK_MAGIC "VALIDSP\001"
+#define VALIDATOR_SIGPACK_MAGIC_LEN 8
+
+typedef struct SigPack SigPack;
+typedef struct SigPackBuilder SigPackBuilder;
+
+SigPack *sigpack_load_at (int dir_fd, const char *dir, GError **error);
+void sigpack_free (SigPack *pack);
+gboolean sigpack_lookup (SigPack *pack, const char *name, const guchar **signature_out,
+                         gsize *signature_len_out);
+gboolean sigpack_load_signature (SigPack *pack, int dir_fd, const char *name, const char *path,
+                                 char **signature_out, gsize *signature_len_out, GError **error);
+
+SigPackBuilder *sigpack_builder_new (const char *dir);
+void sigpack_builder_free (SigPackBuilder *builder);
+void sigpack_builder_add (SigPackBuilder *builder, const char *name, const guchar *signature,
+                          gsize signature_len);
+gboolean sigpack_builder_write (SigPackBuilder *builder, GError **error);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (SigPack, sigpack_free)
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (SigPackBuilder, sigpack_builder_free)
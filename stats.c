@@ -0,0 +1,182 @@
+/*
+ * Copyright © 2023 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+
+#include "config.h"
+
+#include "stats.h"
+
+struct Stats
+{
+  char *name; /* NULL for the total */
+  guint64 counters[STATS_N_COUNTERS];
+  gint64 phase_time[STATS_N_PHASES]; /* In microseconds */
+};
+
+static const char *counter_names[STATS_N_COUNTERS] = {
+  "files", "bytes_hashed", "bytes_copied", "signatures_verified", "key_attempts", "syscalls",
+  "verify_cache_hits", "files_kept", "bytes_kept",
+};
+
+static const char *phase_names[STATS_N_PHASES] = {
+  "keys", "walk", "hash", "verify", "install",
+};
+
+gboolean stats_enabled;
+static gboolean stats_json;
+static gint64 stats_start_time;
+static Stats stats_total;
+static GPtrArray *stats_list; /* Stats, in creation order */
+static GPrivate stats_current;
+
+void
+stats_enable (gboolean json)
+{
+  stats_enabled = TRUE;
+  stats_json = json;
+  stats_start_time = g_get_monotonic_time ();
+}
+
+/* Creates a (named) part of the total, which is reported separately */
+Stats *
+stats_new (const char *name)
+{
+  Stats *stats = g_new0 (Stats, 1);
+  stats->name = g_strdup (name);
+
+  if (stats_list == NULL)
+    stats_list = g_ptr_array_new ();
+  g_ptr_array_add (stats_list, stats);
+
+  return stats;
+}
+
+Stats *
+stats_get_current (void)
+{
+  return g_private_get (&stats_current);
+}
+
+/* Sets what the calling thread accumulates into, in addition to the total */
+void
+stats_set_current (Stats *stats)
+{
+  g_private_set (&stats_current, stats);
+}
+
+static void
+add_to (guint64 *counter, guint64 value)
+{
+  __atomic_fetch_add (counter, value, __ATOMIC_RELAXED);
+}
+
+void
+stats_add (StatsCounter counter, guint64 value)
+{
+  Stats *current = stats_get_current ();
+
+  add_to (&stats_total.counters[counter], value);
+  if (current)
+    add_to (&current->counters[counter], value);
+}
+
+void
+stats_add_time (StatsPhase phase, gint64 start)
+{
+  Stats *current = stats_get_current ();
+  guint64 elapsed = g_get_monotonic_time () - start;
+
+  add_to ((guint64 *)&stats_total.phase_time[phase], elapsed);
+  if (current)
+    add_to ((guint64 *)&current->phase_time[phase], elapsed);
+}
+
+static void
+print_stats_text (Stats *stats)
+{
+  guint64 verified = stats->counters[STATS_SIGNATURES_VERIFIED];
+
+  g_printerr ("Statistics for %s:\n", stats->name ? stats->name : "all");
+  for (int i = 0; i < STATS_N_COUNTERS; i++)
+    g_printerr ("  %-24s %" G_GUINT64_FORMAT "\n", counter_names[i], stats->counters[i]);
+  g_printerr ("  %-24s %.2f\n", "key_attempts_per_verify",
+              verified ? (double)stats->counters[STATS_KEY_ATTEMPTS] / verified : 0.0);
+  for (int i = 0; i < STATS_N_PHASES; i++)
+    g_printerr ("  %-24s %.3f ms\n", phase_names[i], stats->phase_time[i] / 1000.0);
+}
+
+static void
+print_stats_json (GString *s, Stats *stats)
+{
+  guint64 verified = stats->counters[STATS_SIGNATURES_VERIFIED];
+
+  g_string_append (s, "{");
+  if (stats->name)
+    {
+      g_autofree char *escaped = g_strescape (stats->name, NULL);
+      g_string_append_printf (s, "\"name\": \"%s\", ", escaped);
+    }
+  for (int i = 0; i < STATS_N_COUNTERS; i++)
+    g_string_append_printf (s, "\"%s\": %" G_GUINT64_FORMAT ", ", counter_names[i],
+                            stats->counters[i]);
+  g_string_append_printf (s, "\"key_attempts_per_verify\": %.2f, ",
+                          verified ? (double)stats->counters[STATS_KEY_ATTEMPTS] / verified : 0.0);
+  g_string_append (s, "\"time_usec\": {");
+  for (int i = 0; i < STATS_N_PHASES; i++)
+    g_string_append_printf (s, "%s\"%s\": %" G_GINT64_FORMAT, i > 0 ? ", " : "", phase_names[i],
+                            stats->phase_time[i]);
+  g_string_append (s, "}}");
+}
+
+/* Print the total, and each part (e.g. config file) that was created,
+ * to stderr, as stdout may be used for output */
+void
+stats_print (void)
+{
+  gint64 wall_time = g_get_monotonic_time () - stats_start_time;
+  guint n_parts = stats_list ? stats_list->len : 0;
+
+  if (!stats_enabled)
+    return;
+
+  if (stats_json)
+    {
+      g_autoptr (GString) s = g_string_new ("{\"wall_time_usec\": ");
+
+      g_string_append_printf (s, "%" G_GINT64_FORMAT ", \"total\": ", wall_time);
+      print_stats_json (s, &stats_total);
+      g_string_append (s, ", \"parts\": [");
+      for (guint i = 0; i < n_parts; i++)
+        {
+          if (i > 0)
+            g_string_append (s, ", ");
+          print_stats_json (s, g_ptr_array_index (stats_list, i));
+        }
+      g_string_append (s, "]}");
+
+      g_printerr ("%s\n", s->str);
+      return;
+    }
+
+  for (guint i = 0; i < n_parts; i++)
+    print_stats_text (g_ptr_array_index (stats_list, i));
+  print_stats_text (&stats_total);
+  g_printerr ("  %-24s %.3f ms\n", "wall_time", wall_time / 1000.0);
+}
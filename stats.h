@@ -0,0 +1,85 @@
+/*
+ * Copyright © 2023 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+
+#include <glib.h>
+
+/* Statistics for --stats. Counters and phase times are accumulated in
+ * the current Stats of the thread (and in the total), and are only
+ * updated if stats are enabled. Phase times are summed over all
+ * threads, so with several jobs they can add up to more than the wall
+ * clock time. */
+
+typedef enum
+{
+  STATS_FILES,
+  STATS_BYTES_HASHED,
+  STATS_BYTES_COPIED,
+  STATS_SIGNATURES_VERIFIED,
+  STATS_KEY_ATTEMPTS,
+  STATS_SYSCALLS, /* File syscalls (open, stat, read, write, rename...) in the hot paths */
+  STATS_VERIFY_CACHE_HITS,
+  STATS_FILES_KEPT, /* Existing destinations kept without reading the source (not --force) */
+  STATS_BYTES_KEPT, /* Source bytes of those, that weren't hashed */
+  STATS_N_COUNTERS
+} StatsCounter;
+
+typedef enum
+{
+  STATS_PHASE_KEYS,    /* Loading public keys */
+  STATS_PHASE_WALK,    /* Enumerating directories */
+  STATS_PHASE_HASH,    /* Reading and hashing content (and copying it while hashing) */
+  STATS_PHASE_VERIFY,  /* Signature verification */
+  STATS_PHASE_INSTALL, /* Creating destination dirs and files, renaming into place */
+  STATS_N_PHASES
+} StatsPhase;
+
+typedef struct Stats Stats;
+
+extern gboolean stats_enabled;
+
+void stats_enable (gboolean json);
+Stats *stats_new (const char *name);
+Stats *stats_get_current (void);
+void stats_set_current (Stats *stats);
+void stats_add (StatsCounter counter, guint64 value);
+void stats_add_time (StatsPhase phase, gint64 start);
+void stats_print (void);
+
+static inline void
+stats_count (StatsCounter counter, guint64 value)
+{
+  if (G_UNLIKELY (stats_enabled))
+    stats_add (counter, value);
+}
+
+/* Use as: gint64 start = stats_begin (); ...; stats_end (PHASE, start); */
+static inline gint64
+stats_begin (void)
+{
+  return G_UNLIKELY (stats_enabled) ? g_get_monotonic_time () : 0;
+}
+
+static inline void
+stats_end (StatsPhase phase, gint64 start)
+{
+  if (G_UNLIKELY (stats_enabled))
+    stats_add_time (phase, start);
+}
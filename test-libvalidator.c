@@ -0,0 +1,280 @@
+/*
+ * Copyright © 2023 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+/* Tests of the public libvalidator API, against the signatures in
+ * test-assets (made for the content that test.sh generates). */
+
+#include "config.h"
+
+#include "libvalidator.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct
+{
+  char *dir;
+  int dir_fd;
+  ValidatorKeyring *keyring;
+  ValidatorVerifier *verifier;
+} Fixture;
+
+static char *
+load_asset (const char *name, gsize *len_out)
+{
+  g_autofree char *path = g_test_build_filename (G_TEST_DIST, "test-assets", name, NULL);
+  g_autoptr (GError) error = NULL;
+  char *contents = NULL;
+
+  g_file_get_contents (path, &contents, len_out, &error);
+  g_assert_no_error (error);
+
+  return contents;
+}
+
+static void
+write_file (Fixture *fixture, const char *name, const char *contents, gsize len)
+{
+  g_autofree char *path = g_build_filename (fixture->dir, name, NULL);
+  g_autoptr (GError) error = NULL;
+
+  g_file_set_contents (path, contents, len, &error);
+  g_assert_no_error (error);
+}
+
+/* Writes name with its content from test.sh, and the signature of it
+ * from test-assets */
+static void
+write_signed_file (Fixture *fixture, const char *name, const char *contents)
+{
+  g_autofree char *sig_name = g_strconcat (name, ".sig", NULL);
+  g_autofree char *asset_name = g_build_filename ("content", sig_name, NULL);
+  gsize sig_len;
+  g_autofree char *sig = load_asset (asset_name, &sig_len);
+
+  write_file (fixture, name, contents, strlen (contents));
+  write_file (fixture, sig_name, sig, sig_len);
+}
+
+static int
+open_file (Fixture *fixture, const char *name)
+{
+  int fd = openat (fixture->dir_fd, name, O_RDONLY | O_CLOEXEC);
+  g_assert_cmpint (fd, >=, 0);
+  return fd;
+}
+
+static void
+fixture_setup (Fixture *fixture, gconstpointer user_data)
+{
+  g_autoptr (GError) error = NULL;
+
+  fixture->dir = g_dir_make_tmp ("test-libvalidator-XXXXXX", &error);
+  g_assert_no_error (error);
+  fixture->dir_fd = open (fixture->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  g_assert_cmpint (fixture->dir_fd, >=, 0);
+
+  g_autofree char *pubkey = g_test_build_filename (G_TEST_DIST, "test-assets", "public.der", NULL);
+  fixture->keyring = validator_keyring_new ();
+  validator_keyring_load (fixture->keyring, pubkey, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (validator_keyring_get_n_keys (fixture->keyring), ==, 1);
+
+  fixture->verifier = validator_verifier_new (fixture->keyring);
+}
+
+static void
+fixture_teardown (Fixture *fixture, gconstpointer user_data)
+{
+  static const char *names[] = { "file1.txt", "file1.txt.sig", "file2.txt", "file2.txt.sig" };
+
+  for (gsize i = 0; i < G_N_ELEMENTS (names); i++)
+    {
+      if (unlinkat (fixture->dir_fd, names[i], 0) < 0)
+        g_assert_cmpint (errno, ==, ENOENT);
+    }
+
+  close (fixture->dir_fd);
+  g_assert_cmpint (rmdir (fixture->dir), ==, 0);
+  g_free (fixture->dir);
+  validator_verifier_free (fixture->verifier);
+  validator_keyring_unref (fixture->keyring);
+}
+
+static void
+test_verify_at (Fixture *fixture, gconstpointer user_data)
+{
+  g_autoptr (GError) error = NULL;
+
+  write_signed_file (fixture, "file1.txt", "FILEDATA1\n");
+  g_assert_true (validator_verifier_verify_at (fixture->verifier, fixture->dir_fd, "file1.txt",
+                                               "file1.txt", &error));
+  g_assert_no_error (error);
+
+  /* Signed for another path */
+  g_assert_false (validator_verifier_verify_at (fixture->verifier, fixture->dir_fd, "file1.txt",
+                                                "file2.txt", &error));
+  g_assert_error (error, VALIDATOR_ERROR, VALIDATOR_ERROR_INVALID_SIGNATURE);
+  g_clear_error (&error);
+
+  /* Changed content */
+  write_file (fixture, "file1.txt", "wrong\n", 6);
+  g_assert_false (validator_verifier_verify_at (fixture->verifier, fixture->dir_fd, "file1.txt",
+                                                "file1.txt", &error));
+  g_assert_error (error, VALIDATOR_ERROR, VALIDATOR_ERROR_INVALID_SIGNATURE);
+  g_clear_error (&error);
+
+  write_file (fixture, "file2.txt", "FILEDATA2\n", 10);
+  g_assert_false (validator_verifier_verify_at (fixture->verifier, fixture->dir_fd, "file2.txt",
+                                                "file2.txt", &error));
+  g_assert_error (error, VALIDATOR_ERROR, VALIDATOR_ERROR_NOT_SIGNED);
+  g_clear_error (&error);
+
+  /* A malformed signature is invalid, not an I/O error */
+  write_file (fixture, "file2.txt.sig", "garbage", 7);
+  g_assert_false (validator_verifier_verify_at (fixture->verifier, fixture->dir_fd, "file2.txt",
+                                                "file2.txt", &error));
+  g_assert_error (error, VALIDATOR_ERROR, VALIDATOR_ERROR_INVALID_SIGNATURE);
+  g_clear_error (&error);
+
+  write_file (fixture, "file2.txt.sig", "", 0);
+  g_assert_false (validator_verifier_verify_at (fixture->verifier, fixture->dir_fd, "file2.txt",
+                                                "file2.txt", &error));
+  g_assert_error (error, VALIDATOR_ERROR, VALIDATOR_ERROR_INVALID_SIGNATURE);
+}
+
+static void
+test_verify_fd (Fixture *fixture, gconstpointer user_data)
+{
+  g_autoptr (GError) error = NULL;
+  gsize sig_len;
+  g_autofree guint8 *sig = (guint8 *)load_asset ("content/file1.txt.sig", &sig_len);
+
+  write_file (fixture, "file1.txt", "FILEDATA1\n", 10);
+  int fd = open_file (fixture, "file1.txt");
+
+  /* Twice, as the fd is read from the start each time */
+  for (int i = 0; i < 2; i++)
+    {
+      g_assert_true (
+          validator_verifier_verify_fd (fixture->verifier, fd, "file1.txt", sig, sig_len, &error));
+      g_assert_no_error (error);
+    }
+
+  g_assert_false (
+      validator_verifier_verify_fd (fixture->verifier, fd, "file2.txt", sig, sig_len, &error));
+  g_assert_error (error, VALIDATOR_ERROR, VALIDATOR_ERROR_INVALID_SIGNATURE);
+  g_clear_error (&error);
+
+  g_assert_false (validator_verifier_verify_fd (fixture->verifier, fd, "file1.txt", sig,
+                                                sig_len / 2, &error));
+  g_assert_error (error, VALIDATOR_ERROR, VALIDATOR_ERROR_INVALID_SIGNATURE);
+  g_clear_error (&error);
+
+  /* The path prefix is prepended to the path that was signed */
+  validator_verifier_set_path_prefix (fixture->verifier, "prefix");
+  g_assert_false (
+      validator_verifier_verify_fd (fixture->verifier, fd, "file1.txt", sig, sig_len, &error));
+  g_assert_error (error, VALIDATOR_ERROR, VALIDATOR_ERROR_INVALID_SIGNATURE);
+
+  close (fd);
+}
+
+static void
+test_verify_symlink (Fixture *fixture, gconstpointer user_data)
+{
+  g_autoptr (GError) error = NULL;
+  gsize sig_len;
+  g_autofree guint8 *sig = (guint8 *)load_asset ("content/symlink1.sig", &sig_len);
+
+  g_assert_true (validator_verifier_verify_symlink (fixture->verifier, "file1.txt", "symlink1",
+                                                    sig, sig_len, &error));
+  g_assert_no_error (error);
+
+  g_assert_false (validator_verifier_verify_symlink (fixture->verifier, "file2.txt", "symlink1",
+                                                     sig, sig_len, &error));
+  g_assert_error (error, VALIDATOR_ERROR, VALIDATOR_ERROR_INVALID_SIGNATURE);
+  g_clear_error (&error);
+
+  /* A regular file signature doesn't match a symlink with its content */
+  g_autofree guint8 *file_sig = (guint8 *)load_asset ("content/file1.txt.sig", &sig_len);
+  g_assert_false (validator_verifier_verify_symlink (fixture->verifier, "FILEDATA1\n",
+                                                     "file1.txt", file_sig, sig_len, &error));
+  g_assert_error (error, VALIDATOR_ERROR, VALIDATOR_ERROR_INVALID_SIGNATURE);
+}
+
+static void
+test_sign_fd (Fixture *fixture, gconstpointer user_data)
+{
+  static const ValidatorDigestType digest_types[]
+      = { VALIDATOR_DIGEST_SHA512, VALIDATOR_DIGEST_CHUNKED };
+  g_autoptr (GError) error = NULL;
+  g_autofree char *seckey = g_test_build_filename (G_TEST_DIST, "test-assets", "secret.pem", NULL);
+  g_autoptr (ValidatorSigningKey) key = validator_signing_key_load (seckey, &error);
+  g_assert_no_error (error);
+
+  write_file (fixture, "file2.txt", "FILEDATA2\n", 10);
+  int fd = open_file (fixture, "file2.txt");
+
+  for (gsize i = 0; i < G_N_ELEMENTS (digest_types); i++)
+    {
+      gsize sig_len;
+      g_autofree guint8 *sig
+          = validator_sign_fd (key, fd, "dir/file2.txt", digest_types[i], &sig_len, &error);
+      g_assert_no_error (error);
+      g_assert_nonnull (sig);
+
+      g_assert_true (validator_verifier_verify_fd (fixture->verifier, fd, "dir/file2.txt", sig,
+                                                   sig_len, &error));
+      g_assert_no_error (error);
+
+      g_assert_false (
+          validator_verifier_verify_fd (fixture->verifier, fd, "file2.txt", sig, sig_len, &error));
+      g_assert_error (error, VALIDATOR_ERROR, VALIDATOR_ERROR_INVALID_SIGNATURE);
+      g_clear_error (&error);
+
+      /* Same as the signature the validator binary writes */
+      write_file (fixture, "file2.txt.sig", (char *)sig, sig_len);
+      g_assert_true (validator_verifier_verify_at (fixture->verifier, fixture->dir_fd, "file2.txt",
+                                                   "dir/file2.txt", &error));
+      g_assert_no_error (error);
+    }
+
+  close (fd);
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add ("/libvalidator/verify-at", Fixture, NULL, fixture_setup, test_verify_at,
+              fixture_teardown);
+  g_test_add ("/libvalidator/verify-fd", Fixture, NULL, fixture_setup, test_verify_fd,
+              fixture_teardown);
+  g_test_add ("/libvalidator/verify-symlink", Fixture, NULL, fixture_setup, test_verify_symlink,
+              fixture_teardown);
+  g_test_add ("/libvalidator/sign-fd", Fixture, NULL, fixture_setup, test_sign_fd,
+              fixture_teardown);
+
+  return g_test_run ();
+}
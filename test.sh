@@ -52,6 +52,12 @@ assert_file_has_content () {
     done
 }
 
+le_bytes () {
+    for (( i = 0; i < $2; i++ )); do
+        printf "\\x$(printf %02x $(( ($1 >> (8 * i)) & 255 )))"
+    done
+}
+
 TMPDIR=$(mktemp -d /tmp/validator-test.XXXXXX)
 trap 'rm -rf -- "$TMPDIR"' EXIT
 
@@ -144,22 +150,251 @@ fi
 assert_file_has_content $OUT "Signature of .*symlink1.* is invalid"
 assert_file_has_content $OUT "Signature of .*file3.txt.* is invalid"
 
+HEADER Parallel errors are reported in the same order
+if $VALIDATOR validate -r -j1 --key=$PUBKEY $CONTENT 2> $OUT; then
+   fatal "Should not have validated"
+fi
+for jobs in 2 8; do
+    if $VALIDATOR validate -r -j$jobs --key=$PUBKEY $CONTENT 2> $OUT.j$jobs; then
+       fatal "Should not have validated"
+    fi
+    cmp $OUT $OUT.j$jobs
+done
+if $VALIDATOR validate -r --jobs=1 --key=$PUBKEY $CONTENT 2> $OUT; then
+   fatal "Should not have validated"
+fi
+for jobs in 1 4; do
+    if $VALIDATOR validate -r --jobs=$jobs --readahead=3 --key=$PUBKEY $CONTENT 2> $OUT.r$jobs; then
+       fatal "Should not have validated"
+    fi
+    cmp $OUT $OUT.r$jobs
+done
+
 HEADER Re-Sign all forced
 $VALIDATOR sign -f -r --key=$SECKEY $CONTENT
 $VALIDATOR validate -r --key=$PUBKEY $CONTENT
 
 HEADER Externally signed blob gives same result
-echo -n  $'VALIDTR\001' > $TMPDIR/sig_header
+# The key id is the start of the sha256 of the DER encoded public key
+echo -n  $'VALIDTR\002' > $TMPDIR/sig_header
+openssl pkey -in $SECKEY -pubout -outform DER | openssl dgst -sha256 -binary | head -c 8 >> $TMPDIR/sig_header
+echo -n  $'VALIDTR\001' > $TMPDIR/sig_header_v1
 for i in file1.txt file2.txt symlink1 dir/file3.txt dir/symlink2  ; do
     $VALIDATOR blob --relative-to=$CONTENT $CONTENT/$i > $TMPDIR/blob
     openssl pkeyutl -sign -inkey $SECKEY -rawin -in $TMPDIR/blob -out $TMPDIR/blob.rawsig
     cat $TMPDIR/sig_header $TMPDIR/blob.rawsig > $TMPDIR/blob.sig
     cmp $CONTENT/$i.sig $TMPDIR/blob.sig
+    # Old style signatures without key id work too
+    cat $TMPDIR/sig_header_v1 $TMPDIR/blob.rawsig > $CONTENT/$i.sig
 done
+$VALIDATOR validate -r --key=$PUBKEY $CONTENT
+
+HEADER Blob stream and signature import
+$VALIDATOR sign -f -r --key=$SECKEY $CONTENT
+cp $CONTENT/dir/file3.txt.sig $TMPDIR/expected.sig
+$VALIDATOR blob --stream -r $CONTENT > $TMPDIR/stream
+# Sign each blob like an external signer would, into a stream of raw signatures
+rm -f $TMPDIR/sigstream
+size=$(stat -c %s $TMPDIR/stream)
+off=0
+n=0
+while (( off < size )); do
+    len=$(od -An -tu4 -N4 -j $off $TMPDIR/stream)
+    path=$(tail -c +$(( off + 5 )) $TMPDIR/stream | head -c $len)
+    off=$(( off + 4 + len ))
+    len=$(od -An -tu4 -N4 -j $off $TMPDIR/stream)
+    tail -c +$(( off + 5 )) $TMPDIR/stream | head -c $len > $TMPDIR/blob
+    off=$(( off + 4 + len ))
+    openssl pkeyutl -sign -inkey $SECKEY -rawin -in $TMPDIR/blob -out $TMPDIR/blob.rawsig
+    { le_bytes ${#path} 4; echo -n "$path"; le_bytes 64 4; cat $TMPDIR/blob.rawsig; } >> $TMPDIR/sigstream
+    n=$(( n + 1 ))
+done
+test $n = 5 || fatal "Expected 5 blobs, got $n"
+find $CONTENT -name "*.sig" -delete
+$VALIDATOR import-signatures --key=$PUBKEY $CONTENT < $TMPDIR/sigstream
+cmp $TMPDIR/expected.sig $CONTENT/dir/file3.txt.sig
+$VALIDATOR validate -r --key=$PUBKEY $CONTENT
+
+if { le_bytes 8 4; echo -n ../file1; le_bytes 64 4; head -c 64 /dev/zero; } | \
+        $VALIDATOR import-signatures --key=$PUBKEY $CONTENT/dir 2> $OUT; then
+    fatal "Paths outside the dir should not be imported"
+fi
+assert_file_has_content $OUT "Invalid path"
+
+# Signatures are not written through symlinked dirs
+ln -s $CONTENT/dir $CONTENT/linkdir
+if { le_bytes 17 4; echo -n linkdir/file3.txt; le_bytes 64 4; head -c 64 /dev/zero; } | \
+        $VALIDATOR import-signatures --key=$PUBKEY $CONTENT 2> $OUT; then
+    fatal "Paths through symlinks should not be imported"
+fi
+assert_file_has_content $OUT "Can't open dir"
+rm $CONTENT/linkdir
+
+# Signatures that don't match the file are not written
+rm $CONTENT/dir/file3.txt.sig
+if $VALIDATOR import-signatures --chunked --key=$PUBKEY $CONTENT < $TMPDIR/sigstream 2> $OUT; then
+    fatal "Signatures with the wrong digest type should not be imported"
+fi
+assert_file_has_content $OUT "Signature in stream for .*file3.txt.* is invalid"
+assert_not_has_file $CONTENT/dir/file3.txt.sig
+$VALIDATOR import-signatures --key=$PUBKEY $CONTENT < $TMPDIR/sigstream
+$VALIDATOR validate -r --key=$PUBKEY $CONTENT
+
+HEADER Sign with fs-verity digests
+FSVCONTENT=$TMPDIR/fsvcontent
+gencontent $FSVCONTENT
+head -c 100000 /dev/urandom > $FSVCONTENT/dir/large
+$VALIDATOR sign -r --fsverity --key=$SECKEY $FSVCONTENT
+$VALIDATOR validate -r --key=$PUBKEY $FSVCONTENT
+# The header says these are fs-verity signatures
+echo -n  $'VALIDTR\003' > $TMPDIR/sig_header_fsverity
+tail -c 8 $TMPDIR/sig_header >> $TMPDIR/sig_header_fsverity
+for i in file1.txt symlink1 dir/large; do
+    $VALIDATOR blob --fsverity --relative-to=$FSVCONTENT $FSVCONTENT/$i > $TMPDIR/blob
+    openssl pkeyutl -sign -inkey $SECKEY -rawin -in $TMPDIR/blob -out $TMPDIR/blob.rawsig
+    cat $TMPDIR/sig_header_fsverity $TMPDIR/blob.rawsig > $TMPDIR/blob.sig
+    cmp $FSVCONTENT/$i.sig $TMPDIR/blob.sig
+done
+
+rm -rf $COPY
+mkdir -p $COPY
+$VALIDATOR install -r --key=$PUBKEY $FSVCONTENT $COPY
+cmp $FSVCONTENT/dir/large $COPY/dir/large
+
+echo -n x >> $FSVCONTENT/dir/large
+if $VALIDATOR validate -r --key=$PUBKEY $FSVCONTENT 2> $OUT; then
+   fatal "Should not have validated"
+fi
+assert_file_has_content $OUT "Signature of .*large.* is invalid"
+rm -rf $COPY
+
+HEADER Sign with chunked digests
+CHUNKCONTENT=$TMPDIR/chunkcontent
+gencontent $CHUNKCONTENT
+# Large enough to be hashed by several threads, with a partial last chunk
+head -c $(( 9 * 1024 * 1024 + 5 )) /dev/urandom > $CHUNKCONTENT/dir/large
+$VALIDATOR sign -r --chunked --key=$SECKEY $CHUNKCONTENT
+$VALIDATOR validate -r --key=$PUBKEY $CHUNKCONTENT
+
+# The digest is the sha512 of the size, chunk size and the sha512 of each chunk
+rm -rf $TMPDIR/chunks && mkdir $TMPDIR/chunks
+split -b 1M -d -a 3 $CHUNKCONTENT/dir/large $TMPDIR/chunks/
+{
+    le_bytes $(stat -c %s $CHUNKCONTENT/dir/large) 8
+    le_bytes $(( 1024 * 1024 )) 4
+    for chunk in $TMPDIR/chunks/*; do
+        openssl dgst -sha512 -binary $chunk
+    done
+} | openssl dgst -sha512 -binary > $TMPDIR/chunked_digest
+{ printf '\x03dir/large\0'; cat $TMPDIR/chunked_digest; } > $TMPDIR/expected_blob
+$VALIDATOR blob --chunked --relative-to=$CHUNKCONTENT $CHUNKCONTENT/dir/large > $TMPDIR/blob
+cmp $TMPDIR/expected_blob $TMPDIR/blob
+
+echo -n  $'VALIDTR\004' > $TMPDIR/sig_header_chunked
+tail -c 8 $TMPDIR/sig_header >> $TMPDIR/sig_header_chunked
+openssl pkeyutl -sign -inkey $SECKEY -rawin -in $TMPDIR/blob -out $TMPDIR/blob.rawsig
+cat $TMPDIR/sig_header_chunked $TMPDIR/blob.rawsig > $TMPDIR/blob.sig
+cmp $CHUNKCONTENT/dir/large.sig $TMPDIR/blob.sig
+
+rm -rf $COPY
+mkdir -p $COPY
+$VALIDATOR install -r --key=$PUBKEY $CHUNKCONTENT $COPY
+cmp $CHUNKCONTENT/dir/large $COPY/dir/large
+
+printf x | dd of=$CHUNKCONTENT/dir/large bs=1 seek=$(( 5 * 1024 * 1024 )) conv=notrunc status=none
+if $VALIDATOR validate -r --key=$PUBKEY $CHUNKCONTENT 2> $OUT; then
+   fatal "Should not have validated"
+fi
+assert_file_has_content $OUT "Signature of .*large.* is invalid"
+rm -rf $COPY $CHUNKCONTENT
+
+HEADER Validate with key dir
+mkdir -p $TMPDIR/keydir
+for i in 1 2 3; do
+    openssl genpkey -algorithm ed25519 -outform PEM -out $TMPDIR/other.pem
+    openssl pkey -in $TMPDIR/other.pem -pubout -out $TMPDIR/keydir/other$i.pem
+done
+if $VALIDATOR validate -r --key-dir=$TMPDIR/keydir $CONTENT 2> $OUT; then
+   fatal "Should not have validated"
+fi
+assert_file_has_content $OUT "Signature of .*file1.txt.* is invalid"
+cp $PUBKEY $TMPDIR/keydir/
+$VALIDATOR validate -r --key-dir=$TMPDIR/keydir $CONTENT
+$VALIDATOR sign -f -r --key=$SECKEY $CONTENT
+$VALIDATOR validate -r --key-dir=$TMPDIR/keydir $CONTENT
+
+HEADER DER encoded keys
+openssl pkey -in $SECKEY -pubout -outform DER -out $TMPDIR/public-real.der
+$VALIDATOR validate -r --key=$TMPDIR/public-real.der $CONTENT
+
+HEADER Compiled keyring
+$VALIDATOR keyring build --key-dir=$TMPDIR/keydir $TMPDIR/keys.keyring
+$VALIDATOR validate -r --key=$TMPDIR/keys.keyring $CONTENT
+# Keyrings in key dirs are loaded too
+mkdir -p $TMPDIR/keyringdir
+cp $TMPDIR/keys.keyring $TMPDIR/keyringdir/
+$VALIDATOR validate -r --key-dir=$TMPDIR/keyringdir $CONTENT
+
+$VALIDATOR keyring build --key=$TMPDIR/keydir/other1.pem $TMPDIR/other.keyring
+if $VALIDATOR validate -r --key=$TMPDIR/other.keyring $CONTENT 2> $OUT; then
+   fatal "Should not have validated"
+fi
+assert_file_has_content $OUT "Signature of .*file1.txt.* is invalid"
+
+head -c 30 $TMPDIR/keys.keyring > $TMPDIR/broken.keyring
+if $VALIDATOR validate -r --key=$TMPDIR/broken.keyring $CONTENT 2> $OUT; then
+   fatal "Should not have validated"
+fi
+assert_file_has_content $OUT "Keyring .* has invalid size"
 
 # Reset content
 gencontent $CONTENT
 
+HEADER Sign, validate and install a list of files
+printf '%s\0' $CONTENT/file1.txt $CONTENT/dir/symlink2 | \
+    $VALIDATOR sign --key=$SECKEY --relative-to=$CONTENT --files-from=- -0
+assert_has_file $CONTENT/file1.txt.sig
+assert_has_file $CONTENT/dir/symlink2.sig
+assert_not_has_file $CONTENT/file2.txt.sig
+assert_not_has_file $CONTENT/dir/file3.txt.sig
+
+printf '%s\n' $CONTENT/file1.txt $CONTENT/dir/symlink2 > $TMPDIR/list
+$VALIDATOR validate --key=$PUBKEY --relative-to=$CONTENT --files-from=$TMPDIR/list
+rm -rf $COPY
+$VALIDATOR install --key=$PUBKEY --relative-to=$CONTENT --files-from=$TMPDIR/list $COPY
+cmp $CONTENT/file1.txt $COPY/file1.txt
+test "$(readlink $COPY/dir/symlink2)" = file3.txt || fatal "Symlink not installed"
+assert_not_has_file $COPY/file2.txt
+
+if echo $CONTENT/file2.txt | $VALIDATOR validate --key=$PUBKEY --files-from=- 2> $OUT; then
+    fatal "Should not have validated"
+fi
+assert_file_has_content $OUT "No signature for .*file2.txt"
+
+if echo $CONTENT/dir | $VALIDATOR sign --key=$SECKEY --files-from=- 2> $OUT; then
+    fatal "Directories in a file list should fail"
+fi
+assert_file_has_content $OUT "is not a regular file or symlink"
+rm -rf $COPY $TMPDIR/list
+gencontent $CONTENT
+
+HEADER Deep trees
+DEEP=$TMPDIR/deep
+d=$DEEP
+for (( i = 0; i < 200; i++ )); do
+    d=$d/d
+done
+mkdir -p $d
+echo DEEPDATA > $d/file.txt
+ln -s file.txt $d/link
+$VALIDATOR sign -r --key=$SECKEY $DEEP
+$VALIDATOR validate -r --key=$PUBKEY $DEEP
+rm -rf $COPY
+$VALIDATOR install -r --key=$PUBKEY $DEEP $COPY
+cmp $d/file.txt $COPY/${d#$DEEP/}/file.txt
+test "$(readlink $COPY/${d#$DEEP/}/link)" = file.txt || fatal "Symlink not installed"
+rm -rf $COPY $DEEP
+
 HEADER Install unsigned should fail
 mkdir -p $COPY
 
@@ -192,6 +427,27 @@ assert_has_file $COPY/dir/symlink2
 # Dir with no validated file in should not be created
 assert_not_has_dir $COPY/unused
 
+# Invalid files going to a new destination write nothing outside it
+mkdir -p $TMPDIR/parent
+echo wrong > $CONTENT/dir/file3.txt
+if $VALIDATOR install -r --key=$PUBKEY $CONTENT/dir $TMPDIR/parent/new/dest 2> $OUT; then
+    fatal "Should fail"
+fi
+test -z "$(ls -A $TMPDIR/parent/new/dest)" || fatal "Invalid file left in destination"
+test "$(ls -A $TMPDIR/parent)" = new || fatal "Wrote outside the destination"
+test "$(ls -A $TMPDIR/parent/new)" = dest || fatal "Wrote outside the destination"
+echo FILEDATA3 > $CONTENT/dir/file3.txt
+rm -rf $TMPDIR/parent
+
+HEADER Existing destinations are kept without reading the sources
+# Everything is installed already, and a broken signature isn't noticed
+cp $CONTENT/file1.txt.sig $TMPDIR/file1.txt.sig
+echo broken > $CONTENT/file1.txt.sig
+$VALIDATOR --stats --verbose install -r --key=$PUBKEY $CONTENT $COPY 2> $OUT
+assert_file_has_content $OUT "Installed 0 files into .*, 5 were already up to date"
+assert_file_has_content $OUT "files_kept  *5" "bytes_hashed  *0" "signatures_verified  *0"
+mv $TMPDIR/file1.txt.sig $CONTENT/file1.txt.sig
+
 HEADER "Install signed should succeed (config)"
 
 rm -rf $COPY
@@ -238,6 +494,244 @@ assert_has_file $COPY/dir/symlink2
 # Dir with no validated file in should not be created
 assert_not_has_dir $COPY/unused
 
+HEADER Boot mode
+rm -rf $COPY
+mkdir -p $COPY
+
+# The OpenSSL config isn't loaded, so one that fails (with OpenSSL 3)
+# doesn't matter
+cat > $TMPDIR/broken-openssl.cnf <<EOF
+openssl_conf = init
+config_diagnostics = 1
+[init]
+providers = providers
+[providers]
+missing = missing
+[missing]
+activate = 1
+EOF
+OPENSSL_CONF=$TMPDIR/broken-openssl.cnf $VALIDATOR install --boot --config-dir=$CONFIGDIR
+
+assert_has_file $COPY/file1.txt
+cmp $CONTENT/file1.txt $COPY/file1.txt
+assert_has_file $COPY/dir/symlink2
+assert_not_has_dir $COPY/unused
+
+HEADER Incremental install
+rm -rf $COPY
+mkdir -p $COPY
+
+$VALIDATOR install -r -f --incremental --key=$PUBKEY $CONTENT $COPY
+INODE1=$(stat -c %i $COPY/file1.txt)
+INODE2=$(stat -c %i $COPY/file2.txt)
+echo FILEDATAX > $COPY/dir/file3.txt # Same size, different content
+rm $COPY/symlink1
+ln -s wrong $COPY/symlink1
+
+$VALIDATOR --verbose install -r -f --incremental --key=$PUBKEY $CONTENT $COPY 2> $OUT
+assert_file_has_content $OUT "File .*/file1.txt' is unchanged" "File .*/dir/symlink2' is unchanged"
+assert_file_has_content $OUT "Installed file .*/dir/file3.txt" "Installed file .*/symlink1"
+assert_file_has_content $OUT "Installed 2 files into .*, 3 were already up to date"
+test $INODE1 = $(stat -c %i $COPY/file1.txt) || fatal "Unchanged file was rewritten"
+test $INODE2 = $(stat -c %i $COPY/file2.txt) || fatal "Unchanged file was rewritten"
+cmp $CONTENT/dir/file3.txt $COPY/dir/file3.txt
+test "$(readlink $COPY/symlink1)" = file1.txt || fatal "Symlink not updated"
+
+HEADER Durable installs
+for durability in batch file; do
+    rm -rf $COPY
+    $VALIDATOR install -r --durability=$durability --key=$PUBKEY $CONTENT $COPY
+    cmp $CONTENT/file1.txt $COPY/file1.txt
+    cmp $CONTENT/dir/file3.txt $COPY/dir/file3.txt
+    test "$(readlink $COPY/dir/symlink2)" = file3.txt || fatal "Symlink not installed"
+    test -z "$(find $COPY -name '*.??????')" || fatal "Temporary files left behind"
+done
+
+# With batch, files that validated are still installed when others fail
+echo FILEDATAX > $COPY/file1.txt
+echo CHANGED > $CONTENT/dir/file3.txt
+if $VALIDATOR install -r -f --durability=batch --key=$PUBKEY $CONTENT $COPY 2> $OUT; then
+    fatal "Should fail"
+fi
+cmp $CONTENT/file1.txt $COPY/file1.txt
+test -z "$(find $COPY -name '*.??????')" || fatal "Temporary files left behind"
+echo FILEDATA3 > $CONTENT/dir/file3.txt
+
+mkdir -p $CONFIGDIR
+cat > $CONFIGDIR/durable.conf <<EOF
+[install]
+keys=$PUBKEY
+sources=$CONTENT
+destination=$COPY
+durability=bogus
+EOF
+if $VALIDATOR install --config=$CONFIGDIR/durable.conf 2> $OUT; then
+    fatal "Should fail"
+fi
+assert_file_has_content $OUT "Unsupported durability 'bogus'"
+rm -rf $CONFIGDIR
+
+HEADER Staged install
+rm -rf $COPY
+$VALIDATOR install -r --staged --key=$PUBKEY $CONTENT $COPY
+cmp $CONTENT/file1.txt $COPY/file1.txt
+test "$(readlink $COPY/dir/symlink2)" = file3.txt || fatal "Symlink not installed"
+
+# Other files in the destination are kept, as hardlinks
+echo OTHER > $COPY/dir/other
+INODE=$(stat -c %i $COPY/dir/other)
+echo FILEDATAX > $COPY/file1.txt
+$VALIDATOR install -r -f --staged --durability=batch --key=$PUBKEY $CONTENT $COPY
+cmp $CONTENT/file1.txt $COPY/file1.txt
+test $INODE = $(stat -c %i $COPY/dir/other) || fatal "Other file not kept"
+test -z "$(ls -A $(dirname $COPY) | grep staged)" || fatal "Staging dir left behind"
+
+# Nothing is published unless all files are valid
+echo FILEDATAX > $COPY/file1.txt
+echo CHANGED > $CONTENT/dir/file3.txt
+if $VALIDATOR install -r -f --staged --key=$PUBKEY $CONTENT $COPY 2> $OUT; then
+    fatal "Should fail"
+fi
+assert_file_has_content $OUT "Not publishing"
+assert_file_has_content $COPY/file1.txt FILEDATAX
+test -z "$(ls -A $(dirname $COPY) | grep staged)" || fatal "Staging dir left behind"
+echo FILEDATA3 > $CONTENT/dir/file3.txt
+rm -rf $COPY
+
+# Special files, and the owner and times of directories, are kept
+$VALIDATOR install -r --key=$PUBKEY $CONTENT $COPY
+mkfifo $COPY/dir/fifo
+mkdir $COPY/other
+touch -d @1000000000 $COPY/other
+if test "$(id -u)" = 0; then
+    chown 1234:1234 $COPY $COPY/other
+fi
+OWNER=$(stat -c %u:%g $COPY)
+$VALIDATOR install -r -f --staged --key=$PUBKEY $CONTENT $COPY
+test -p $COPY/dir/fifo || fatal "Fifo not kept"
+test "$(stat -c %Y $COPY/other)" = 1000000000 || fatal "Directory mtime not kept"
+test "$(stat -c %u:%g $COPY)" = $OWNER || fatal "Destination owner not kept"
+test "$(stat -c %u:%g $COPY/other)" = $OWNER || fatal "Directory owner not kept"
+rm -rf $COPY
+
+# Unchanged files are hardlinks to the live tree, whose digest xattrs
+# aren't added, so the destinations are still hashed afterwards
+$VALIDATOR install -r --key=$PUBKEY $CONTENT $COPY
+$VALIDATOR install -r -f --staged --incremental --key=$PUBKEY $CONTENT $COPY
+$VALIDATOR --stats install -r -f --incremental --key=$PUBKEY $CONTENT $COPY 2> $OUT
+assert_file_has_content $OUT "bytes_hashed  *60$"
+rm -rf $COPY
+
+HEADER Watch for changes
+wait_for () {
+    for (( i = 0; i < 100; i++ )); do
+        if eval "$1"; then return 0; fi
+        sleep 0.1
+    done
+    fatal "Timed out waiting for: $1"
+}
+
+rm -rf $COPY
+$VALIDATOR --verbose install -r -f --watch --key=$PUBKEY $CONTENT $COPY 2> $OUT &
+WATCH_PID=$!
+wait_for "grep -q 'Watching 1 sources' $OUT"
+cmp $CONTENT/file1.txt $COPY/file1.txt
+
+# A new file is installed once it has a signature
+echo NEWFILE > $CONTENT/dir/new.txt
+sleep 0.5
+assert_not_has_file $COPY/dir/new.txt
+$VALIDATOR sign --key=$SECKEY --relative-to=$CONTENT $CONTENT/dir/new.txt
+wait_for "cmp -s $CONTENT/dir/new.txt $COPY/dir/new.txt"
+
+# Invalid changes are reported, and the watch goes on
+echo FILEDATAX > $CONTENT/file2.txt
+wait_for "grep -q 'file2.txt.* is invalid' $OUT"
+assert_file_has_content $COPY/file2.txt FILEDATA2
+
+# New directories are walked, and watched
+mkdir -p $CONTENT/newdir/sub
+echo NEWFILE2 > $CONTENT/newdir/sub/new2.txt
+$VALIDATOR sign --key=$SECKEY --relative-to=$CONTENT $CONTENT/newdir/sub/new2.txt
+wait_for "cmp -s $CONTENT/newdir/sub/new2.txt $COPY/newdir/sub/new2.txt"
+echo NEWFILE3 > $CONTENT/newdir/sub/new3.txt
+$VALIDATOR sign --key=$SECKEY --relative-to=$CONTENT $CONTENT/newdir/sub/new3.txt
+wait_for "cmp -s $CONTENT/newdir/sub/new3.txt $COPY/newdir/sub/new3.txt"
+
+# A file that is written all the time doesn't hold back other changes
+( for i in $(seq 200); do echo BUSY > $CONTENT/busy.txt; sleep 0.05; done ) &
+BUSY_PID=$!
+echo NEWFILE4 > $CONTENT/newdir/new4.txt
+$VALIDATOR sign --key=$SECKEY --relative-to=$CONTENT $CONTENT/newdir/new4.txt
+wait_for "cmp -s $CONTENT/newdir/new4.txt $COPY/newdir/new4.txt"
+kill $BUSY_PID
+wait $BUSY_PID || true
+
+kill $WATCH_PID
+wait $WATCH_PID || true
+echo FILEDATA2 > $CONTENT/file2.txt
+rm -rf $CONTENT/newdir $CONTENT/dir/new.txt* $CONTENT/busy.txt $COPY
+
+HEADER "Keys are shared between config files"
+
+rm -rf $COPY $CONFIGDIR
+mkdir -p $COPY $CONFIGDIR
+for i in 1 2 3; do
+    cat > $CONFIGDIR/test$i.conf <<- EOF
+[install]
+key_dirs=$PUBDIR
+sources=$CONTENT
+destination=$COPY/$i
+EOF
+done
+
+$VALIDATOR --verbose install --config-dir=$CONFIGDIR 2> $OUT
+assert_has_file $COPY/1/file1.txt
+assert_has_file $COPY/3/dir/file3.txt
+test "$(grep -c "Loaded public key" $OUT)" = 1 || _fatal_print_file $OUT "Keys loaded more than once"
+
+HEADER Statistics
+
+$VALIDATOR --stats validate -r --key=$PUBKEY $CONTENT 2> $OUT
+assert_file_has_content $OUT "Statistics for all" "signatures_verified  *5" "key_attempts_per_verify"
+
+rm -rf $COPY
+$VALIDATOR --stats=json install --config-dir=$CONFIGDIR 2> $OUT
+assert_file_has_content $OUT '"total": {"files": 15,' '"bytes_hashed": [1-9]'
+assert_file_has_content $OUT '"name": "[^"]*/test1.conf", "files": 5,' '"name": "[^"]*/test3.conf"'
+
+HEADER "Independent config files run concurrently, overlapping ones in order"
+
+rm -rf $COPY $CONFIGDIR $TMPDIR/content2
+mkdir -p $COPY $CONFIGDIR
+gencontent $TMPDIR/content2
+echo NEWDATA1 > $TMPDIR/content2/file1.txt
+$VALIDATOR sign -r --key=$SECKEY $TMPDIR/content2
+
+# 30-later.conf writes into the same tree as 10-first.conf, so has to run after it
+for conf in 10-first:$CONTENT:$COPY/a 20-other:$CONTENT:$COPY/b 30-later:$TMPDIR/content2:$COPY/a/dir; do
+    IFS=: read name source destination <<< "$conf"
+    cat > $CONFIGDIR/$name.conf <<- EOF
+[install]
+key_dirs=$PUBDIR
+sources=$source
+destination=$destination
+EOF
+done
+
+$VALIDATOR --verbose install -j 2 --config-dir=$CONFIGDIR 2> $OUT
+assert_file_has_content $OUT "Installing 3 configs in 2 independent chains"
+assert_has_file $COPY/b/dir/file3.txt
+test "$(cat $COPY/a/dir/file1.txt)" = NEWDATA1 || fatal "Overlapping configs not run in order"
+test "$(cat $COPY/a/file1.txt)" = FILEDATA1 || fatal "Wrong content installed"
+
+# What is printed for each config comes together, in config order
+a_done=$(grep -n "files into '$COPY/a'" $OUT | cut -d: -f1)
+b_first=$(grep -n "Installed file '$COPY/b/" $OUT | head -1 | cut -d: -f1)
+b_done=$(grep -n "files into '$COPY/b'" $OUT | cut -d: -f1)
+test "$a_done" -lt "$b_first" -a "$b_first" -lt "$b_done" || \
+    _fatal_print_file $OUT "Config output not in config order"
+
 HEADER Partial install
 rm -rf $COPY
 mkdir -p $COPY
@@ -258,6 +752,222 @@ assert_has_file $COPY/symlink1
 assert_has_file $COPY/dir/file3.txt
 assert_not_has_file $COPY/dir/symlink2
 
+# No temporary files left behind from the invalid file
+if test -n "$(find $COPY -name '*.??????')"; then
+    fatal "Temporary files left in $COPY"
+fi
+
+HEADER Sign with manifest
+gencontent $CONTENT
+$VALIDATOR sign -r --manifest --key=$SECKEY $CONTENT
+
+assert_has_file $CONTENT/.validator-manifest
+assert_has_file $CONTENT/.validator-manifest.sig
+if test -n "$(find $CONTENT -name '*.sig' ! -name .validator-manifest.sig)"; then
+    fatal "Per-file signatures written in manifest mode"
+fi
+
+$VALIDATOR validate -r --key=$PUBKEY $CONTENT
+
+rm -rf $COPY
+mkdir -p $COPY
+$VALIDATOR install -r --key=$PUBKEY $CONTENT $COPY
+assert_has_file $COPY/file1.txt
+cmp $CONTENT/file1.txt $COPY/file1.txt
+assert_has_file $COPY/symlink1
+assert_has_file $COPY/dir/file3.txt
+cmp $CONTENT/dir/file3.txt $COPY/dir/file3.txt
+assert_has_file $COPY/dir/symlink2
+
+echo wrong > $CONTENT/file2.txt
+echo NEWFILE > $CONTENT/dir/new.txt
+if $VALIDATOR validate -r --key=$PUBKEY $CONTENT 2> $OUT; then
+    fatal "Should fail"
+fi
+assert_file_has_content $OUT "Signature of .*file2.txt.* is invalid"
+assert_file_has_content $OUT "No signature for .*new.txt"
+
+# Files not in the manifest can still have their own signature
+$VALIDATOR sign --key=$SECKEY --relative-to=$CONTENT $CONTENT/dir/new.txt
+echo FILEDATA2 > $CONTENT/file2.txt
+$VALIDATOR validate -r --key=$PUBKEY $CONTENT
+
+# Signing some files into the manifest keeps the others
+rm $CONTENT/dir/new.txt.sig
+echo CHANGED > $CONTENT/file2.txt
+$VALIDATOR sign --manifest --key=$SECKEY --relative-to=$CONTENT $CONTENT/file2.txt $CONTENT/dir/new.txt
+$VALIDATOR validate -r --key=$PUBKEY $CONTENT
+
+# A tampered manifest is rejected
+echo garbage >> $CONTENT/.validator-manifest
+if $VALIDATOR validate -r --key=$PUBKEY $CONTENT 2> $OUT; then
+    fatal "Should fail"
+fi
+assert_file_has_content $OUT "manifest"
+
+HEADER Signature packs
+gencontent $CONTENT
+$VALIDATOR sign -r --pack --key=$SECKEY $CONTENT
+
+assert_has_file $CONTENT/.validator-sigpack
+assert_has_file $CONTENT/dir/.validator-sigpack
+if test -n "$(find $CONTENT -name '*.sig')"; then
+    fatal "Per-file signatures written in pack mode"
+fi
+
+$VALIDATOR validate -r --key=$PUBKEY $CONTENT
+$VALIDATOR validate --key=$PUBKEY --relative-to=$CONTENT $CONTENT/dir/file3.txt
+
+rm -rf $COPY
+mkdir -p $COPY
+$VALIDATOR install -r --key=$PUBKEY $CONTENT $COPY
+cmp $CONTENT/file1.txt $COPY/file1.txt
+cmp $CONTENT/dir/file3.txt $COPY/dir/file3.txt
+assert_has_file $COPY/dir/symlink2
+assert_not_has_file $COPY/.validator-sigpack
+
+# Files are re-signed into the pack one at a time, keeping the others
+echo CHANGED > $CONTENT/file2.txt
+if $VALIDATOR validate -r --key=$PUBKEY $CONTENT 2> $OUT; then
+    fatal "Should fail"
+fi
+assert_file_has_content $OUT "Signature of .*file2.txt.* is invalid"
+$VALIDATOR sign --pack --key=$SECKEY $CONTENT/file2.txt
+if $VALIDATOR validate -r --key=$PUBKEY $CONTENT 2> $OUT; then
+    fatal "Should fail"
+fi
+$VALIDATOR sign -f --pack --key=$SECKEY $CONTENT/file2.txt
+$VALIDATOR validate -r --key=$PUBKEY $CONTENT
+
+# Files in the pack are re-signed into it, also without --pack
+echo CHANGED2 > $CONTENT/dir/file3.txt
+$VALIDATOR sign -f --key=$SECKEY --relative-to=$CONTENT $CONTENT/dir/file3.txt
+assert_not_has_file $CONTENT/dir/file3.txt.sig
+$VALIDATOR validate -r --key=$PUBKEY $CONTENT
+
+# Files not in the pack fall back to their own signature
+echo NEWFILE > $CONTENT/dir/new.txt
+$VALIDATOR sign --key=$SECKEY --relative-to=$CONTENT $CONTENT/dir/new.txt
+$VALIDATOR validate -r --key=$PUBKEY $CONTENT
+
+# A corrupt pack is rejected
+echo garbage > $CONTENT/dir/.validator-sigpack
+if $VALIDATOR validate -r --key=$PUBKEY $CONTENT 2> $OUT; then
+    fatal "Should fail"
+fi
+assert_file_has_content $OUT "signature pack"
+
+HEADER Verification cache
+
+# The cache is only written, and trusted, if owned by root
+if test "$(id -u)" = 0; then
+    gencontent $CONTENT
+    $VALIDATOR sign -r --key=$SECKEY $CONTENT
+    CACHE=$TMPDIR/verify.cache
+    rm -rf $COPY
+    $VALIDATOR --stats install -r --incremental --verify-cache=$CACHE --key=$PUBKEY $CONTENT $COPY 2> $OUT
+    assert_file_has_content $OUT "signatures_verified  *5" "verify_cache_hits  *0"
+    assert_has_file $CACHE
+
+    # Unchanged files are neither hashed nor verified again
+    $VALIDATOR --stats install -rf --incremental --verify-cache=$CACHE --key=$PUBKEY $CONTENT $COPY 2> $OUT
+    assert_file_has_content $OUT "bytes_hashed  *0" "signatures_verified  *0" "verify_cache_hits  *5"
+    $VALIDATOR --stats validate -r --verify-cache=$CACHE --key=$PUBKEY $CONTENT 2> $OUT
+    assert_file_has_content $OUT "signatures_verified  *0" "verify_cache_hits  *5"
+
+    # A changed file misses, and is validated as usual
+    echo wrong > $CONTENT/file2.txt
+    if $VALIDATOR validate -r --verify-cache=$CACHE --key=$PUBKEY $CONTENT 2> $OUT; then
+        fatal "Should fail"
+    fi
+    assert_file_has_content $OUT "Signature of .*file2.txt.* is invalid"
+    echo FILEDATA2 > $CONTENT/file2.txt
+
+    # Other keys, or a cache that isn't only writable by root, aren't trusted
+    openssl genpkey -algorithm ed25519 -outform PEM -out $TMPDIR/other.pem
+    openssl pkey -in $TMPDIR/other.pem -pubout -out $TMPDIR/other.der
+    $VALIDATOR --stats validate -r --verify-cache=$CACHE --key=$PUBKEY --key=$TMPDIR/other.der \
+               $CONTENT 2> $OUT
+    assert_file_has_content $OUT "verify_cache_hits  *0"
+    chmod go+w $CACHE
+    $VALIDATOR --stats -v validate -r --verify-cache=$CACHE --key=$PUBKEY $CONTENT 2> $OUT
+    assert_file_has_content $OUT "Ignoring verification cache" "verify_cache_hits  *0"
+    rm -f $CACHE $TMPDIR/other.der
+
+    # When watching, the cache is saved after each set of changes, with
+    # the entries of changed files replacing their old ones
+    rm -rf $COPY
+    $VALIDATOR install -r --verify-cache=$CACHE --key=$PUBKEY $CONTENT $COPY
+    CACHE_SIZE=$(stat -c %s $CACHE)
+    $VALIDATOR --verbose install -r -f --watch --verify-cache=$CACHE --key=$PUBKEY $CONTENT $COPY 2> $OUT &
+    WATCH_PID=$!
+    wait_for "grep -q 'Watching 1 sources' $OUT"
+    for i in 1 2 3; do
+        echo CHANGED$i > $CONTENT/file2.txt
+        $VALIDATOR sign -f --key=$SECKEY $CONTENT/file2.txt
+        wait_for "cmp -s $CONTENT/file2.txt $COPY/file2.txt"
+    done
+    wait_for "$VALIDATOR --stats validate -r --verify-cache=$CACHE --key=$PUBKEY $CONTENT 2>&1 | grep -q 'verify_cache_hits  *5'"
+    kill $WATCH_PID
+    wait $WATCH_PID || true
+    test "$(stat -c %s $CACHE)" = $CACHE_SIZE || fatal "Verification cache grew when watching"
+    echo FILEDATA2 > $CONTENT/file2.txt
+    $VALIDATOR sign -f --key=$SECKEY $CONTENT/file2.txt
+    rm -f $CACHE
+fi
+
+HEADER Bundles
+
+gencontent $CONTENT
+$VALIDATOR sign -r --key=$SECKEY $CONTENT
+BUNDLE=$TMPDIR/content.bundle
+$VALIDATOR bundle create -r $BUNDLE $CONTENT
+$VALIDATOR bundle list $BUNDLE | sort > $OUT
+printf '%s\n' dir/file3.txt dir/symlink2 file1.txt file2.txt symlink1 | cmp - $OUT
+
+rm -rf $COPY
+$VALIDATOR install --key=$PUBKEY --bundle=$BUNDLE $COPY
+cmp $CONTENT/file1.txt $COPY/file1.txt
+cmp $CONTENT/dir/file3.txt $COPY/dir/file3.txt
+test "$(readlink $COPY/dir/symlink2)" = file3.txt || fatal "Symlink not installed"
+assert_not_has_file $COPY/file1.txt.sig
+
+# Streamed from stdin, and signed while bundling
+$VALIDATOR bundle create -r --key=$SECKEY --path-prefix=prefix $BUNDLE $CONTENT
+rm -rf $COPY
+$VALIDATOR install --key=$PUBKEY --path-prefix=prefix --bundle=- $COPY < $BUNDLE
+cmp $CONTENT/file2.txt $COPY/file2.txt
+if $VALIDATOR install --key=$PUBKEY --force --bundle=$BUNDLE $COPY 2> $OUT; then
+    fatal "Should fail without the prefix"
+fi
+assert_file_has_content $OUT "Signature of bundled 'file2.txt' .* is invalid"
+
+# A tampered file isn't installed, the others are
+$VALIDATOR bundle create -r $BUNDLE $CONTENT
+sed -i s/FILEDATA2/FILEDATA9/ $BUNDLE
+rm -rf $COPY
+if $VALIDATOR install --key=$PUBKEY --bundle=$BUNDLE $COPY 2> $OUT; then
+    fatal "Should fail"
+fi
+assert_file_has_content $OUT "Signature of bundled 'file2.txt' .* is invalid"
+assert_not_has_file $COPY/file2.txt
+assert_has_file $COPY/file1.txt
+
+head -c 100 $BUNDLE > $TMPDIR/truncated.bundle
+if $VALIDATOR install --key=$PUBKEY --bundle=$TMPDIR/truncated.bundle $COPY 2> $OUT; then
+    fatal "Should fail"
+fi
+assert_file_has_content $OUT "Truncated bundle"
+
+# Unsigned files can't be bundled, and nothing is written then
+rm $CONTENT/file1.txt.sig
+if $VALIDATOR bundle create -r $TMPDIR/unsigned.bundle $CONTENT 2> $OUT; then
+    fatal "Should fail"
+fi
+assert_file_has_content $OUT "No signature for .*file1.txt"
+assert_not_has_file $TMPDIR/unsigned.bundle
+rm -f $BUNDLE $TMPDIR/truncated.bundle
+
 HEADER Compatible with existing keys/signatures
 
 rm -rf $CONTENT/*
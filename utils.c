@@ -21,20 +21,21 @@
 #include <config.h>
 
 #include "utils.h"
+#include "fsverity.h"
+#include "chunked.h"
+#include "stats.h"
+#include "probes.h"
 
 #include <fcntl.h>
+#include <limits.h>
+#include <linux/fs.h>
 #include <openssl/err.h>
 #include <openssl/pem.h>
+#include <openssl/rand.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
 #include <unistd.h>
 
-void
-free_keys (GList *keys)
-{
-  for (GList *l = keys; l != NULL; l = l->next)
-    EVP_PKEY_free (l->data);
-  g_list_free (keys);
-}
-
 static const char *
 get_ssl_error_reason (void)
 {
@@ -74,29 +75,196 @@ fail_ssl (GError **error, const char *msg, ...)
   return FALSE;
 }
 
-EVP_PKEY *
-load_pub_key (const char *path, GError **error)
+static const EVP_MD *
+fetch_md (const char *name, const EVP_MD *fallback)
 {
-  g_autoptr (FILE) file = NULL;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  EVP_MD *md = EVP_MD_fetch (NULL, name, NULL);
+  if (md != NULL)
+    return md; /* Kept for the lifetime of the process */
+#endif
+  return fallback;
+}
 
-  file = fopen (path, "rb");
-  if (file == NULL)
+/* With OpenSSL 3 each init with EVP_sha512() looks up the
+ * implementation again, which is about a quarter of the cost of
+ * hashing a small file, so the implementations are fetched once.
+ * OpenSSL picks the fastest code for the CPU (SHA extensions, AVX2,
+ * NEON) itself. */
+const EVP_MD *
+get_sha512_md (void)
+{
+  static gsize md = 0;
+
+  if (g_once_init_enter (&md))
+    g_once_init_leave (&md, (gsize)fetch_md ("SHA512", EVP_sha512 ()));
+
+  return (const EVP_MD *)md;
+}
+
+const EVP_MD *
+get_sha256_md (void)
+{
+  static gsize md = 0;
+
+  if (g_once_init_enter (&md))
+    g_once_init_leave (&md, (gsize)fetch_md ("SHA256", EVP_sha256 ()));
+
+  return (const EVP_MD *)md;
+}
+
+/* The DER encoded SubjectPublicKeyInfo of an Ed25519 key is this
+ * prefix followed by the raw key. Building it directly is much cheaper
+ * than i2d_PUBKEY(), whose first use sets up the OpenSSL encoders, and
+ * that was most of the startup time when loading a compiled keyring. */
+static const guchar ed25519_spki_prefix[]
+    = { 0x30, 0x2a, 0x30, 0x05, 0x06, 0x03, 0x2b, 0x65, 0x70, 0x03, 0x21, 0x00 };
+
+/* The key id is a truncated sha256 of the DER encoded public key
+ * (SubjectPublicKeyInfo), so it works for any key type. */
+gboolean
+get_key_id (EVP_PKEY *key, guchar *key_id_out, GError **error)
+{
+  guchar ed25519_der[sizeof (ed25519_spki_prefix) + VALIDATOR_ED25519_KEY_LEN];
+  size_t raw_len = VALIDATOR_ED25519_KEY_LEN;
+  unsigned char *der = NULL;
+  int der_len;
+
+  if (EVP_PKEY_id (key) == EVP_PKEY_ED25519
+      && EVP_PKEY_get_raw_public_key (key, ed25519_der + sizeof (ed25519_spki_prefix), &raw_len)
+      && raw_len == VALIDATOR_ED25519_KEY_LEN)
     {
-      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno), "Can't load key %s: %s",
-                   path, strerror (errno));
-      return NULL;
+      memcpy (ed25519_der, ed25519_spki_prefix, sizeof (ed25519_spki_prefix));
+      der_len = sizeof (ed25519_der);
+    }
+  else
+    {
+      der_len = i2d_PUBKEY (key, &der);
+      if (der_len <= 0)
+        return fail_ssl (error, "Can't encode public key");
     }
 
-  g_autoptr (EVP_PKEY) pkey = PEM_read_PUBKEY (file, NULL, NULL, NULL);
-  if (pkey == NULL)
+  guchar digest[EVP_MAX_MD_SIZE];
+  guint digest_len = 0;
+  int res = EVP_Digest (der ? der : ed25519_der, der_len, digest, &digest_len, get_sha256_md (),
+                        NULL);
+  OPENSSL_free (der);
+  if (res == 0)
+    return fail_ssl (error, "Can't compute key id");
+
+  memcpy (key_id_out, digest, VALIDATOR_KEY_ID_LEN);
+  return TRUE;
+}
+
+Keyring *
+keyring_new (void)
+{
+  Keyring *keyring = g_new0 (Keyring, 1);
+
+  keyring->keys = g_ptr_array_new_with_free_func ((GDestroyNotify)EVP_PKEY_free);
+  keyring->keys_by_id = g_hash_table_new_full (g_int64_hash, g_int64_equal, g_free, NULL);
+  g_mutex_init (&keyring->fingerprint_lock);
+
+  return keyring;
+}
+
+void
+keyring_free (Keyring *keyring)
+{
+  g_hash_table_unref (keyring->keys_by_id);
+  g_ptr_array_unref (keyring->keys);
+  g_mutex_clear (&keyring->fingerprint_lock);
+  g_free (keyring);
+}
+
+/* Takes ownership of the key */
+void
+keyring_add_key (Keyring *keyring, EVP_PKEY *key)
+{
+  guchar key_id[VALIDATOR_KEY_ID_LEN];
+
+  g_ptr_array_add (keyring->keys, key);
+  g_mutex_lock (&keyring->fingerprint_lock);
+  keyring->has_fingerprint = FALSE;
+  g_mutex_unlock (&keyring->fingerprint_lock);
+
+  g_autoptr (GError) error = NULL;
+  if (!get_key_id (key, key_id, &error))
     {
-      fail_ssl_with_val (error, G_FILE_ERROR_INVAL, "Can't parse public key %s", path);
-      return NULL;
+      /* Still usable for signatures without key id */
+      g_debug ("Not indexing public key: %s", error->message);
+      return;
     }
 
-  g_info ("Loaded public key '%s'", path);
+  guint64 *id = g_new (guint64, 1);
+  memcpy (id, key_id, VALIDATOR_KEY_ID_LEN);
+  if (g_hash_table_contains (keyring->keys_by_id, id))
+    {
+      g_free (id);
+      return; /* Same key loaded twice */
+    }
 
-  return g_steal_pointer (&pkey);
+  g_hash_table_insert (keyring->keys_by_id, id, key);
+}
+
+EVP_PKEY *
+keyring_lookup (Keyring *keyring, const guchar *key_id)
+{
+  guint64 id;
+
+  memcpy (&id, key_id, VALIDATOR_KEY_ID_LEN);
+  return g_hash_table_lookup (keyring->keys_by_id, &id);
+}
+
+/* Keys are identified by the sha512 of their DER encoding */
+#define KEY_DIGEST_LEN 64
+
+static int
+compare_key_digests (gconstpointer a, gconstpointer b)
+{
+  return memcmp (a, b, KEY_DIGEST_LEN);
+}
+
+static gboolean
+compute_fingerprint (Keyring *keyring, guchar *fingerprint_out)
+{
+  guint n_keys = keyring->keys->len;
+  g_autofree guchar *digests = g_new0 (guchar, MAX (n_keys, 1) * KEY_DIGEST_LEN);
+
+  for (guint i = 0; i < n_keys; i++)
+    {
+      unsigned char *der = NULL;
+      int der_len = i2d_PUBKEY (g_ptr_array_index (keyring->keys, i), &der);
+      gboolean ok = der_len > 0
+                    && EVP_Digest (der, der_len, digests + i * KEY_DIGEST_LEN, NULL,
+                                   get_sha512_md (), NULL);
+      OPENSSL_free (der);
+      if (!ok)
+        return FALSE;
+    }
+  qsort (digests, n_keys, KEY_DIGEST_LEN, compare_key_digests);
+
+  return EVP_Digest (digests, n_keys * KEY_DIGEST_LEN, fingerprint_out, NULL, get_sha512_md (),
+                     NULL);
+}
+
+/* A digest of the set of keys, which doesn't depend on the order they
+ * were loaded in. If any key can't be hashed the whole fingerprint is
+ * random instead, so it matches nothing. It is copied out, since it
+ * changes when a key is added. */
+void
+keyring_get_fingerprint (Keyring *keyring, guchar *fingerprint_out)
+{
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&keyring->fingerprint_lock);
+
+  if (!keyring->has_fingerprint)
+    {
+      if (!compute_fingerprint (keyring, keyring->fingerprint))
+        (void)RAND_bytes (keyring->fingerprint, VALIDATOR_KEYRING_FINGERPRINT_LEN);
+      keyring->has_fingerprint = TRUE;
+    }
+
+  memcpy (fingerprint_out, keyring->fingerprint, VALIDATOR_KEYRING_FINGERPRINT_LEN);
 }
 
 EVP_PKEY *
@@ -124,32 +292,314 @@ load_priv_key (const char *path, GError **error)
   return g_steal_pointer (&pkey);
 }
 
+/* Public keys are cached for the lifetime of the process, so that
+ * several config files using the same keys (or key dirs) don't parse
+ * them again. Entries are keyed by canonical path, and are reloaded
+ * if the file (or directory) changed since they were loaded. */
+typedef struct
+{
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+  GPtrArray *keys; /* EVP_PKEY */
+} KeyCacheEntry;
+
+static GMutex key_cache_lock;
+static GHashTable *key_cache; /* canonical path -> KeyCacheEntry */
+
+static void
+key_cache_entry_free (KeyCacheEntry *entry)
+{
+  g_ptr_array_unref (entry->keys);
+  g_free (entry);
+}
+
+static gboolean
+key_cache_entry_matches (KeyCacheEntry *entry, struct stat *st)
+{
+  return entry->ino == st->st_ino && entry->size == st->st_size
+         && entry->mtime.tv_sec == st->st_mtim.tv_sec
+         && entry->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/* Returns a new reference to the cached keys, or NULL */
+static GPtrArray *
+key_cache_lookup (const char *canonical_path, struct stat *st)
+{
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&key_cache_lock);
+
+  if (key_cache == NULL)
+    return NULL;
+
+  KeyCacheEntry *entry = g_hash_table_lookup (key_cache, canonical_path);
+  if (entry == NULL || !key_cache_entry_matches (entry, st))
+    return NULL;
+
+  return g_ptr_array_ref (entry->keys);
+}
+
+static void
+key_cache_insert (const char *canonical_path, struct stat *st, GPtrArray *keys)
+{
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&key_cache_lock);
+
+  if (key_cache == NULL)
+    key_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                       (GDestroyNotify)key_cache_entry_free);
+
+  KeyCacheEntry *entry = g_new0 (KeyCacheEntry, 1);
+  entry->ino = st->st_ino;
+  entry->size = st->st_size;
+  entry->mtime = st->st_mtim;
+  entry->keys = g_ptr_array_ref (keys);
+
+  g_hash_table_replace (key_cache, g_strdup (canonical_path), entry);
+}
+
+static void
+keyring_add_keys (Keyring *keyring, GPtrArray *keys)
+{
+  for (guint i = 0; i < keys->len; i++)
+    {
+      EVP_PKEY *key = g_ptr_array_index (keys, i);
+      EVP_PKEY_up_ref (key);
+      keyring_add_key (keyring, key);
+    }
+}
+
+static GPtrArray *
+new_key_array (void)
+{
+  return g_ptr_array_new_with_free_func ((GDestroyNotify)EVP_PKEY_free);
+}
+
+/* A compiled keyring is a header followed by fixed-size records of key
+ * id and raw Ed25519 public key, so loading it needs no ASN.1 parsing. */
+static GPtrArray *
+parse_compiled_keyring (const char *path, const guchar *data, gsize data_len, GError **error)
+{
+  if (data_len < VALIDATOR_KEYRING_HEADER_LEN)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "Keyring %s is truncated", path);
+      return NULL;
+    }
+
+  guint32 n_keys;
+  memcpy (&n_keys, data + VALIDATOR_KEYRING_MAGIC_LEN, sizeof (n_keys));
+  n_keys = GUINT32_FROM_LE (n_keys);
+  if ((guint64)n_keys * VALIDATOR_KEYRING_ENTRY_LEN != data_len - VALIDATOR_KEYRING_HEADER_LEN)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "Keyring %s has invalid size", path);
+      return NULL;
+    }
+
+  g_autoptr (GPtrArray) keys = new_key_array ();
+  const guchar *entry = data + VALIDATOR_KEYRING_HEADER_LEN;
+
+  for (guint32 i = 0; i < n_keys; i++, entry += VALIDATOR_KEYRING_ENTRY_LEN)
+    {
+      EVP_PKEY *key = EVP_PKEY_new_raw_public_key (EVP_PKEY_ED25519, NULL,
+                                                   entry + VALIDATOR_KEY_ID_LEN,
+                                                   VALIDATOR_ED25519_KEY_LEN);
+      if (key == NULL)
+        {
+          fail_ssl_with_val (error, G_FILE_ERROR_INVAL, "Can't parse key %u in keyring %s", i,
+                             path);
+          return NULL;
+        }
+      g_ptr_array_add (keys, key);
+
+      guchar key_id[VALIDATOR_KEY_ID_LEN];
+      if (!get_key_id (key, key_id, error))
+        return NULL;
+
+      if (memcmp (key_id, entry, VALIDATOR_KEY_ID_LEN) != 0)
+        {
+          g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                       "Wrong key id for key %u in keyring %s", i, path);
+          return NULL;
+        }
+    }
+
+  return g_steal_pointer (&keys);
+}
+
+/* Loads a public key (in PEM or DER format), or all keys from a compiled keyring */
+static GPtrArray *
+load_pub_key_file (const char *path, GError **error)
+{
+  g_autofree char *data = NULL;
+  gsize data_len = 0;
+  g_autoptr (GError) my_error = NULL;
+
+  if (!g_file_get_contents (path, &data, &data_len, &my_error))
+    {
+      g_set_error (error, my_error->domain, my_error->code, "Can't load key %s: %s", path,
+                   my_error->message);
+      return NULL;
+    }
+
+  if (data_len >= VALIDATOR_KEYRING_MAGIC_LEN
+      && memcmp (data, VALIDATOR_KEYRING_MAGIC, VALIDATOR_KEYRING_MAGIC_LEN) == 0)
+    {
+      GPtrArray *keys = parse_compiled_keyring (path, (guchar *)data, data_len, error);
+      if (keys != NULL)
+        g_info ("Loaded %u public keys from keyring '%s'", keys->len, path);
+      return keys;
+    }
+
+  EVP_PKEY *pkey;
+  if (g_str_has_prefix (data, "-----BEGIN"))
+    {
+      g_autoptr (BIO) bio = BIO_new_mem_buf (data, data_len);
+      pkey = bio ? PEM_read_bio_PUBKEY (bio, NULL, NULL, NULL) : NULL;
+    }
+  else
+    {
+      const unsigned char *p = (unsigned char *)data;
+      pkey = d2i_PUBKEY (NULL, &p, data_len);
+    }
+
+  if (pkey == NULL)
+    {
+      fail_ssl_with_val (error, G_FILE_ERROR_INVAL, "Can't parse public key %s", path);
+      return NULL;
+    }
+
+  g_info ("Loaded public key '%s'", path);
+
+  GPtrArray *keys = new_key_array ();
+  g_ptr_array_add (keys, pkey);
+  return keys;
+}
+
+/* Like load_pub_key_file(), but shares the result with earlier loads of the same file */
+static GPtrArray *
+load_pub_key_file_cached (const char *path, GError **error)
+{
+  g_autofree char *canonical_path = realpath (path, NULL);
+  struct stat st;
+
+  if (canonical_path == NULL || stat (canonical_path, &st) < 0 || !S_ISREG (st.st_mode))
+    return load_pub_key_file (path, error); /* Gives the right error */
+
+  GPtrArray *cached = key_cache_lookup (canonical_path, &st);
+  if (cached != NULL)
+    {
+      g_debug ("Using cached public key '%s'", path);
+      return cached;
+    }
+
+  GPtrArray *keys = load_pub_key_file (path, error);
+  if (keys == NULL)
+    return NULL;
+
+  key_cache_insert (canonical_path, &st, keys);
+
+  return keys;
+}
+
+/* Adds the public key in path, or all the keys if it is a compiled keyring */
 gboolean
-load_pub_keys_from_dir (const char *key_dir, GList **out_keys, GError **error)
+load_pub_keys (const char *path, Keyring *keyring, GError **error)
+{
+  g_autoptr (GPtrArray) keys = load_pub_key_file_cached (path, error);
+  if (keys == NULL)
+    return FALSE;
+
+  keyring_add_keys (keyring, keys);
+  return TRUE;
+}
+
+/* Serializes the keyring in the compiled keyring format, only Ed25519 keys are supported */
+guchar *
+keyring_compile (Keyring *keyring, gsize *len_out, GError **error)
 {
-  GList *keys = NULL;
+  g_autoptr (GByteArray) data = g_byte_array_new ();
+  guint32 n_keys = 0;
+  guchar header[VALIDATOR_KEYRING_HEADER_LEN] = { 0 };
+
+  g_byte_array_append (data, header, sizeof (header));
+
+  for (guint i = 0; i < keyring->keys->len; i++)
+    {
+      EVP_PKEY *key = g_ptr_array_index (keyring->keys, i);
+      guchar entry[VALIDATOR_KEYRING_ENTRY_LEN];
+      size_t raw_len = VALIDATOR_ED25519_KEY_LEN;
+
+      if (EVP_PKEY_id (key) != EVP_PKEY_ED25519)
+        {
+          g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                       "Only Ed25519 keys are supported in keyrings");
+          return NULL;
+        }
+
+      if (!get_key_id (key, entry, error))
+        return NULL;
+
+      if (keyring_lookup (keyring, entry) != key)
+        continue; /* Duplicate */
+
+      if (!EVP_PKEY_get_raw_public_key (key, entry + VALIDATOR_KEY_ID_LEN, &raw_len)
+          || raw_len != VALIDATOR_ED25519_KEY_LEN)
+        {
+          fail_ssl (error, "Can't get raw public key");
+          return NULL;
+        }
+
+      g_byte_array_append (data, entry, sizeof (entry));
+      n_keys++;
+    }
+
+  memcpy (data->data, VALIDATOR_KEYRING_MAGIC, VALIDATOR_KEYRING_MAGIC_LEN);
+  guint32 n_keys_le = GUINT32_TO_LE (n_keys);
+  memcpy (data->data + VALIDATOR_KEYRING_MAGIC_LEN, &n_keys_le, sizeof (n_keys_le));
+
+  *len_out = data->len;
+  return g_byte_array_free (g_steal_pointer (&data), FALSE);
+}
+
+/* Note: The directory mtime only changes when keys are added, removed or
+ * renamed, so keys modified in place are not picked up until restart. */
+gboolean
+load_pub_keys_from_dir (const char *key_dir, Keyring *keyring, GError **error)
+{
+  g_autofree char *canonical_dir = realpath (key_dir, NULL);
+  struct stat st;
+
+  if (canonical_dir != NULL && stat (canonical_dir, &st) == 0)
+    {
+      g_autoptr (GPtrArray) cached = key_cache_lookup (canonical_dir, &st);
+      if (cached != NULL)
+        {
+          g_debug ("Using cached public keys from '%s'", key_dir);
+          keyring_add_keys (keyring, cached);
+          return TRUE;
+        }
+    }
+  else
+    g_clear_pointer (&canonical_dir, g_free);
 
   g_autoptr (GError) my_error = NULL;
   g_autoptr (GDir) dir = g_dir_open (key_dir, 0, &my_error);
   if (dir == NULL)
     {
       if (g_error_matches (my_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
-        {
-          *out_keys = NULL;
-          return TRUE;
-        }
+        return TRUE;
 
       g_propagate_prefixed_error (error, my_error, "Can't enumerate key dir %s: ", key_dir);
       return FALSE;
     }
 
+  g_autoptr (GPtrArray) keys = new_key_array ();
+
   const char *filename;
   while ((filename = g_dir_read_name (dir)) != NULL)
     {
       g_autofree char *path = g_build_filename (key_dir, filename, NULL);
 
-      g_autoptr (EVP_PKEY) pkey = load_pub_key (path, &my_error);
-      if (pkey == NULL)
+      g_autoptr (GPtrArray) file_keys = load_pub_key_file_cached (path, &my_error);
+      if (file_keys == NULL)
         {
           if (!g_error_matches (my_error, G_FILE_ERROR, G_FILE_ERROR_NOENT)
               && !g_error_matches (my_error, G_FILE_ERROR, G_FILE_ERROR_ISDIR))
@@ -161,117 +611,298 @@ load_pub_keys_from_dir (const char *key_dir, GList **out_keys, GError **error)
         }
       else
         {
-          keys = g_list_prepend (keys, g_steal_pointer (&pkey));
+          for (guint i = 0; i < file_keys->len; i++)
+            {
+              EVP_PKEY *key = g_ptr_array_index (file_keys, i);
+              EVP_PKEY_up_ref (key);
+              g_ptr_array_add (keys, key);
+            }
         }
     }
 
-  *out_keys = keys;
+  if (canonical_dir != NULL)
+    key_cache_insert (canonical_dir, &st, keys);
+
+  keyring_add_keys (keyring, keys);
+
   return TRUE;
 }
 
-guchar *
-make_sign_blob (const char *rel_path, int type, const guchar *content, gsize content_len,
-                gsize *out_size, GError **error)
+/* Each thread keeps one context for hashing, one for verifying and
+ * a buffer for the signed data, so validating a file doesn't allocate
+ * them again */
+static GPrivate thread_hash_ctx = G_PRIVATE_INIT ((GDestroyNotify)EVP_MD_CTX_free);
+static GPrivate thread_verify_ctx = G_PRIVATE_INIT ((GDestroyNotify)EVP_MD_CTX_free);
+static GPrivate thread_sign_blob = G_PRIVATE_INIT ((GDestroyNotify)g_byte_array_unref);
+
+/* Large blobs (of chunked files) are not kept around */
+#define THREAD_SIGN_BLOB_MAX_KEPT (64 * 1024)
+
+static EVP_MD_CTX *
+get_thread_ctx (GPrivate *thread_ctx)
 {
-  gsize rel_path_len = strlen (rel_path);
-  gsize to_sign_len = 1 + rel_path_len + 1 + content_len;
-  g_autofree guchar *to_sign = g_malloc (to_sign_len);
+  EVP_MD_CTX *ctx = g_private_get (thread_ctx);
+  if (ctx == NULL)
+    {
+      ctx = EVP_MD_CTX_new ();
+      g_private_set (thread_ctx, ctx);
+    }
+
+  return ctx;
+}
 
+/* to_sign must have room for 1 + strlen (rel_path) + 1 + content_len bytes */
+static gboolean
+fill_sign_blob (guchar *to_sign, const char *rel_path, gsize rel_path_len, int type,
+                ValidatorDigestType digest_type, const guchar *content, gsize content_len,
+                GError **error)
+{
   guchar *dst = to_sign;
-  if (type == S_IFREG)
+  if (type == S_IFREG && digest_type == VALIDATOR_DIGEST_FSVERITY)
+    *dst++ = 2;
+  else if (type == S_IFREG && digest_type == VALIDATOR_DIGEST_CHUNKED)
+    *dst++ = 3;
+  else if (type == S_IFREG)
     *dst++ = 0;
   else if (type == S_IFLNK)
     *dst++ = 1;
   else
     {
       g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "Unsupported file type");
-      return NULL;
+      return FALSE;
     }
 
   memcpy (dst, rel_path, rel_path_len);
   dst += rel_path_len;
   *dst++ = 0;
   memcpy (dst, content, content_len);
-  dst += content_len;
+
+  return TRUE;
+}
+
+guchar *
+make_sign_blob (const char *rel_path, int type, ValidatorDigestType digest_type,
+                const guchar *content, gsize content_len, gsize *out_size, GError **error)
+{
+  gsize rel_path_len = strlen (rel_path);
+  gsize to_sign_len = 1 + rel_path_len + 1 + content_len;
+  g_autofree guchar *to_sign = g_malloc (to_sign_len);
+
+  if (!fill_sign_blob (to_sign, rel_path, rel_path_len, type, digest_type, content, content_len,
+                       error))
+    return NULL;
 
   *out_size = to_sign_len;
   return g_steal_pointer (&to_sign);
 }
 
+/* Like make_sign_blob(), but the blob is in a buffer of the calling
+ * thread, only valid until the next call in the thread */
+static const guchar *
+make_thread_sign_blob (const char *rel_path, int type, ValidatorDigestType digest_type,
+                       const guchar *content, gsize content_len, gsize *out_size, GError **error)
+{
+  GByteArray *blob = g_private_get (&thread_sign_blob);
+  if (blob == NULL || blob->len > THREAD_SIGN_BLOB_MAX_KEPT)
+    {
+      blob = g_byte_array_new ();
+      g_private_replace (&thread_sign_blob, blob);
+    }
+
+  gsize rel_path_len = strlen (rel_path);
+  gsize to_sign_len = 1 + rel_path_len + 1 + content_len;
+  g_byte_array_set_size (blob, to_sign_len);
+
+  if (!fill_sign_blob (blob->data, rel_path, rel_path_len, type, digest_type, content,
+                       content_len, error))
+    return NULL;
+
+  *out_size = to_sign_len;
+  return blob->data;
+}
+
+/* Setting up a verify operation costs about as much as a fifth of the
+ * verification itself, and OpenSSL has no batch verification for
+ * Ed25519, so each key keeps an initialized context that is copied for
+ * each signature. It is freed with the key. */
+static GMutex verify_template_lock;
+static int verify_template_index = -1;
+
+static void
+verify_template_free (void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl, void *argp)
+{
+  EVP_MD_CTX_free (ptr);
+}
+
+static EVP_MD_CTX *
+get_verify_template (EVP_PKEY *key)
+{
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&verify_template_lock);
+
+  if (verify_template_index < 0)
+    verify_template_index = EVP_PKEY_get_ex_new_index (0, NULL, NULL, NULL, verify_template_free);
+  if (verify_template_index < 0)
+    return NULL;
+
+  EVP_MD_CTX *template = EVP_PKEY_get_ex_data (key, verify_template_index);
+  if (template != NULL)
+    return template;
+
+  template = EVP_MD_CTX_new ();
+  if (template == NULL || EVP_DigestVerifyInit (template, NULL, NULL, NULL, key) == 0
+      || EVP_PKEY_set_ex_data (key, verify_template_index, template) == 0)
+    {
+      ERR_clear_error ();
+      EVP_MD_CTX_free (template);
+      return NULL;
+    }
+
+  return template;
+}
+
+/* Returns 1 if valid, 0 if not and -1 on error */
+static int
+verify_with_key (const char *rel_path, EVP_PKEY *key, const guchar *sig, gsize sig_size,
+                 const guchar *to_sign, gsize to_sign_len, GError **error)
+{
+  stats_count (STATS_KEY_ATTEMPTS, 1);
+
+  EVP_MD_CTX *ctx = get_thread_ctx (&thread_verify_ctx);
+  if (!ctx)
+    {
+      fail_ssl (error, "Can't init context");
+      return -1;
+    }
+
+  /* Falls back to a new operation if the context can't be copied */
+  EVP_MD_CTX *template = get_verify_template (key);
+  if (template == NULL || EVP_MD_CTX_copy_ex (ctx, template) == 0)
+    {
+      ERR_clear_error ();
+      EVP_MD_CTX_reset (ctx);
+      if (EVP_DigestVerifyInit (ctx, NULL, NULL, NULL, key) == 0)
+        {
+          fail_ssl (error, "Can't initialzie digest verify operation");
+          return -1;
+        }
+    }
+
+  VALIDATOR_PROBE2 (key__begin, rel_path, (guint64)to_sign_len);
+  gint64 start = stats_begin ();
+  int res = EVP_DigestVerify (ctx, sig, sig_size, to_sign, to_sign_len);
+  stats_end (STATS_PHASE_VERIFY, start);
+  VALIDATOR_PROBE2 (key__end, rel_path, res);
+  if (res != 1 && res != 0)
+    {
+      fail_ssl (error, "Error validating digest");
+      return -1;
+    }
+
+  return res;
+}
+
+/* Says how the content of a regular file has to be hashed for validate_data() */
+ValidatorDigestType
+signature_get_digest_type (const char *sig, gsize sig_size)
+{
+  if (sig_size >= VALIDATOR_SIGNATURE_MAGIC_LEN
+      && memcmp (sig, VALIDATOR_SIGNATURE_FSVERITY_MAGIC, VALIDATOR_SIGNATURE_MAGIC_LEN) == 0)
+    return VALIDATOR_DIGEST_FSVERITY;
+
+  if (sig_size >= VALIDATOR_SIGNATURE_MAGIC_LEN
+      && memcmp (sig, VALIDATOR_SIGNATURE_CHUNKED_MAGIC, VALIDATOR_SIGNATURE_MAGIC_LEN) == 0)
+    return VALIDATOR_DIGEST_CHUNKED;
+
+  return VALIDATOR_DIGEST_SHA512;
+}
+
 gboolean
 validate_data (const char *rel_path, int type, guchar *content, gsize content_len, char *sig,
-               gsize sig_size, GList *pub_keys, GError **error)
+               gsize sig_size, Keyring *pub_keys, GError **error)
 {
-  if (sig_size < VALIDATOR_SIGNATURE_MAGIC_LEN
-      || memcmp (sig, VALIDATOR_SIGNATURE_MAGIC, VALIDATOR_SIGNATURE_MAGIC_LEN) != 0)
+  EVP_PKEY *key_for_id = NULL;
+  ValidatorDigestType digest_type = signature_get_digest_type (sig, sig_size);
+
+  if (sig_size >= VALIDATOR_SIGNATURE_V2_HEADER_LEN
+      && (memcmp (sig, VALIDATOR_SIGNATURE_V2_MAGIC, VALIDATOR_SIGNATURE_MAGIC_LEN) == 0
+          || digest_type != VALIDATOR_DIGEST_SHA512))
+    {
+      /* The header says which key was used, so we only need to try that one */
+      key_for_id = keyring_lookup (pub_keys, (guchar *)sig + VALIDATOR_SIGNATURE_MAGIC_LEN);
+      if (key_for_id == NULL)
+        return FALSE; /* Not signed by any of our keys */
+
+      sig += VALIDATOR_SIGNATURE_V2_HEADER_LEN;
+      sig_size -= VALIDATOR_SIGNATURE_V2_HEADER_LEN;
+    }
+  else if (sig_size >= VALIDATOR_SIGNATURE_MAGIC_LEN
+           && memcmp (sig, VALIDATOR_SIGNATURE_MAGIC, VALIDATOR_SIGNATURE_MAGIC_LEN) == 0)
+    {
+      /* Skip past header */
+      sig += VALIDATOR_SIGNATURE_MAGIC_LEN;
+      sig_size -= VALIDATOR_SIGNATURE_MAGIC_LEN;
+    }
+  else
     {
       g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "Invalid signature");
       return FALSE;
     }
-  /* Skip past header */
-  sig += VALIDATOR_SIGNATURE_MAGIC_LEN;
-  sig_size -= VALIDATOR_SIGNATURE_MAGIC_LEN;
 
   gsize to_sign_len;
-  g_autofree guchar *to_sign
-      = make_sign_blob (rel_path, type, content, content_len, &to_sign_len, error);
+  const guchar *to_sign = make_thread_sign_blob (rel_path, type, digest_type, content,
+                                                 content_len, &to_sign_len, error);
   if (to_sign == NULL)
     return FALSE;
 
-  gboolean valid = FALSE;
-  for (GList *l = pub_keys; l != NULL; l = l->next)
-    {
-      EVP_PKEY *key = l->data;
+  stats_count (STATS_SIGNATURES_VERIFIED, 1);
 
-      g_autoptr (EVP_MD_CTX) ctx = EVP_MD_CTX_new ();
-      if (!ctx)
-        return fail_ssl (error, "Can't init context");
+  if (key_for_id != NULL)
+    {
+      int res = verify_with_key (rel_path, key_for_id, (guchar *)sig, sig_size, to_sign,
+                                 to_sign_len, error);
+      return res == 1;
+    }
 
-      if (EVP_DigestVerifyInit (ctx, NULL, NULL, NULL, key) == 0)
-        return fail_ssl (error, "Can't initialzie digest verify operation");
+  /* Old style signature, try all keys */
+  for (guint i = 0; i < pub_keys->keys->len; i++)
+    {
+      EVP_PKEY *key = g_ptr_array_index (pub_keys->keys, i);
 
-      int res = EVP_DigestVerify (ctx, (unsigned char *)sig, sig_size, (unsigned char *)to_sign,
-                                  to_sign_len);
+      int res
+          = verify_with_key (rel_path, key, (guchar *)sig, sig_size, to_sign, to_sign_len, error);
+      if (res < 0)
+        return FALSE;
       if (res == 1)
-        {
-          valid = TRUE;
-          break;
-        }
-      else if (res != 0)
-        return fail_ssl (error, "Error validating digest");
+        return TRUE;
     }
 
-  return valid;
+  return FALSE;
 }
 
 static char *
-sha512_file (const char *path, gsize *digest_len_out, int *fd_out, GError **error)
+sha512_fd (int fd, const char *path, gsize *digest_len_out, int copy_to_fd, GError **error)
 {
-  autofd int fd = open (path, O_RDONLY);
-  if (fd < 0)
-    {
-      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno), "Can't open %s: %s", path,
-                   strerror (errno));
-      return NULL;
-    }
-
-  g_autoptr (EVP_MD_CTX) ctx = EVP_MD_CTX_new ();
+  EVP_MD_CTX *ctx = get_thread_ctx (&thread_hash_ctx);
   if (!ctx)
     {
       fail_ssl (error, "Can't init context");
       return NULL;
     }
 
-  if (EVP_DigestInit_ex (ctx, EVP_sha512 (), NULL) == 0)
+  if (EVP_DigestInit_ex (ctx, get_sha512_md (), NULL) == 0)
     {
       fail_ssl (error, "Can't initialize sha512 operation");
       return NULL;
     }
 
   guchar buf[16 * 1024];
+  guint64 offset = 0;
   while (TRUE)
     {
+      VALIDATOR_PROBE2 (hash__read__begin, path, offset);
       ssize_t res = read (fd, buf, sizeof (buf));
+      VALIDATOR_PROBE2 (hash__read__end, path, (gint64)res);
+      stats_count (STATS_SYSCALLS, 1);
       if (res < 0)
         {
           if (errno == EINTR)
@@ -283,11 +914,24 @@ sha512_file (const char *path, gsize *digest_len_out, int *fd_out, GError **erro
       else if (res == 0)
         break;
 
+      offset += res;
+      stats_count (STATS_BYTES_HASHED, res);
       if (EVP_DigestUpdate (ctx, buf, res) == 0)
         {
           fail_ssl (error, "Can't compute sha512 operation");
           return NULL;
         }
+
+      /* Copy exactly the data we hashed, so the copy can't differ from
+       * what is validated, even if the source changes under us. */
+      if (copy_to_fd >= 0 && write_to_fd (copy_to_fd, buf, res) < 0)
+        {
+          g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                       "Can't write copy of %s: %s", path, strerror (errno));
+          return NULL;
+        }
+      if (copy_to_fd >= 0)
+        stats_count (STATS_BYTES_COPIED, res);
     }
 
   guint digest_len = EVP_MD_CTX_size (ctx);
@@ -298,24 +942,195 @@ sha512_file (const char *path, gsize *digest_len_out, int *fd_out, GError **erro
       return NULL;
     }
 
-  if (fd_out)
-    {
-      lseek (fd, 0, SEEK_SET);
-      *fd_out = steal_fd (&fd);
-    }
   *digest_len_out = digest_len;
   return g_steal_pointer (&digest);
 }
 
+char *
+digest_file_fd (int fd, const char *path, ValidatorDigestType digest_type, gsize *digest_len_out,
+                int copy_to_fd, GError **error)
+{
+  /* Not using a reflink here, as the clone would not have fs-verity enabled */
+  if (digest_type == VALIDATOR_DIGEST_FSVERITY)
+    return fsverity_digest_fd (fd, path, digest_len_out, copy_to_fd, error);
+
+#ifdef FICLONE
+  /* If the copy can be a reflink we don't have to copy any data. We
+   * then hash the clone rather than the source, so the copy is still
+   * guaranteed to be what we validated. */
+  if (copy_to_fd >= 0)
+    {
+      stats_count (STATS_SYSCALLS, 1);
+      if (ioctl (copy_to_fd, FICLONE, fd) == 0)
+        {
+          fd = copy_to_fd;
+          copy_to_fd = -1;
+        }
+    }
+#endif
+
+  if (digest_type == VALIDATOR_DIGEST_CHUNKED)
+    return chunked_digest_fd (fd, path, digest_len_out, copy_to_fd, error);
+
+  return sha512_fd (fd, path, digest_len_out, copy_to_fd, error);
+}
+
+static char *
+digest_file_at (int dir_fd, const char *name, const char *path, ValidatorDigestType digest_type,
+                gsize *digest_len_out, int copy_to_fd, GError **error)
+{
+  autofd int fd = openat (dir_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  stats_count (STATS_SYSCALLS, 1);
+  if (fd < 0)
+    {
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno), "Can't open %s: %s", path,
+                   strerror (errno));
+      return NULL;
+    }
+
+  gint64 start = stats_begin ();
+  char *digest = digest_file_fd (fd, path, digest_type, digest_len_out, copy_to_fd, error);
+  stats_end (STATS_PHASE_HASH, start);
+
+  return digest;
+}
+
+char *
+read_link_at (int dir_fd, const char *name, const char *path, GError **error)
+{
+  gsize size = 256;
+
+  while (TRUE)
+    {
+      g_autofree char *buf = g_malloc (size);
+      gssize len = readlinkat (dir_fd, name, buf, size);
+      stats_count (STATS_SYSCALLS, 1);
+      if (len < 0)
+        {
+          g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                       "Failed to read the symlink %s: %s", path, strerror (errno));
+          return NULL;
+        }
+
+      if (len < size)
+        {
+          buf[len] = 0;
+          return g_steal_pointer (&buf);
+        }
+
+      size *= 2;
+    }
+}
+
+/* Like g_file_get_contents(), but relative to a directory fd. This is
+ * also how manifests and signature packs are loaded: the source tree
+ * is not trusted, so they can't be mmapped, as they could then change
+ * (or be truncated) after being validated. */
+gboolean
+load_file_at (int dir_fd, const char *name, const char *path, char **contents_out,
+              gsize *len_out, GError **error)
+{
+  autofd int fd = openat (dir_fd, name, O_RDONLY | O_CLOEXEC);
+  stats_count (STATS_SYSCALLS, 1);
+  if (fd < 0)
+    {
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno), "Can't open %s: %s", path,
+                   strerror (errno));
+      return FALSE;
+    }
+
+  /* Mostly this loads signatures, which fit in one read, and then
+   * the result is a single allocation of the right size */
+  g_autofree char *contents = NULL;
+  gsize len = 0;
+  gsize allocated = 0;
+  char buf[16 * 1024];
+  while (TRUE)
+    {
+      gssize n = TEMP_FAILURE_RETRY (read (fd, buf, sizeof (buf)));
+      stats_count (STATS_SYSCALLS, 1);
+      if (n < 0)
+        {
+          g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno), "Can't read %s: %s",
+                       path, strerror (errno));
+          return FALSE;
+        }
+      if (n == 0)
+        break;
+
+      if (len + n + 1 > allocated)
+        {
+          allocated = MAX (allocated * 2, len + n + 1);
+          contents = g_realloc (contents, allocated);
+        }
+      memcpy (contents + len, buf, n);
+      len += n;
+    }
+
+  if (contents == NULL)
+    contents = g_malloc (1);
+  contents[len] = 0; /* Zero terminate, like glib */
+
+  *len_out = len;
+  *contents_out = g_steal_pointer (&contents);
+  return TRUE;
+}
+
+/* Loads the signature of the file name in dir_fd, path is its full
+ * path. The signature name is built on the stack and its path only
+ * for errors, since this is done for each file. */
 gboolean
-load_file_data_for_sign (const char *path, struct stat *st, int *type_out, guchar **content_out,
-                         gsize *content_len_out, int *fd_out, GError **error)
+load_signature_at (int dir_fd, const char *name, const char *path, char **sig_out,
+                   gsize *sig_len_out, GError **error)
 {
+  char sig_name[NAME_MAX + 1];
+  gsize name_len = strlen (name);
+  g_autoptr (GError) local_error = NULL;
 
+  if (name_len + strlen (".sig") > NAME_MAX)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_NOENT, "No signature for '%s'", path);
+      return FALSE;
+    }
+  memcpy (sig_name, name, name_len);
+  memcpy (sig_name + name_len, ".sig", sizeof (".sig"));
+
+  if (!load_file_at (dir_fd, sig_name, sig_name, sig_out, sig_len_out, &local_error))
+    {
+      if (g_error_matches (local_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_NOENT, "No signature for '%s'", path);
+      else
+        g_set_error (error, local_error->domain, local_error->code, "Failed to load '%s.sig': %s",
+                     path, local_error->message);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* If copy_to_fd is >= 0, a regular file is copied to it while it is
+ * being hashed, so the file is only read once. digest_type selects how
+ * the content of regular files is hashed. */
+gboolean
+load_file_data_for_sign (const char *path, struct stat *st, ValidatorDigestType digest_type,
+                         int *type_out, guchar **content_out, gsize *content_len_out,
+                         int copy_to_fd, GError **error)
+{
+  return load_file_data_for_sign_at (AT_FDCWD, path, path, st, digest_type, type_out, content_out,
+                                     content_len_out, copy_to_fd, error);
+}
+
+/* Like load_file_data_for_sign(), for the file name in dir_fd, which
+ * is not followed if it is a symlink. path is used for messages. */
+gboolean
+load_file_data_for_sign_at (int dir_fd, const char *name, const char *path, struct stat *st,
+                            ValidatorDigestType digest_type, int *type_out, guchar **content_out,
+                            gsize *content_len_out, int copy_to_fd, GError **error)
+{
   struct stat st_buf;
   if (st == NULL)
     {
-      int res = lstat (path, &st_buf);
+      int res = fstatat (dir_fd, name, &st_buf, AT_SYMLINK_NOFOLLOW);
       if (res < 0)
         {
           g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno), "Can't stat %s: %s",
@@ -335,24 +1150,21 @@ load_file_data_for_sign (const char *path, struct stat *st, int *type_out, gucha
 
   g_autofree char *content = NULL;
   gsize content_len = 0;
-  autofd int fd = -1;
 
   if (type == S_IFREG)
     {
-      content = sha512_file (path, &content_len, fd_out ? &fd : NULL, error);
+      content = digest_file_at (dir_fd, name, path, digest_type, &content_len, copy_to_fd, error);
       if (content == NULL)
         return FALSE;
     }
   else
     {
-      content = g_file_read_link (path, error);
+      content = read_link_at (dir_fd, name, path, error);
       if (content == NULL)
         return FALSE;
       content_len = strlen (content);
     }
 
-  if (fd_out)
-    *fd_out = steal_fd (&fd);
   if (type_out)
     *type_out = type;
   *content_out = (guchar *)g_steal_pointer (&content);
@@ -361,13 +1173,60 @@ load_file_data_for_sign (const char *path, struct stat *st, int *type_out, gucha
   return TRUE;
 }
 
+/* The header magic for signatures with a key id */
+static const char *
+get_signature_magic (ValidatorDigestType digest_type)
+{
+  switch (digest_type)
+    {
+    case VALIDATOR_DIGEST_FSVERITY:
+      return VALIDATOR_SIGNATURE_FSVERITY_MAGIC;
+    case VALIDATOR_DIGEST_CHUNKED:
+      return VALIDATOR_SIGNATURE_CHUNKED_MAGIC;
+    case VALIDATOR_DIGEST_SHA512:
+    default:
+      return VALIDATOR_SIGNATURE_V2_MAGIC;
+    }
+}
+
+/* Writes the header for signatures by key into header_out, which must
+ * fit VALIDATOR_SIGNATURE_V2_HEADER_LEN bytes. Returns the length of
+ * the header, or 0 on error. */
+gsize
+make_signature_header (EVP_PKEY *key, ValidatorDigestType digest_type, guchar *header_out,
+                       GError **error)
+{
+  /* Include the key id in the header if possible, so validation
+   * doesn't need to try all keys */
+  guchar key_id[VALIDATOR_KEY_ID_LEN];
+  g_autoptr (GError) key_id_error = NULL;
+  if (!get_key_id (key, key_id, &key_id_error))
+    {
+      /* Only the sha512 header can be without key id */
+      if (digest_type != VALIDATOR_DIGEST_SHA512)
+        {
+          g_propagate_error (error, g_steal_pointer (&key_id_error));
+          return 0;
+        }
+
+      g_debug ("Using signature without key id: %s", key_id_error->message);
+      memcpy (header_out, VALIDATOR_SIGNATURE_MAGIC, VALIDATOR_SIGNATURE_MAGIC_LEN);
+      return VALIDATOR_SIGNATURE_MAGIC_LEN;
+    }
+
+  memcpy (header_out, get_signature_magic (digest_type), VALIDATOR_SIGNATURE_MAGIC_LEN);
+  memcpy (header_out + VALIDATOR_SIGNATURE_MAGIC_LEN, key_id, VALIDATOR_KEY_ID_LEN);
+  return VALIDATOR_SIGNATURE_V2_HEADER_LEN;
+}
+
 gboolean
-sign_data (int type, const char *rel_path, const guchar *content, gsize content_len, EVP_PKEY *pkey,
-           guchar **signature_out, gsize *signature_len_out, GError **error)
+sign_data (int type, ValidatorDigestType digest_type, const char *rel_path, const guchar *content,
+           gsize content_len, EVP_PKEY *pkey, guchar **signature_out, gsize *signature_len_out,
+           GError **error)
 {
   gsize to_sign_len;
   g_autofree guchar *to_sign
-      = make_sign_blob (rel_path, type, content, content_len, &to_sign_len, error);
+      = make_sign_blob (rel_path, type, digest_type, content, content_len, &to_sign_len, error);
   if (to_sign == NULL)
     return FALSE;
 
@@ -378,19 +1237,23 @@ sign_data (int type, const char *rel_path, const guchar *content, gsize content_
   if (EVP_DigestSignInit (ctx, NULL, NULL, NULL, pkey) == 0)
     return fail_ssl (error, "Can't initialize signature operation");
 
+  guchar header[VALIDATOR_SIGNATURE_V2_HEADER_LEN];
+  gsize header_len = make_signature_header (pkey, digest_type, header, error);
+  if (header_len == 0)
+    return FALSE;
+
   gsize signature_len = 0;
   if (EVP_DigestSign (ctx, NULL, &signature_len, to_sign, to_sign_len) == 0)
     return fail_ssl (error, "Error getting signature size");
 
-  g_autofree guchar *signature = g_malloc (VALIDATOR_SIGNATURE_MAGIC_LEN + signature_len);
-  memcpy (signature, VALIDATOR_SIGNATURE_MAGIC, VALIDATOR_SIGNATURE_MAGIC_LEN);
-  if (EVP_DigestSign (ctx, signature + VALIDATOR_SIGNATURE_MAGIC_LEN, &signature_len, to_sign,
-                      to_sign_len)
-      == 0)
+  g_autofree guchar *signature = g_malloc (header_len + signature_len);
+  memcpy (signature, header, header_len);
+
+  if (EVP_DigestSign (ctx, signature + header_len, &signature_len, to_sign, to_sign_len) == 0)
     return fail_ssl (error, "Error signing data");
 
   *signature_out = g_steal_pointer (&signature);
-  *signature_len_out = VALIDATOR_SIGNATURE_MAGIC_LEN + signature_len;
+  *signature_len_out = header_len + signature_len;
 
   return TRUE;
 }
@@ -435,6 +1298,7 @@ write_to_fd (int fd, const guchar *content, gsize len)
   while (len > 0)
     {
       res = TEMP_FAILURE_RETRY (write (fd, content, len));
+      stats_count (STATS_SYSCALLS, 1);
       if (res <= 0)
         {
           if (res == 0) /* Unexpected short write, should not happen when writing to a file */
@@ -448,13 +1312,158 @@ write_to_fd (int fd, const guchar *content, gsize len)
   return 0;
 }
 
+/* Little-endian integers, as used by the manifest and signature pack
+ * formats */
+guint32
+read_uint32 (const guchar *data)
+{
+  guint32 v;
+  memcpy (&v, data, sizeof (v));
+  return GUINT32_FROM_LE (v);
+}
+
+void
+append_uint32 (GString *s, guint32 v)
+{
+  v = GUINT32_TO_LE (v);
+  g_string_append_len (s, (const char *)&v, sizeof (v));
+}
+
+/* A relative path from a stream or bundle, which must not point
+ * outside the directory it is relative to */
+gboolean
+is_safe_relative_path (const char *path)
+{
+  if (*path == 0 || *path == '/')
+    return FALSE;
+
+  g_auto (GStrv) elements = g_strsplit (path, "/", -1);
+  for (gsize i = 0; elements[i] != NULL; i++)
+    {
+      if (strcmp (elements[i], "..") == 0)
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Appends a blob stream record for path and data to stream */
+void
+blob_stream_append (GByteArray *stream, const char *path, const guchar *data, gsize data_len)
+{
+  guint32 path_len_le = GUINT32_TO_LE (strlen (path));
+  guint32 data_len_le = GUINT32_TO_LE (data_len);
+
+  g_byte_array_append (stream, (guchar *)&path_len_le, 4);
+  g_byte_array_append (stream, (guchar *)path, strlen (path));
+  g_byte_array_append (stream, (guchar *)&data_len_le, 4);
+  g_byte_array_append (stream, data, data_len);
+}
+
+static gboolean
+blob_stream_fail_read (FILE *f, GError **error)
+{
+  if (ferror (f))
+    g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                 "Can't read blob stream: %s", strerror (errno));
+  else
+    g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "Truncated blob stream");
+  return FALSE;
+}
+
+static gboolean
+blob_stream_read_field (FILE *f, guint32 max_len, gboolean eof_ok, guchar **data_out,
+                        gsize *len_out, GError **error)
+{
+  guint32 len_le;
+  gsize n = fread (&len_le, 1, 4, f);
+  if (n == 0 && eof_ok && feof (f))
+    {
+      *data_out = NULL;
+      return TRUE;
+    }
+  if (n != 4)
+    return blob_stream_fail_read (f, error);
+
+  guint32 len = GUINT32_FROM_LE (len_le);
+  if (len > max_len)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "Too large record in blob stream");
+      return FALSE;
+    }
+
+  /* Zero terminated, for the path */
+  g_autofree guchar *data = g_malloc (len + 1);
+  if (fread (data, 1, len, f) != len)
+    return blob_stream_fail_read (f, error);
+  data[len] = 0;
+
+  *data_out = g_steal_pointer (&data);
+  *len_out = len;
+  return TRUE;
+}
+
+/* Reads the next record of a blob stream, at the end of the stream
+ * this returns TRUE with path_out set to NULL */
+gboolean
+blob_stream_read (FILE *f, char **path_out, guchar **data_out, gsize *data_len_out,
+                  GError **error)
+{
+  g_autofree guchar *path = NULL;
+  gsize path_len;
+  if (!blob_stream_read_field (f, PATH_MAX, TRUE, &path, &path_len, error))
+    return FALSE;
+
+  if (path == NULL)
+    {
+      *path_out = NULL;
+      return TRUE;
+    }
+
+  if (strlen ((char *)path) != path_len)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "Invalid path in blob stream");
+      return FALSE;
+    }
+
+  if (!blob_stream_read_field (f, VALIDATOR_BLOB_STREAM_MAX_DATA, FALSE, data_out, data_len_out,
+                               error))
+    return FALSE;
+
+  *path_out = (char *)g_steal_pointer (&path);
+  return TRUE;
+}
+
 int
 copy_fd (int from_fd, int to_fd)
 {
+#ifdef HAVE_COPY_FILE_RANGE
+  /* Let the kernel copy (or reflink) the data if it can, and fall back
+   * to a regular copy of whatever is left if not */
+  while (TRUE)
+    {
+      gssize n = TEMP_FAILURE_RETRY (copy_file_range (from_fd, NULL, to_fd, NULL, G_MAXINT, 0));
+      stats_count (STATS_SYSCALLS, 1);
+      if (n == 0) /* EOF */
+        return 0;
+
+      if (n < 0)
+        {
+          if (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP
+              || errno == EBADF)
+            break;
+          return -1;
+        }
+
+      stats_count (STATS_BYTES_COPIED, n);
+    }
+#endif
+
   while (TRUE)
     {
       guchar buf[16 * 1024];
       gssize n = TEMP_FAILURE_RETRY (read (from_fd, buf, sizeof (buf)));
+      stats_count (STATS_SYSCALLS, 1);
       if (n < 0)
         return -1;
 
@@ -463,6 +1472,7 @@ copy_fd (int from_fd, int to_fd)
 
       if (write_to_fd (to_fd, buf, (size_t)n) < 0)
         return -1;
+      stats_count (STATS_BYTES_COPIED, n);
     }
 
   return 0;
@@ -1,12 +1,41 @@
 #include <glib.h>
+#include "libvalidator.h"
 
+#include <openssl/bio.h>
 #include <openssl/evp.h>
 #include <sys/stat.h>
 
 #define VALIDATOR_SIGNATURE_MAGIC "VALIDTR\001"
 #define VALIDATOR_SIGNATURE_MAGIC_LEN 8
 
+/* Version 2 signatures have the id of the signing key after the magic */
+#define VALIDATOR_SIGNATURE_V2_MAGIC "VALIDTR\002"
+#define VALIDATOR_KEY_ID_LEN 8
+#define VALIDATOR_SIGNATURE_V2_HEADER_LEN (VALIDATOR_SIGNATURE_MAGIC_LEN + VALIDATOR_KEY_ID_LEN)
+
+/* Like version 2, but regular files are signed by their fs-verity digest */
+#define VALIDATOR_SIGNATURE_FSVERITY_MAGIC "VALIDTR\003"
+
+/* Like version 2, but regular files are signed by their chunked digest */
+#define VALIDATOR_SIGNATURE_CHUNKED_MAGIC "VALIDTR\004"
+
+/* Blob streams (validator blob --stream and import-signatures) are a
+ * sequence of records, each the u32 (little endian) length of a path,
+ * the path, the u32 length of the data and the data */
+#define VALIDATOR_BLOB_STREAM_MAX_DATA (1024 * 1024)
+
+/* Compiled keyrings are a header (magic, u32 number of keys, u32 reserved)
+ * followed by the key id and raw public key of each key */
+#define VALIDATOR_KEYRING_MAGIC "VALIDKR\001"
+#define VALIDATOR_KEYRING_MAGIC_LEN 8
+#define VALIDATOR_KEYRING_HEADER_LEN (VALIDATOR_KEYRING_MAGIC_LEN + 8)
+#define VALIDATOR_ED25519_KEY_LEN 32
+#define VALIDATOR_ED25519_SIGNATURE_LEN 64
+#define VALIDATOR_KEYRING_ENTRY_LEN (VALIDATOR_KEY_ID_LEN + VALIDATOR_ED25519_KEY_LEN)
+#define VALIDATOR_KEYRING_FINGERPRINT_LEN 64
+
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (FILE, fclose)
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (BIO, BIO_free)
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (EVP_PKEY, EVP_PKEY_free)
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (EVP_MD_CTX, EVP_MD_CTX_free)
 
@@ -48,24 +77,66 @@ close_fd (int *fdp)
 
 #define autofd __attribute__ ((cleanup (close_fd)))
 
+typedef struct
+{
+  GPtrArray *keys;        /* EVP_PKEY, in load order */
+  GHashTable *keys_by_id; /* key id -> EVP_PKEY */
+  GMutex fingerprint_lock;
+  gboolean has_fingerprint; /* Computed on first use, until a key is added */
+  guchar fingerprint[VALIDATOR_KEYRING_FINGERPRINT_LEN];
+} Keyring;
+
+Keyring *keyring_new (void);
+void keyring_free (Keyring *keyring);
+void keyring_add_key (Keyring *keyring, EVP_PKEY *key);
+EVP_PKEY *keyring_lookup (Keyring *keyring, const guchar *key_id);
+void keyring_get_fingerprint (Keyring *keyring, guchar *fingerprint_out);
+guchar *keyring_compile (Keyring *keyring, gsize *len_out, GError **error);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (Keyring, keyring_free)
+
 void oom (void);
 gboolean has_path_prefix (const char *str, const char *prefix);
-void free_keys (GList *keys);
+const EVP_MD *get_sha512_md (void);
+const EVP_MD *get_sha256_md (void);
+gboolean get_key_id (EVP_PKEY *key, guchar *key_id_out, GError **error);
 EVP_PKEY *load_priv_key (const char *path, GError **error);
-EVP_PKEY *load_pub_key (const char *path, GError **error);
-gboolean load_pub_keys_from_dir (const char *key_dir, GList **out_keys, GError **error);
+gboolean load_pub_keys (const char *path, Keyring *keyring, GError **error);
+gboolean load_pub_keys_from_dir (const char *key_dir, Keyring *keyring, GError **error);
+ValidatorDigestType signature_get_digest_type (const char *sig, gsize sig_size);
 gboolean validate_data (const char *rel_path, int type, guchar *content, gsize content_size,
-                        char *sig, gsize sig_size, GList *pub_keys, GError **error);
-guchar *make_sign_blob (const char *rel_path, int type, const guchar *content, gsize content_len,
-                        gsize *out_size, GError **error);
-gboolean sign_data (int type, const char *rel_path, const guchar *data, gsize data_len,
-                    EVP_PKEY *pkey, guchar **signature_out, gsize *signature_len_out,
-                    GError **error);
-gboolean load_file_data_for_sign (const char *path, struct stat *st, int *type_out,
-                                  guchar **content_out, gsize *content_len_out, int *fd_out,
+                        char *sig, gsize sig_size, Keyring *pub_keys, GError **error);
+guchar *make_sign_blob (const char *rel_path, int type, ValidatorDigestType digest_type,
+                        const guchar *content, gsize content_len, gsize *out_size, GError **error);
+gsize make_signature_header (EVP_PKEY *key, ValidatorDigestType digest_type, guchar *header_out,
+                             GError **error);
+gboolean sign_data (int type, ValidatorDigestType digest_type, const char *rel_path,
+                    const guchar *data, gsize data_len, EVP_PKEY *pkey, guchar **signature_out,
+                    gsize *signature_len_out, GError **error);
+char *read_link_at (int dir_fd, const char *name, const char *path, GError **error);
+char *digest_file_fd (int fd, const char *path, ValidatorDigestType digest_type,
+                      gsize *digest_len_out, int copy_to_fd, GError **error);
+gboolean load_file_at (int dir_fd, const char *name, const char *path, char **contents_out,
+                       gsize *len_out, GError **error);
+gboolean load_signature_at (int dir_fd, const char *name, const char *path, char **sig_out,
+                            gsize *sig_len_out, GError **error);
+gboolean load_file_data_for_sign_at (int dir_fd, const char *name, const char *path,
+                                     struct stat *st, ValidatorDigestType digest_type,
+                                     int *type_out, guchar **content_out, gsize *content_len_out,
+                                     int copy_to_fd, GError **error);
+gboolean load_file_data_for_sign (const char *path, struct stat *st,
+                                  ValidatorDigestType digest_type, int *type_out,
+                                  guchar **content_out, gsize *content_len_out, int copy_to_fd,
                                   GError **error);
 int write_to_fd (int fd, const guchar *content, gsize len);
 int copy_fd (int from_fd, int to_fd);
+guint32 read_uint32 (const guchar *data);
+void append_uint32 (GString *s, guint32 v);
+gboolean is_safe_relative_path (const char *path);
+void blob_stream_append (GByteArray *stream, const char *path, const guchar *data,
+                         gsize data_len);
+gboolean blob_stream_read (FILE *f, char **path_out, guchar **data_out, gsize *data_len_out,
+                           GError **error);
 
 gboolean keyfile_get_boolean_with_default (GKeyFile *keyfile, const char *section,
                                            const char *value, gboolean default_value,
@@ -22,96 +22,114 @@
 #include "main.h"
 
 static gboolean
-validate (const char *path, const char *relative_to)
+validate_file (WalkItem *item, gpointer user_data, GError **error)
 {
-  struct stat st;
-  gboolean success = TRUE;
+  VerifyCache *cache = user_data;
+  Manifest *manifest = item->root_data;
+  const char *path = item->path;
 
-  int res = lstat (path, &st);
-  if (res < 0)
+  g_autofree char *rel_path = opt_get_relative_path (path, item->relative_to, opt_path_prefix);
+  if (rel_path == NULL)
     {
-      g_printerr ("Can't access '%s': %s\n", path, strerror (errno));
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "File '%s' not inside relative dir",
+                   path);
       return FALSE;
     }
 
-  int type = st.st_mode & S_IFMT;
-  if (type == S_IFREG || type == S_IFLNK)
-    {
-      g_autofree char *sig_path = g_strconcat (path, ".sig", NULL);
+  /* Files not in the manifest (if any) need a separate signature */
+  gboolean in_manifest
+      = manifest != NULL && manifest_lookup (manifest, rel_path, NULL, NULL, NULL);
 
-      g_autofree char *signature = NULL;
-      gsize signature_len = 0;
+  g_autofree char *signature = NULL;
+  gsize signature_len = 0;
 
-      g_autoptr (GError) error = NULL;
-      if (!g_file_get_contents (sig_path, &signature, &signature_len, &error))
-        {
-          if (g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
-            g_printerr ("No signature for '%s'\n", path);
-          else
-            g_printerr ("Failed to load '%s': %s\n", sig_path, error->message);
-          return FALSE;
-        }
+  if (!in_manifest)
+    {
+      if (!sigpack_load_signature (item->sigpack, item->dir_fd, item->name, path, &signature,
+                                   &signature_len, error))
+        return FALSE;
+    }
 
-      g_autofree guchar *content = NULL;
-      gsize content_len = 0;
-      if (!load_file_data_for_sign (path, &st, NULL, &content, &content_len, NULL, &error))
+  /* An unchanged file that was verified before isn't hashed again */
+  guchar cache_key[VERIFY_CACHE_KEY_LEN];
+  if (cache && !in_manifest
+      && verify_cache_make_key (&item->st, rel_path, signature, signature_len, opt_public_keys,
+                                cache_key))
+    {
+      g_autofree guchar *cached = verify_cache_lookup (cache, path, cache_key, NULL);
+      if (cached)
         {
-          g_printerr ("Failed to load '%s': %s\n", path, error->message);
-          return FALSE;
+          log_info ("%s is valid (as %s, cached)", path, rel_path);
+          return TRUE;
         }
+    }
 
-      g_autofree char *rel_path = opt_get_relative_path (path, relative_to, opt_path_prefix);
-      if (rel_path == NULL)
-        {
-          g_printerr ("File '%s' not inside relative dir\n", path);
-          return FALSE;
-        }
+  g_autofree guchar *content = NULL;
+  gsize content_len = 0;
+  ValidatorDigestType digest_type = in_manifest
+                                        ? VALIDATOR_DIGEST_SHA512
+                                        : signature_get_digest_type (signature, signature_len);
+  if (!load_file_data_for_sign_at (item->dir_fd, item->name, path, &item->st, digest_type, NULL,
+                                   &content, &content_len, -1, error))
+    {
+      g_prefix_error (error, "Failed to load '%s': ", path);
+      return FALSE;
+    }
 
-      g_autoptr (GError) validate_error = NULL;
-      if (!validate_data (rel_path, type, content, content_len, signature, signature_len,
-                          opt_public_keys, &validate_error))
+  if (in_manifest)
+    {
+      if (!manifest_validate (manifest, rel_path, item->type, content, content_len))
         {
-          if (validate_error)
-            g_printerr ("Signature of '%s' is invalid (as %s): %s\n", path, rel_path,
-                        validate_error->message);
-          else
-            g_printerr ("Signature of '%s' is invalid (as %s)\n", path, rel_path);
+          g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                       "Signature of '%s' is invalid (as %s): Doesn't match manifest", path,
+                       rel_path);
           return FALSE;
         }
 
-      g_info ("%s is valid (as %s)", path, rel_path);
+      log_info ("%s is valid (as %s, in manifest)", path, rel_path);
+      return TRUE;
     }
-  else if (type == S_IFDIR)
+
+  g_autoptr (GError) validate_error = NULL;
+  if (!validate_data (rel_path, item->type, content, content_len, signature, signature_len,
+                      opt_public_keys, &validate_error))
     {
-      g_autoptr (GError) dir_error = NULL;
-      g_autoptr (GDir) dir = g_dir_open (path, 0, &dir_error);
-      if (dir == NULL)
-        {
-          if (g_error_matches (dir_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
-            return TRUE;
+      if (validate_error)
+        g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                     "Signature of '%s' is invalid (as %s): %s", path, rel_path,
+                     validate_error->message);
+      else
+        g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                     "Signature of '%s' is invalid (as %s)", path, rel_path);
+      return FALSE;
+    }
 
-          g_printerr ("Failed to open dir '%s': %s\n", path, strerror (errno));
-          return FALSE;
-        }
+  log_info ("%s is valid (as %s)", path, rel_path);
 
-      const char *child;
-      while ((child = g_dir_read_name (dir)) != NULL)
-        {
-          if (g_str_has_suffix (child, ".sig"))
-            continue; /* Skip existing signatures */
+  return TRUE;
+}
 
-          g_autofree char *child_path = g_build_filename (path, child, NULL);
-          if (!validate (child_path, relative_to))
-            success = FALSE;
-        }
-    }
-  else
-    {
-      g_printerr ("Can't validate '%s' due to unsupported file type'\n", path);
-      success = FALSE;
-    }
+typedef struct
+{
+  Walker *walker;
+  GHashTable *manifests;
+} ValidateList;
 
-  return success;
+static void
+validate_list_entry (const char *path, gpointer user_data)
+{
+  ValidateList *list = user_data;
+  g_autofree char *dirname = g_path_get_dirname (path);
+  const char *relative_to = opt_path_relative ? opt_path_relative : dirname;
+
+  g_autoptr (GError) error = NULL;
+  Manifest *manifest = manifest_cache_load (list->manifests, relative_to, opt_path_prefix,
+                                            opt_public_keys, &error);
+  if (error)
+    walker_add_error (list->walker, g_steal_pointer (&error));
+
+  walker_set_root_data (list->walker, manifest);
+  walker_walk_file (list->walker, path, relative_to, NULL);
 }
 
 int
@@ -119,33 +137,57 @@ cmd_validate (int argc, char *argv[])
 {
   g_autoptr (GError) error = NULL;
 
-  if (argc == 1)
+  if (argc == 1 && opt_files_from == NULL)
     help_error ("No input files given");
 
-  gboolean res = TRUE;
+  /* Only installs add to the cache */
+  g_autoptr (VerifyCache) cache = NULL;
+  if (opt_verify_cache)
+    cache = verify_cache_open (opt_verify_cache, FALSE);
+
+  g_autoptr (GHashTable) manifests = manifest_cache_new ();
+  g_autoptr (Walker) walker = walker_new (opt_jobs, validate_file, cache);
+
   for (gsize i = 1; i < argc; i++)
     {
       g_autofree char *path = g_canonicalize_filename (argv[i], NULL);
+      g_autofree char *dirname = NULL;
+      const char *relative_to;
 
       if (g_file_test (path, G_FILE_TEST_IS_DIR))
         {
           if (!opt_recursive)
             {
+              walker_finish (walker);
               g_printerr ("error: '%s' is a directory and not in recursive mode\n", path);
               return EXIT_FAILURE;
             }
 
-          if (!validate (path, opt_path_relative ? opt_path_relative : path))
-            res = FALSE;
+          relative_to = opt_path_relative ? opt_path_relative : path;
         }
       else
         {
-          g_autofree char *dirname = g_path_get_dirname (path);
-
-          if (!validate (path, opt_path_relative ? opt_path_relative : dirname))
-            res = FALSE;
+          dirname = g_path_get_dirname (path);
+          relative_to = opt_path_relative ? opt_path_relative : dirname;
         }
+
+      Manifest *manifest = manifest_cache_load (manifests, relative_to, opt_path_prefix,
+                                                opt_public_keys, &error);
+      if (error)
+        walker_add_error (walker, g_steal_pointer (&error));
+
+      walker_set_root_data (walker, manifest);
+      walker_walk (walker, path, relative_to, NULL, TRUE);
     }
 
+  if (opt_files_from)
+    {
+      ValidateList list = { walker, manifests };
+      if (!opt_read_files_from (validate_list_entry, &list, &error))
+        walker_add_error (walker, g_steal_pointer (&error));
+    }
+
+  gboolean res = walker_finish (walker);
+
   return res ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -0,0 +1,318 @@
+/*
+ * Copyright © 2023 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+#include "config.h"
+#include "main.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+struct VerifyCache
+{
+  char *path;
+  gboolean writable;
+  GMutex lock;
+  GHashTable *loaded; /* GBytes key -> GBytes content, from the file */
+  GHashTable *used;   /* Entries hit or added by this run, which are saved */
+  GHashTable *slots;  /* Source path -> GBytes key of its entry in used */
+  gboolean changed;
+  gboolean saved;
+};
+
+static GHashTable *
+new_entries (void)
+{
+  return g_hash_table_new_full (g_bytes_hash, g_bytes_equal, (GDestroyNotify)g_bytes_unref,
+                                (GDestroyNotify)g_bytes_unref);
+}
+
+/* A cache file anybody but root can write could mark anything as valid */
+static gboolean
+verify_cache_load (VerifyCache *cache, GError **error)
+{
+  autofd int fd = open (cache->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || fstat (fd, &st) < 0)
+    {
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno), "Can't open '%s': %s",
+                   cache->path, strerror (errno));
+      return FALSE;
+    }
+
+  if (!S_ISREG (st.st_mode) || st.st_uid != 0 || (st.st_mode & (S_IWGRP | S_IWOTH)) != 0)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_PERM,
+                   "'%s' is not a regular file owned and only writable by root", cache->path);
+      return FALSE;
+    }
+
+  /* Read from the fd that was checked */
+  gsize len = st.st_size;
+  g_autofree char *data = g_malloc (MAX (len, 1));
+  for (gsize n_read = 0; n_read < len;)
+    {
+      gssize n = TEMP_FAILURE_RETRY (read (fd, data + n_read, len - n_read));
+      if (n <= 0)
+        {
+          g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                       "Can't read '%s': %s", cache->path,
+                       n < 0 ? strerror (errno) : "Unexpected end of file");
+          return FALSE;
+        }
+      n_read += n;
+    }
+
+  if (len < VERIFY_CACHE_MAGIC_LEN
+      || memcmp (data, VERIFY_CACHE_MAGIC, VERIFY_CACHE_MAGIC_LEN) != 0)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "Invalid verification cache '%s'",
+                   cache->path);
+      return FALSE;
+    }
+
+  g_autoptr (GHashTable) entries = new_entries ();
+  gsize offset = VERIFY_CACHE_MAGIC_LEN;
+  while (offset < len)
+    {
+      guint32 content_len_le;
+
+      if (len - offset < VERIFY_CACHE_KEY_LEN + 4)
+        break;
+      memcpy (&content_len_le, data + offset + VERIFY_CACHE_KEY_LEN, 4);
+      gsize content_len = GUINT32_FROM_LE (content_len_le);
+      if (content_len > PATH_MAX || len - offset - VERIFY_CACHE_KEY_LEN - 4 < content_len)
+        break;
+
+      g_hash_table_replace (entries, g_bytes_new (data + offset, VERIFY_CACHE_KEY_LEN),
+                            g_bytes_new (data + offset + VERIFY_CACHE_KEY_LEN + 4, content_len));
+      offset += VERIFY_CACHE_KEY_LEN + 4 + content_len;
+    }
+
+  if (offset != len)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "Invalid verification cache '%s'",
+                   cache->path);
+      return FALSE;
+    }
+
+  g_hash_table_unref (cache->loaded);
+  cache->loaded = g_steal_pointer (&entries);
+  return TRUE;
+}
+
+/* Unusable cache files are ignored, and replaced when saving */
+VerifyCache *
+verify_cache_open (const char *path, gboolean writable)
+{
+  VerifyCache *cache = g_new0 (VerifyCache, 1);
+  cache->path = g_strdup (path);
+  cache->writable = writable && geteuid () == 0;
+  g_mutex_init (&cache->lock);
+  cache->loaded = new_entries ();
+  cache->used = new_entries ();
+  cache->slots = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                        (GDestroyNotify)g_bytes_unref);
+
+  g_autoptr (GError) error = NULL;
+  if (!verify_cache_load (cache, &error))
+    {
+      if (g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        g_debug ("No verification cache '%s'", path);
+      else
+        g_info ("Ignoring verification cache: %s", error->message);
+    }
+  else
+    g_debug ("Loaded %u entries from verification cache '%s'",
+             g_hash_table_size (cache->loaded), path);
+
+  return cache;
+}
+
+void
+verify_cache_free (VerifyCache *cache)
+{
+  g_hash_table_unref (cache->loaded);
+  g_hash_table_unref (cache->used);
+  g_hash_table_unref (cache->slots);
+  g_mutex_clear (&cache->lock);
+  g_free (cache->path);
+  g_free (cache);
+}
+
+/* Only the entries that were used are kept, so entries for removed or
+ * changed files, or old keys, are dropped. Can be called again (e.g.
+ * after each set of changes when watching), and only writes the file
+ * if something changed since. */
+gboolean
+verify_cache_save (VerifyCache *cache, GError **error)
+{
+  g_autoptr (GMutexLocker) locker = g_mutex_locker_new (&cache->lock);
+
+  if (!cache->writable
+      || (!cache->changed
+          && (cache->saved
+              || g_hash_table_size (cache->used) == g_hash_table_size (cache->loaded))))
+    return TRUE;
+
+  g_autoptr (GByteArray) data = g_byte_array_new ();
+  g_byte_array_append (data, (const guchar *)VERIFY_CACHE_MAGIC, VERIFY_CACHE_MAGIC_LEN);
+
+  GHashTableIter iter;
+  gpointer key, content;
+  g_hash_table_iter_init (&iter, cache->used);
+  while (g_hash_table_iter_next (&iter, &key, &content))
+    {
+      gsize content_len;
+      const guchar *content_data = g_bytes_get_data (content, &content_len);
+      guint32 content_len_le = GUINT32_TO_LE (content_len);
+
+      g_byte_array_append (data, g_bytes_get_data (key, NULL), VERIFY_CACHE_KEY_LEN);
+      g_byte_array_append (data, (const guchar *)&content_len_le, 4);
+      g_byte_array_append (data, content_data, content_len);
+    }
+
+  g_autofree char *tmp_path = g_strconcat (cache->path, ".XXXXXX", NULL);
+  autofd int fd = g_mkstemp_full (tmp_path, O_WRONLY | O_CLOEXEC, 0600);
+  if (fd < 0)
+    {
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                   "Can't create '%s': %s", tmp_path, strerror (errno));
+      return FALSE;
+    }
+
+  if (write_to_fd (fd, data->data, data->len) < 0 || rename (tmp_path, cache->path) < 0)
+    {
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno), "Can't write '%s': %s",
+                   cache->path, strerror (errno));
+      (void)unlink (tmp_path);
+      return FALSE;
+    }
+
+  g_debug ("Wrote %u entries to verification cache '%s'", g_hash_table_size (cache->used),
+           cache->path);
+  cache->changed = FALSE;
+  cache->saved = TRUE;
+  return TRUE;
+}
+
+static void
+digest_update_u64 (EVP_MD_CTX *ctx, guint64 value)
+{
+  guint64 value_le = GUINT64_TO_LE (value);
+  EVP_DigestUpdate (ctx, &value_le, 8);
+}
+
+/* Returns FALSE if the key can't be computed, and the cache is not used */
+gboolean
+verify_cache_make_key (struct stat *st, const char *rel_path, const char *signature,
+                       gsize signature_len, Keyring *keyring, guchar *key_out)
+{
+  g_autoptr (EVP_MD_CTX) ctx = EVP_MD_CTX_new ();
+  if (ctx == NULL || !EVP_DigestInit_ex (ctx, get_sha512_md (), NULL))
+    return FALSE;
+
+  digest_update_u64 (ctx, st->st_dev);
+  digest_update_u64 (ctx, st->st_ino);
+  digest_update_u64 (ctx, st->st_mode & S_IFMT);
+  digest_update_u64 (ctx, st->st_size);
+  digest_update_u64 (ctx, st->st_mtim.tv_sec);
+  digest_update_u64 (ctx, st->st_mtim.tv_nsec);
+  digest_update_u64 (ctx, st->st_ctim.tv_sec);
+  digest_update_u64 (ctx, st->st_ctim.tv_nsec);
+  digest_update_u64 (ctx, strlen (rel_path));
+  EVP_DigestUpdate (ctx, rel_path, strlen (rel_path));
+  digest_update_u64 (ctx, signature_len);
+  EVP_DigestUpdate (ctx, signature, signature_len);
+  guchar fingerprint[VALIDATOR_KEYRING_FINGERPRINT_LEN];
+  keyring_get_fingerprint (keyring, fingerprint);
+  EVP_DigestUpdate (ctx, fingerprint, VALIDATOR_KEYRING_FINGERPRINT_LEN);
+
+  return EVP_DigestFinal_ex (ctx, key_out, NULL) != 0;
+}
+
+/* The entry of path is now key, so the one it had before (for an older
+ * version of the file) is dropped, and not saved again */
+static void
+verify_cache_set_slot_locked (VerifyCache *cache, const char *path, GBytes *key)
+{
+  GBytes *old_key = g_hash_table_lookup (cache->slots, path);
+  if (old_key != NULL && !g_bytes_equal (old_key, key))
+    {
+      g_hash_table_remove (cache->used, old_key);
+      cache->changed = TRUE;
+    }
+
+  g_hash_table_replace (cache->slots, g_strdup (path), g_bytes_ref (key));
+}
+
+/* Returns the validated content of the source path, or NULL if not
+ * cached */
+guchar *
+verify_cache_lookup (VerifyCache *cache, const char *path, const guchar *key,
+                     gsize *content_len_out)
+{
+  g_autoptr (GBytes) key_bytes = g_bytes_new (key, VERIFY_CACHE_KEY_LEN);
+  guchar *res = NULL;
+
+  g_mutex_lock (&cache->lock);
+  GBytes *content = g_hash_table_lookup (cache->used, key_bytes);
+  if (content == NULL)
+    {
+      content = g_hash_table_lookup (cache->loaded, key_bytes);
+      if (content)
+        g_hash_table_replace (cache->used, g_bytes_ref (key_bytes), g_bytes_ref (content));
+    }
+  if (content)
+    {
+      if (cache->writable)
+        verify_cache_set_slot_locked (cache, path, key_bytes);
+
+      /* Zero terminated, for symlink targets */
+      gsize content_len = g_bytes_get_size (content);
+      res = g_malloc (content_len + 1);
+      memcpy (res, g_bytes_get_data (content, NULL), content_len);
+      res[content_len] = 0;
+      if (content_len_out)
+        *content_len_out = content_len;
+    }
+  g_mutex_unlock (&cache->lock);
+
+  if (res)
+    stats_count (STATS_VERIFY_CACHE_HITS, 1);
+
+  return res;
+}
+
+/* Only after the content of the source path was validated, by us */
+void
+verify_cache_add (VerifyCache *cache, const char *path, const guchar *key, const guchar *content,
+                  gsize content_len)
+{
+  if (!cache->writable || content_len > PATH_MAX)
+    return;
+
+  g_autoptr (GBytes) key_bytes = g_bytes_new (key, VERIFY_CACHE_KEY_LEN);
+
+  g_mutex_lock (&cache->lock);
+  verify_cache_set_slot_locked (cache, path, key_bytes);
+  g_hash_table_replace (cache->used, g_bytes_ref (key_bytes), g_bytes_new (content, content_len));
+  cache->changed = TRUE;
+  g_mutex_unlock (&cache->lock);
+}
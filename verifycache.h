@@ -0,0 +1,52 @@
+/*
+ * Copyright © 2023 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+#include <glib.h>
+#include <sys/stat.h>
+
+/* The verification cache remembers source files whose signature was
+ * verified, so unchanged files are not hashed and verified again. An
+ * entry is keyed on a digest of the identity of the file (device,
+ * inode, type, size, mtime and ctime), its signature, the path it was
+ * validated as and the set of keys, so any change to the file, its
+ * signature or the keys misses, and maps to the validated content
+ * (the digest of a file, or symlink target).
+ *
+ * The cache file is: the magic, followed by a record per entry of the
+ * key, the u32 length of the content (little endian) and the content.
+ * It is only trusted if owned by root and not writable by others, and
+ * only written by root. */
+#define VERIFY_CACHE_MAGIC "VALIDVC\001"
+#define VERIFY_CACHE_MAGIC_LEN 8
+#define VERIFY_CACHE_KEY_LEN 64
+
+typedef struct VerifyCache VerifyCache;
+
+VerifyCache *verify_cache_open (const char *path, gboolean writable);
+void verify_cache_free (VerifyCache *cache);
+gboolean verify_cache_save (VerifyCache *cache, GError **error);
+gboolean verify_cache_make_key (struct stat *st, const char *rel_path, const char *signature,
+                                gsize signature_len, Keyring *keyring, guchar *key_out);
+guchar *verify_cache_lookup (VerifyCache *cache, const char *path, const guchar *key,
+                             gsize *content_len_out);
+void verify_cache_add (VerifyCache *cache, const char *path, const guchar *key,
+                       const guchar *content, gsize content_len);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (VerifyCache, verify_cache_free)
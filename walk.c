@@ -0,0 +1,824 @@
+/*
+ * Copyright © 2023 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+#include "config.h"
+
+#include "main.h"
+#include "probes.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+/* The walker enumerates the tree on the calling thread, and hands each
+ * file off to a pool of worker threads. Results are reported in the
+ * order the files were found, so the output is the same independent
+ * of the number of jobs.
+ *
+ * The tree is walked iteratively, with directories opened relative to
+ * their parent (never following symlinks), and files identified by
+ * their directory fd and name. The entry types from readdir say which
+ * entries are directories, so the files themselves are only stat:ed
+ * by the workers.
+ *
+ * The entries of each directory are handled in inode order, which on
+ * most filesystems is close to their order on disk, instead of readdir
+ * (often hash) order. With --readahead, the start of each file and its
+ * signature is prefetched some files before the file is processed, so
+ * the device is reading while the CPU is hashing. */
+
+/* How many files per job we allow to be queued before waiting */
+#define WALKER_PENDING_PER_JOB 64
+
+/* Queued files keep their directory open, this is the most directories
+ * we keep open (at most a quarter of the fd limit) before waiting for
+ * the queued files to be processed */
+#define WALKER_MAX_OPEN_DIRS 256
+
+/* How much of each file --readahead prefetches, the kernel readahead
+ * takes over once the file is read sequentially */
+#define WALKER_PREFETCH_BYTES (128 * 1024)
+
+struct Walker
+{
+  WalkFileFunc func;
+  gpointer user_data;
+  gboolean success;
+
+  GThreadPool *pool; /* NULL if single-threaded */
+  guint max_pending;
+
+  guint max_open_dirs;
+  gint n_open_dirs;
+
+  guint prefetch_depth;
+  GQueue prefetched; /* WalkItems prefetched, but not yet queued for processing */
+
+  GMutex lock;
+  GCond cond;
+  GQueue pending; /* WalkItems in walk order, not yet reported */
+
+  GHashTable *relative_to; /* Strings referenced by items, each only once */
+  gpointer root_data;
+
+  /* The dir of the last toplevel file, consecutive files in a file
+   * list are often in the same directory */
+  char *last_dir_path;
+  WalkDir *last_dir;
+
+  FILE *timings; /* If --timings given */
+  Stats *stats;  /* What the workers account to, from the creating thread */
+};
+
+/* A refcounted directory fd, shared by the items in it */
+struct WalkDir
+{
+  gint ref_count;
+  int fd;
+  Walker *walker;
+  SigPack *sigpack; /* Of the directory, if it has one */
+};
+
+/* An entry of a directory that is being walked */
+typedef struct
+{
+  ino_t ino;
+  guchar d_type;
+  char name[]; /* Allocated with the entry */
+} WalkEntry;
+
+/* A directory on the stack of the directories being walked */
+typedef struct
+{
+  WalkDir *dir;
+  char *path;
+  char *destination_dir; /* Where its files are installed, or NULL */
+  GPtrArray *entries;    /* WalkEntry, in inode order */
+  guint next_entry;
+} WalkFrame;
+
+static WalkDir *
+walk_dir_new (Walker *walker, int fd)
+{
+  WalkDir *dir = g_new0 (WalkDir, 1);
+
+  dir->ref_count = 1;
+  dir->fd = fd;
+  dir->walker = walker;
+  g_atomic_int_inc (&walker->n_open_dirs);
+
+  return dir;
+}
+
+static WalkDir *
+walk_dir_ref (WalkDir *dir)
+{
+  g_atomic_int_inc (&dir->ref_count);
+  return dir;
+}
+
+static void
+walk_dir_unref (WalkDir *dir)
+{
+  if (g_atomic_int_dec_and_test (&dir->ref_count))
+    {
+      g_atomic_int_add (&dir->walker->n_open_dirs, -1);
+      close (dir->fd);
+      sigpack_free (dir->sigpack);
+      g_free (dir);
+    }
+}
+
+static void
+walk_frame_free (WalkFrame *frame)
+{
+  walk_dir_unref (frame->dir);
+  g_free (frame->path);
+  g_free (frame->destination_dir);
+  g_ptr_array_unref (frame->entries);
+  g_free (frame);
+}
+
+static void
+walk_item_free (WalkItem *item)
+{
+  if (item->dir)
+    walk_dir_unref (item->dir);
+  g_free (item->path);
+  g_free (item->destination_dir);
+  if (item->output)
+    g_byte_array_unref (item->output);
+  g_clear_error (&item->error);
+  g_free (item);
+}
+
+static void
+walker_report (Walker *walker, WalkItem *item)
+{
+  if (walker->timings && item->path)
+    fprintf (walker->timings, "%" G_GINT64_FORMAT " %s\n", item->duration, item->path);
+
+  if (item->success && item->output && write_to_fd (1, item->output->data, item->output->len) < 0)
+    {
+      g_printerr ("Failed to write output: %s\n", strerror (errno));
+      walker->success = FALSE;
+    }
+
+  if (!item->success)
+    {
+      if (item->error)
+        g_printerr ("%s\n", item->error->message);
+      walker->success = FALSE;
+    }
+
+  walk_item_free (item);
+}
+
+/* Fills in item->st, if the walker didn't need to stat the file */
+static gboolean
+walker_stat_item (WalkItem *item, GError **error)
+{
+  if (item->st.st_mode != 0)
+    return TRUE;
+
+  stats_count (STATS_SYSCALLS, 1);
+  if (fstatat (item->dir_fd, item->name, &item->st, AT_SYMLINK_NOFOLLOW) < 0)
+    {
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno), "Can't access '%s': %s",
+                   item->path, strerror (errno));
+      return FALSE;
+    }
+
+  /* Replaced since it was listed */
+  item->type = item->st.st_mode & S_IFMT;
+  if (item->type != S_IFREG && item->type != S_IFLNK)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "Unsupported file type for '%s'",
+                   item->path);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+walker_process (Walker *walker, WalkItem *item, gint64 *duration_out, GError **error)
+{
+  gint64 start = g_get_monotonic_time ();
+  gboolean res = walker_stat_item (item, error);
+
+  VALIDATOR_PROBE2 (file__begin, item->path, (guint64)item->st.st_size);
+
+  if (res)
+    res = walker->func (item, walker->user_data, error);
+  *duration_out = g_get_monotonic_time () - start;
+
+  VALIDATOR_PROBE2 (file__end, item->path, res);
+
+  return res;
+}
+
+static void
+walker_worker (gpointer data, gpointer user_data)
+{
+  WalkItem *item = data;
+  Walker *walker = user_data;
+  GError *error = NULL;
+  gint64 duration;
+
+  stats_set_current (walker->stats);
+
+  gboolean res = walker_process (walker, item, &duration, &error);
+
+  g_mutex_lock (&walker->lock);
+  item->success = res;
+  item->error = error;
+  item->duration = duration;
+  item->done = TRUE;
+  g_cond_broadcast (&walker->cond);
+  g_mutex_unlock (&walker->lock);
+}
+
+/* Report finished items in order, waiting until at most max_pending are
+ * left. Only the walking thread flushes, so the items can be reported
+ * after dropping the lock, without workers waiting for the output. */
+static void
+walker_flush (Walker *walker, guint max_pending)
+{
+  gboolean flushed = FALSE;
+
+  while (!flushed)
+    {
+      GQueue ready = G_QUEUE_INIT;
+
+      g_mutex_lock (&walker->lock);
+      while (!g_queue_is_empty (&walker->pending)
+             && ((WalkItem *)g_queue_peek_head (&walker->pending))->done)
+        g_queue_push_tail (&ready, g_queue_pop_head (&walker->pending));
+
+      if (g_queue_is_empty (&ready))
+        {
+          if (g_queue_get_length (&walker->pending) > max_pending)
+            g_cond_wait (&walker->cond, &walker->lock);
+          else
+            flushed = TRUE;
+        }
+      g_mutex_unlock (&walker->lock);
+
+      WalkItem *item;
+      while ((item = g_queue_pop_head (&ready)) != NULL)
+        walker_report (walker, item);
+    }
+}
+
+static void
+walker_queue_item (Walker *walker, WalkItem *item)
+{
+  if (walker->pool == NULL)
+    {
+      if (!item->done)
+        {
+          item->success = walker_process (walker, item, &item->duration, &item->error);
+          item->done = TRUE;
+        }
+      walker_report (walker, item);
+      return;
+    }
+
+  g_mutex_lock (&walker->lock);
+  g_queue_push_tail (&walker->pending, item);
+  g_mutex_unlock (&walker->lock);
+
+  if (!item->done)
+    g_thread_pool_push (walker->pool, item, NULL);
+
+  walker_flush (walker, walker->max_pending);
+}
+
+static void
+prefetch_at (int dir_fd, const char *name)
+{
+  int fd = openat (dir_fd, name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+  if (fd < 0)
+    return; /* The worker reports any errors */
+
+  posix_fadvise (fd, 0, WALKER_PREFETCH_BYTES, POSIX_FADV_WILLNEED);
+  close (fd);
+}
+
+/* Queue all prefetched items for processing */
+static void
+walker_drain_prefetched (Walker *walker)
+{
+  WalkItem *item;
+
+  while ((item = g_queue_pop_head (&walker->prefetched)) != NULL)
+    walker_queue_item (walker, item);
+}
+
+/* Each item is prefetched when added, and then held back until
+ * prefetch_depth more items have been added. Everything goes through
+ * this, so errors stay in order with the files. */
+static void
+walker_add_item (Walker *walker, WalkItem *item)
+{
+  if (walker->prefetch_depth == 0)
+    {
+      walker_queue_item (walker, item);
+      return;
+    }
+
+  if (item->type == S_IFREG)
+    {
+      gint64 start = stats_begin ();
+      prefetch_at (item->dir_fd, item->name);
+      stats_count (STATS_SYSCALLS, 3);
+
+      /* A signature in the pack is already in memory */
+      if (item->sigpack == NULL || !sigpack_lookup (item->sigpack, item->name, NULL, NULL))
+        {
+          g_autofree char *sig_name = g_strconcat (item->name, ".sig", NULL);
+          prefetch_at (item->dir_fd, sig_name);
+          stats_count (STATS_SYSCALLS, 3);
+        }
+      stats_end (STATS_PHASE_WALK, start);
+    }
+
+  g_queue_push_tail (&walker->prefetched, item);
+  if (g_queue_get_length (&walker->prefetched) > walker->prefetch_depth)
+    walker_queue_item (walker, g_queue_pop_head (&walker->prefetched));
+}
+
+/* Report an error in order with the files, takes ownership of error */
+void
+walker_add_error (Walker *walker, GError *error)
+{
+  WalkItem *item = g_new0 (WalkItem, 1);
+
+  item->done = TRUE;
+  item->success = FALSE;
+  item->error = error;
+
+  walker_add_item (walker, item);
+}
+
+Walker *
+walker_new (int n_jobs, WalkFileFunc func, gpointer user_data)
+{
+  Walker *walker = g_new0 (Walker, 1);
+
+  walker->func = func;
+  walker->user_data = user_data;
+  walker->success = TRUE;
+  walker->stats = stats_get_current ();
+  walker->relative_to = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_mutex_init (&walker->lock);
+  g_cond_init (&walker->cond);
+  g_queue_init (&walker->pending);
+  g_queue_init (&walker->prefetched);
+  walker->prefetch_depth = opt_readahead;
+
+  /* Per-file processing times, used by bench.sh */
+  if (opt_timings)
+    {
+      walker->timings = fopen (opt_timings, "a");
+      if (walker->timings == NULL)
+        g_printerr ("Can't open '%s': %s\n", opt_timings, strerror (errno));
+    }
+
+  struct rlimit limit;
+  walker->max_open_dirs = WALKER_MAX_OPEN_DIRS;
+  if (getrlimit (RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+    walker->max_open_dirs = CLAMP (limit.rlim_cur / 4, 1, WALKER_MAX_OPEN_DIRS);
+
+  if (n_jobs <= 0)
+    n_jobs = g_get_num_processors ();
+
+  if (n_jobs > 1)
+    {
+      walker->pool = g_thread_pool_new (walker_worker, walker, n_jobs, FALSE, NULL);
+      walker->max_pending = n_jobs * WALKER_PENDING_PER_JOB;
+    }
+
+  return walker;
+}
+
+/* Queues a file in dir, taking ownership of path. st is NULL if the
+ * worker should stat it */
+static void
+walker_add_file (Walker *walker, WalkDir *dir, char *path, const char *relative_to,
+                 const char *destination_dir, int type, struct stat *st)
+{
+  WalkItem *item = g_new0 (WalkItem, 1);
+
+  /* Paths are canonical, so there is always a slash */
+  item->path = path;
+  item->name = strrchr (item->path, '/') + 1;
+  item->dir = walk_dir_ref (dir);
+  item->dir_fd = dir->fd;
+  item->relative_to = relative_to;
+  item->destination_dir = g_strdup (destination_dir);
+  item->root_data = walker->root_data;
+  item->sigpack = dir->sigpack;
+  item->type = type;
+  if (st)
+    item->st = *st;
+
+  stats_count (STATS_FILES, 1);
+  walker_add_item (walker, item);
+}
+
+static int
+compare_entries_by_inode (gconstpointer a, gconstpointer b)
+{
+  const WalkEntry *entry_a = *(const WalkEntry **)a;
+  const WalkEntry *entry_b = *(const WalkEntry **)b;
+
+  if (entry_a->ino != entry_b->ino)
+    return entry_a->ino < entry_b->ino ? -1 : 1;
+
+  return strcmp (entry_a->name, entry_b->name);
+}
+
+static gboolean
+read_dir_entries (int fd, GPtrArray *entries, gboolean *has_sigpack_out)
+{
+  /* The stream gets its own fd, so it can be closed once read */
+  int stream_fd = fcntl (fd, F_DUPFD_CLOEXEC, 0);
+  if (stream_fd < 0)
+    return FALSE;
+
+  DIR *stream = fdopendir (stream_fd);
+  if (stream == NULL)
+    {
+      close (stream_fd);
+      return FALSE;
+    }
+
+  while (TRUE)
+    {
+      errno = 0;
+      struct dirent *dirent = readdir (stream);
+      stats_count (STATS_SYSCALLS, 1);
+      if (dirent == NULL)
+        break;
+
+      const char *name = dirent->d_name;
+      if (strcmp (name, ".") == 0 || strcmp (name, "..") == 0)
+        continue;
+
+      if (g_str_has_suffix (name, ".sig"))
+        continue; /* Skip existing signatures */
+
+      if (strcmp (name, VALIDATOR_MANIFEST_NAME) == 0)
+        continue; /* Manifests are handled separately */
+
+      if (strcmp (name, VALIDATOR_SIGPACK_NAME) == 0)
+        {
+          *has_sigpack_out = TRUE;
+          continue;
+        }
+
+      gsize name_len = strlen (name);
+      WalkEntry *entry = g_malloc (sizeof (WalkEntry) + name_len + 1);
+      memcpy (entry->name, name, name_len + 1);
+      entry->ino = dirent->d_ino;
+      entry->d_type = dirent->d_type;
+      g_ptr_array_add (entries, entry);
+    }
+
+  int saved_errno = errno;
+  closedir (stream);
+  errno = saved_errno;
+
+  if (errno != 0)
+    return FALSE;
+
+  g_ptr_array_sort (entries, compare_entries_by_inode);
+  return TRUE;
+}
+
+/* Open a directory (relative to parent_fd) and push it on the stack */
+static void
+walker_push_dir (Walker *walker, GPtrArray *stack, int parent_fd, const char *name,
+                 const char *path, const char *destination_dir)
+{
+  /* Releases the directories of the queued files */
+  if (g_atomic_int_get (&walker->n_open_dirs) >= walker->max_open_dirs)
+    {
+      walker_drain_prefetched (walker);
+      walker_flush (walker, 0);
+    }
+
+  gint64 start = stats_begin ();
+  int fd = openat (parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  stats_count (STATS_SYSCALLS, 1);
+  if (fd < 0)
+    {
+      if (errno != ENOENT)
+        walker_add_error (walker, g_error_new (G_FILE_ERROR, g_file_error_from_errno (errno),
+                                               "Failed to open dir '%s': %s", path,
+                                               strerror (errno)));
+      stats_end (STATS_PHASE_WALK, start);
+      return;
+    }
+
+  WalkFrame *frame = g_new0 (WalkFrame, 1);
+  frame->dir = walk_dir_new (walker, fd);
+  frame->path = g_strdup (path);
+  frame->destination_dir = g_strdup (destination_dir);
+  frame->entries = g_ptr_array_new_with_free_func (g_free);
+
+  gboolean has_sigpack = FALSE;
+  if (!read_dir_entries (fd, frame->entries, &has_sigpack))
+    {
+      walker_add_error (walker, g_error_new (G_FILE_ERROR, g_file_error_from_errno (errno),
+                                             "Failed to read dir '%s': %s", path,
+                                             strerror (errno)));
+      walk_frame_free (frame);
+      stats_end (STATS_PHASE_WALK, start);
+      return;
+    }
+
+  /* If the pack can't be loaded the files need loose signatures */
+  g_autoptr (GError) error = NULL;
+  if (has_sigpack)
+    frame->dir->sigpack = sigpack_load_at (fd, path, &error);
+  if (error)
+    walker_add_error (walker, g_steal_pointer (&error));
+
+  g_ptr_array_add (stack, frame);
+  stats_end (STATS_PHASE_WALK, start);
+}
+
+/* Walk the directories on the stack, depth first in inode order */
+static void
+walker_walk_stack (Walker *walker, GPtrArray *stack, const char *relative_to)
+{
+  while (stack->len > 0)
+    {
+      WalkFrame *frame = g_ptr_array_index (stack, stack->len - 1);
+      if (frame->next_entry == frame->entries->len)
+        {
+          g_ptr_array_remove_index (stack, stack->len - 1);
+          continue;
+        }
+
+      WalkEntry *entry = g_ptr_array_index (frame->entries, frame->next_entry++);
+      g_autofree char *child_path = g_build_filename (frame->path, entry->name, NULL);
+      int type;
+      struct stat st;
+      struct stat *stp = NULL;
+
+      switch (entry->d_type)
+        {
+        case DT_DIR:
+          type = S_IFDIR;
+          break;
+        case DT_REG:
+          type = S_IFREG;
+          break;
+        case DT_LNK:
+          type = S_IFLNK;
+          break;
+        case DT_UNKNOWN:
+          /* Not all filesystems give the type, then we have to stat */
+          stats_count (STATS_SYSCALLS, 1);
+          if (fstatat (frame->dir->fd, entry->name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+            {
+              if (errno != ENOENT)
+                walker_add_error (walker,
+                                  g_error_new (G_FILE_ERROR, g_file_error_from_errno (errno),
+                                               "Can't access '%s': %s", child_path,
+                                               strerror (errno)));
+              continue;
+            }
+          type = st.st_mode & S_IFMT;
+          stp = &st;
+          break;
+        default:
+          type = 0;
+          break;
+        }
+
+      if (type == S_IFREG || type == S_IFLNK)
+        walker_add_file (walker, frame->dir, g_steal_pointer (&child_path), relative_to,
+                         frame->destination_dir, type, stp);
+      else if (type == S_IFDIR)
+        {
+          g_autofree char *destination_subdir = NULL;
+          if (frame->destination_dir)
+            destination_subdir = g_build_filename (frame->destination_dir, entry->name, NULL);
+
+          /* Note: This may reallocate the stack, so frame is invalid after this */
+          walker_push_dir (walker, stack, frame->dir->fd, entry->name, child_path,
+                           destination_subdir);
+        }
+      else
+        walker_add_error (walker, g_error_new (G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                                               "Unsupported file type for '%s'", child_path));
+    }
+}
+
+static void
+walker_add_toplevel_file (Walker *walker, const char *path, const char *relative_to,
+                          const char *destination_dir, int type, struct stat *st)
+{
+  g_autofree char *dirname = g_path_get_dirname (path);
+
+  if (walker->last_dir == NULL || strcmp (walker->last_dir_path, dirname) != 0)
+    {
+      g_clear_pointer (&walker->last_dir, walk_dir_unref);
+      g_clear_pointer (&walker->last_dir_path, g_free);
+
+      int dir_fd = open (dirname, O_PATH | O_DIRECTORY | O_CLOEXEC);
+      stats_count (STATS_SYSCALLS, 1);
+      if (dir_fd < 0)
+        {
+          walker_add_error (walker, g_error_new (G_FILE_ERROR, g_file_error_from_errno (errno),
+                                                 "Failed to open dir '%s': %s", dirname,
+                                                 strerror (errno)));
+          return;
+        }
+
+      walker->last_dir = walk_dir_new (walker, dir_fd);
+      walker->last_dir_path = g_steal_pointer (&dirname);
+
+      g_autoptr (GError) error = NULL;
+      walker->last_dir->sigpack = sigpack_load_at (dir_fd, walker->last_dir_path, &error);
+      if (error)
+        walker_add_error (walker, g_steal_pointer (&error));
+    }
+
+  walker_add_file (walker, walker->last_dir, g_strdup (path), relative_to, destination_dir, type,
+                   st);
+}
+
+static void
+walker_walk_path (Walker *walker, const char *path, const char *relative_to,
+                  const char *destination_dir, gboolean toplevel)
+{
+  struct stat st;
+
+  gint64 start = stats_begin ();
+  int res = lstat (path, &st);
+  stats_count (STATS_SYSCALLS, 1);
+  stats_end (STATS_PHASE_WALK, start);
+  if (res < 0)
+    {
+      walker_add_error (walker, g_error_new (G_FILE_ERROR, g_file_error_from_errno (errno),
+                                             "Can't access '%s': %s", path, strerror (errno)));
+      return;
+    }
+
+  int type = st.st_mode & S_IFMT;
+  if (type == S_IFREG || type == S_IFLNK)
+    walker_add_toplevel_file (walker, path, relative_to, destination_dir, type, &st);
+  else if (type == S_IFDIR)
+    {
+      g_autoptr (GPtrArray) stack
+          = g_ptr_array_new_with_free_func ((GDestroyNotify)walk_frame_free);
+
+      /* The content of a toplevel directory is installed into destination_dir */
+      g_autofree char *destination_subdir = NULL;
+      if (destination_dir)
+        {
+          g_autofree char *basename = g_path_get_basename (path);
+          destination_subdir = g_build_filename (destination_dir, toplevel ? NULL : basename, NULL);
+        }
+
+      walker_push_dir (walker, stack, AT_FDCWD, path, path, destination_subdir);
+      walker_walk_stack (walker, stack, relative_to);
+    }
+  else
+    {
+      walker_add_error (walker, g_error_new (G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                                             "Unsupported file type for '%s'", path));
+    }
+}
+
+/* Set the data passed in WalkItem.root_data for the following walks.
+ * This is not owned by the walker. */
+void
+walker_set_root_data (Walker *walker, gpointer root_data)
+{
+  walker->root_data = root_data;
+}
+
+static const char *
+walker_intern_relative_to (Walker *walker, const char *relative_to)
+{
+  const char *interned = g_hash_table_lookup (walker->relative_to, relative_to);
+  if (interned == NULL)
+    {
+      char *copy = g_strdup (relative_to);
+      g_hash_table_insert (walker->relative_to, copy, copy);
+      interned = copy;
+    }
+  return interned;
+}
+
+/* Walk path (recursively, if a directory) and queue all files found
+ * for processing. Note: Target directories are never created here,
+ * that is up to the file callback once it has validated a file. */
+void
+walker_walk (Walker *walker, const char *path, const char *relative_to,
+             const char *destination_dir, gboolean toplevel)
+{
+  walker_walk_path (walker, path, walker_intern_relative_to (walker, relative_to),
+                    destination_dir, toplevel);
+}
+
+/* Queue a single file (regular or symlink), directories are not walked
+ * but reported as an error. This is for file lists, where the caller
+ * already knows what changed. */
+void
+walker_walk_file (Walker *walker, const char *path, const char *relative_to,
+                  const char *destination_dir)
+{
+  struct stat st;
+
+  gint64 start = stats_begin ();
+  int res = lstat (path, &st);
+  stats_count (STATS_SYSCALLS, 1);
+  stats_end (STATS_PHASE_WALK, start);
+  if (res < 0)
+    {
+      walker_add_error (walker, g_error_new (G_FILE_ERROR, g_file_error_from_errno (errno),
+                                             "Can't access '%s': %s", path, strerror (errno)));
+      return;
+    }
+
+  int type = st.st_mode & S_IFMT;
+  if (type != S_IFREG && type != S_IFLNK)
+    {
+      walker_add_error (walker, g_error_new (G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                                             "'%s' is not a regular file or symlink", path));
+      return;
+    }
+
+  walker_add_toplevel_file (walker, path, walker_intern_relative_to (walker, relative_to),
+                            destination_dir, type, &st);
+}
+
+/* Wait for all queued files, returns FALSE if any of them failed. The
+ * walker can then be used for more files, and the next finish only
+ * reports on those. */
+gboolean
+walker_finish (Walker *walker)
+{
+  walker_drain_prefetched (walker);
+  walker_flush (walker, 0);
+
+  /* The directory may be replaced before the walker is used again */
+  g_clear_pointer (&walker->last_dir, walk_dir_unref);
+  g_clear_pointer (&walker->last_dir_path, g_free);
+
+  gboolean success = walker->success;
+  walker->success = TRUE;
+  return success;
+}
+
+void
+walker_free (Walker *walker)
+{
+  walker_drain_prefetched (walker);
+
+  if (walker->pool)
+    {
+      /* Waits for running jobs */
+      g_thread_pool_free (walker->pool, FALSE, TRUE);
+      walker->pool = NULL;
+    }
+
+  walker_flush (walker, 0);
+
+  if (walker->timings)
+    fclose (walker->timings);
+
+  g_clear_pointer (&walker->last_dir, walk_dir_unref);
+  g_free (walker->last_dir_path);
+  g_hash_table_unref (walker->relative_to);
+  g_mutex_clear (&walker->lock);
+  g_cond_clear (&walker->cond);
+  g_free (walker);
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright © 2023 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+#include <glib.h>
+#include <sys/stat.h>
+
+typedef struct WalkDir WalkDir;
+
+/* A single file (regular or symlink) found while walking a tree. Files
+ * should be accessed with dir_fd and name (openat() etc, without
+ * following symlinks), so that a directory of the source tree being
+ * replaced by a symlink while walking can't redirect us. */
+typedef struct
+{
+  char *path;              /* Full path of the file, for messages and relative paths */
+  int dir_fd;              /* The directory the file is in, while the item is processed */
+  const char *name;        /* Name of the file in dir_fd */
+  WalkDir *dir;            /* Owns dir_fd */
+  const char *relative_to; /* Base dir of signed path, owned by the walker */
+  char *destination_dir;   /* Where to install the file, or NULL */
+  gpointer root_data;      /* From walker_set_root_data() */
+  SigPack *sigpack;        /* Signatures of the files in dir, or NULL, owned by dir */
+  struct stat st;          /* lstat of the file, done by the worker */
+  int type;
+
+  /* Result, set when processed */
+  GByteArray *output; /* If set, written to stdout when reported, in walk order */
+  gboolean done;
+  gboolean success;
+  GError *error;
+  gint64 duration; /* In microseconds */
+} WalkItem;
+
+/* Called for each file, possibly from a worker thread. On failure this
+ * must set error, and the message will be printed by the walker. */
+typedef gboolean (*WalkFileFunc) (WalkItem *item, gpointer user_data, GError **error);
+
+typedef struct Walker Walker;
+
+Walker *walker_new (int n_jobs, WalkFileFunc func, gpointer user_data);
+void walker_set_root_data (Walker *walker, gpointer root_data);
+void walker_walk (Walker *walker, const char *path, const char *relative_to,
+                  const char *destination_dir, gboolean toplevel);
+void walker_walk_file (Walker *walker, const char *path, const char *relative_to,
+                       const char *destination_dir);
+void walker_add_error (Walker *walker, GError *error);
+gboolean walker_finish (Walker *walker);
+void walker_free (Walker *walker);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (Walker, walker_free)
@@ -0,0 +1,428 @@
+/*
+ * Copyright © 2023 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+#include "config.h"
+
+#include "main.h"
+#include "watch.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+/* Files are reported when written and closed, or moved in, symlinks
+ * when created; directories when they are created or moved in */
+#define WATCH_MASK \
+  (IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_TO | IN_DONT_FOLLOW | IN_ONLYDIR | IN_EXCL_UNLINK)
+
+typedef struct
+{
+  char *path;
+  gpointer root_data;
+} WatchRoot;
+
+/* A watched directory. For a file given to watch_add() this is its
+ * parent, and only events for the file (and its signature) count. */
+typedef struct
+{
+  char *path;
+  char *only_name;
+  WatchRoot *root;
+} WatchDir;
+
+struct Watch
+{
+  int fd;
+  GHashTable *dirs;    /* wd -> WatchDir */
+  GPtrArray *roots;    /* WatchRoot */
+  GHashTable *pending; /* path -> root_data, changes not yet reported */
+  gboolean added;      /* A path was added to pending by the last events */
+};
+
+static void
+watch_root_free (WatchRoot *root)
+{
+  g_free (root->path);
+  g_free (root);
+}
+
+static void
+watch_dir_free (WatchDir *dir)
+{
+  g_free (dir->path);
+  g_free (dir->only_name);
+  g_free (dir);
+}
+
+Watch *
+watch_new (GError **error)
+{
+  int fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+  if (fd < 0)
+    {
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                   "Can't initialize inotify: %s", strerror (errno));
+      return NULL;
+    }
+
+  Watch *watch = g_new0 (Watch, 1);
+  watch->fd = fd;
+  watch->dirs = g_hash_table_new_full (NULL, NULL, NULL, (GDestroyNotify)watch_dir_free);
+  watch->roots = g_ptr_array_new_with_free_func ((GDestroyNotify)watch_root_free);
+  watch->pending = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  return watch;
+}
+
+void
+watch_free (Watch *watch)
+{
+  close (watch->fd);
+  g_hash_table_unref (watch->dirs);
+  g_ptr_array_unref (watch->roots);
+  g_hash_table_unref (watch->pending);
+  g_free (watch);
+}
+
+static gboolean
+watch_add_dir (Watch *watch, const char *path, const char *only_name, WatchRoot *root,
+               GError **error)
+{
+  int wd = inotify_add_watch (watch->fd, path, WATCH_MASK);
+  if (wd < 0)
+    {
+      if (errno == ENOSPC)
+        g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_NOSPC,
+                     "Can't watch '%s': Too many watches, see fs.inotify.max_user_watches",
+                     path);
+      else
+        g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                     "Can't watch '%s': %s", path, strerror (errno));
+      return FALSE;
+    }
+
+  /* A directory that was moved keeps its watch, with the new path */
+  WatchDir *dir = g_new0 (WatchDir, 1);
+  dir->path = g_strdup (path);
+  dir->only_name = g_strdup (only_name);
+  dir->root = root;
+  g_hash_table_replace (watch->dirs, GINT_TO_POINTER (wd), dir);
+
+  return TRUE;
+}
+
+/* Watches path and all directories below it, without following symlinks */
+static gboolean
+watch_add_tree (Watch *watch, const char *path, WatchRoot *root, GError **error)
+{
+  g_autoptr (GPtrArray) stack = g_ptr_array_new_with_free_func (g_free);
+  g_ptr_array_add (stack, g_strdup (path));
+
+  while (stack->len > 0)
+    {
+      g_autofree char *dir_path = g_strdup (g_ptr_array_index (stack, stack->len - 1));
+      g_ptr_array_remove_index (stack, stack->len - 1);
+
+      if (!watch_add_dir (watch, dir_path, NULL, root, error))
+        return FALSE;
+
+      DIR *stream = opendir (dir_path);
+      if (stream == NULL)
+        {
+          /* Removed since, there is nothing to watch */
+          if (errno == ENOENT || errno == ENOTDIR)
+            continue;
+
+          g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                       "Can't open directory '%s': %s", dir_path, strerror (errno));
+          return FALSE;
+        }
+
+      struct dirent *dirent;
+      while ((dirent = readdir (stream)) != NULL)
+        {
+          const char *name = dirent->d_name;
+          if (strcmp (name, ".") == 0 || strcmp (name, "..") == 0)
+            continue;
+
+          g_autofree char *child = g_build_filename (dir_path, name, NULL);
+          struct stat st;
+          if (dirent->d_type == DT_DIR
+              || (dirent->d_type == DT_UNKNOWN && lstat (child, &st) == 0 && S_ISDIR (st.st_mode)))
+            g_ptr_array_add (stack, g_steal_pointer (&child));
+        }
+      closedir (stream);
+    }
+
+  return TRUE;
+}
+
+/* Watches a directory tree, or a single file, for changes. Changes
+ * to a file's signature are reported as changes to the file. */
+gboolean
+watch_add (Watch *watch, const char *path, gpointer root_data, GError **error)
+{
+  struct stat st;
+  if (lstat (path, &st) < 0)
+    {
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno), "Can't watch '%s': %s",
+                   path, strerror (errno));
+      return FALSE;
+    }
+
+  WatchRoot *root = g_new0 (WatchRoot, 1);
+  root->path = g_strdup (path);
+  root->root_data = root_data;
+  g_ptr_array_add (watch->roots, root);
+
+  if (S_ISDIR (st.st_mode))
+    return watch_add_tree (watch, path, root, error);
+
+  g_autofree char *dirname = g_path_get_dirname (path);
+  g_autofree char *basename = g_path_get_basename (path);
+  return watch_add_dir (watch, dirname, basename, root, error);
+}
+
+static void
+watch_add_pending (Watch *watch, char *path, gpointer root_data)
+{
+  if (g_hash_table_contains (watch->pending, path))
+    {
+      g_free (path);
+      return;
+    }
+
+  g_hash_table_insert (watch->pending, path, root_data);
+  watch->added = TRUE;
+}
+
+static void
+watch_handle_event (Watch *watch, const struct inotify_event *event)
+{
+  if (event->mask & IN_Q_OVERFLOW)
+    {
+      /* Events were lost, so everything may have changed */
+      g_info ("Watch queue overflowed, rescanning all sources");
+      for (guint i = 0; i < watch->roots->len; i++)
+        {
+          WatchRoot *root = g_ptr_array_index (watch->roots, i);
+          watch_add_pending (watch, g_strdup (root->path), root->root_data);
+        }
+      return;
+    }
+
+  WatchDir *dir = g_hash_table_lookup (watch->dirs, GINT_TO_POINTER (event->wd));
+  if (dir == NULL)
+    return;
+
+  if (event->mask & IN_IGNORED)
+    {
+      g_hash_table_remove (watch->dirs, GINT_TO_POINTER (event->wd));
+      return;
+    }
+
+  if (event->len == 0 || event->name[0] == 0)
+    return;
+
+  g_autofree char *name = NULL;
+  if (g_str_has_suffix (event->name, ".sig"))
+    name = g_strndup (event->name, strlen (event->name) - strlen (".sig"));
+  else
+    name = g_strdup (event->name);
+
+  if (dir->only_name && strcmp (name, dir->only_name) != 0)
+    return;
+
+  if (*name == 0)
+    return;
+
+  g_autofree char *path = g_build_filename (dir->path, name, NULL);
+
+  /* A new regular file is reported when it is closed after writing */
+  if ((event->mask & (IN_CREATE | IN_ISDIR)) == IN_CREATE)
+    {
+      g_autofree char *event_path = g_build_filename (dir->path, event->name, NULL);
+      struct stat st;
+      if (lstat (event_path, &st) == 0 && S_ISREG (st.st_mode))
+        return;
+    }
+
+  if (event->mask & IN_ISDIR)
+    {
+      if (dir->only_name)
+        return;
+
+      /* The whole new directory is walked, so only events after the
+       * watch is added matter */
+      g_autoptr (GError) error = NULL;
+      if (!watch_add_tree (watch, path, dir->root, &error))
+        g_printerr ("%s\n", error->message);
+    }
+  else if (strcmp (name, VALIDATOR_MANIFEST_NAME) == 0
+           || strcmp (name, VALIDATOR_SIGPACK_NAME) == 0)
+    {
+      /* The manifest covers everything below its directory, and a
+       * signature pack the files in it */
+      g_clear_pointer (&path, g_free);
+      path = g_strdup (dir->path);
+    }
+
+  watch_add_pending (watch, g_steal_pointer (&path), dir->root->root_data);
+}
+
+static gboolean
+watch_read_events (Watch *watch, GError **error)
+{
+  char buf[16 * 1024] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+
+  while (TRUE)
+    {
+      gssize len = read (watch->fd, buf, sizeof (buf));
+      if (len < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          if (errno == EAGAIN)
+            return TRUE;
+
+          g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                       "Can't read inotify events: %s", strerror (errno));
+          return FALSE;
+        }
+
+      for (char *p = buf; p < buf + len;)
+        {
+          const struct inotify_event *event = (const struct inotify_event *)p;
+          watch_handle_event (watch, event);
+          p += sizeof (struct inotify_event) + event->len;
+        }
+    }
+}
+
+static int
+compare_changes (gconstpointer a, gconstpointer b)
+{
+  const WatchChange *change_a = *(const WatchChange **)a;
+  const WatchChange *change_b = *(const WatchChange **)b;
+
+  return strcmp (change_a->path, change_b->path);
+}
+
+static void
+watch_change_free (WatchChange *change)
+{
+  g_free (change->path);
+  g_free (change);
+}
+
+/* A change below a directory that changed is covered by walking it */
+static gboolean
+watch_change_is_covered (Watch *watch, const char *path)
+{
+  g_autofree char *parent = g_path_get_dirname (path);
+
+  while (strcmp (parent, "/") != 0 && strcmp (parent, ".") != 0)
+    {
+      if (g_hash_table_contains (watch->pending, parent))
+        return TRUE;
+
+      char *next = g_path_get_dirname (parent);
+      g_free (parent);
+      parent = next;
+    }
+
+  return FALSE;
+}
+
+/* Blocks until something changed, and returns the changes (WatchChange)
+ * once no new change arrived for WATCH_COALESCE_MSEC, or at most
+ * WATCH_MAX_DELAY_MSEC after the first one. Events for changes that
+ * are already pending, or that are ignored, don't delay them. */
+GPtrArray *
+watch_wait (Watch *watch, GError **error)
+{
+  gint64 first_added = 0;
+  gint64 last_added = 0;
+
+  while (TRUE)
+    {
+      struct pollfd pollfd = { watch->fd, POLLIN, 0 };
+      int timeout = -1;
+
+      if (g_hash_table_size (watch->pending) > 0)
+        {
+          gint64 deadline = MIN (last_added + WATCH_COALESCE_MSEC * 1000,
+                                 first_added + WATCH_MAX_DELAY_MSEC * 1000);
+          gint64 now = g_get_monotonic_time ();
+          if (now >= deadline)
+            break; /* Quiet for long enough, or waited long enough */
+
+          timeout = (deadline - now + 999) / 1000;
+        }
+
+      int res = poll (&pollfd, 1, timeout);
+      if (res < 0)
+        {
+          if (errno == EINTR)
+            continue;
+
+          g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                       "Can't poll inotify: %s", strerror (errno));
+          return NULL;
+        }
+
+      if (res == 0)
+        continue; /* The deadline is checked above */
+
+      watch->added = FALSE;
+      if (!watch_read_events (watch, error))
+        return NULL;
+
+      if (watch->added)
+        {
+          last_added = g_get_monotonic_time ();
+          if (first_added == 0)
+            first_added = last_added;
+        }
+    }
+
+  GPtrArray *changes = g_ptr_array_new_with_free_func ((GDestroyNotify)watch_change_free);
+
+  GHashTableIter iter;
+  gpointer key, value;
+  g_hash_table_iter_init (&iter, watch->pending);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      if (watch_change_is_covered (watch, key))
+        continue;
+
+      WatchChange *change = g_new0 (WatchChange, 1);
+      change->path = g_strdup (key);
+      change->root_data = value;
+      g_ptr_array_add (changes, change);
+    }
+  g_hash_table_remove_all (watch->pending);
+
+  g_ptr_array_sort (changes, compare_changes);
+
+  return changes;
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright © 2023 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+#include <glib.h>
+
+/* How long a change has to be quiet before it is reported, so that a
+ * file and its signature landing together give one change */
+#define WATCH_COALESCE_MSEC 200
+
+/* The longest a change waits for the others to be quiet, so a file
+ * that keeps changing doesn't hold back the other changes forever */
+#define WATCH_MAX_DELAY_MSEC 2000
+
+typedef struct
+{
+  char *path;         /* The changed file, or directory to walk again */
+  gpointer root_data; /* From watch_add() */
+} WatchChange;
+
+typedef struct Watch Watch;
+
+Watch *watch_new (GError **error);
+gboolean watch_add (Watch *watch, const char *path, gpointer root_data, GError **error);
+GPtrArray *watch_wait (Watch *watch, GError **error);
+void watch_free (Watch *watch);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (Watch, watch_free)